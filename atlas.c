@@ -0,0 +1,149 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "atlas.h"
+
+// Skyline bottom-left packing, as described in Jukka Jylänki's "A Thousand
+// Ways to Pack the Bin". The skyline is the top edge of everything placed so
+// far, kept as a list of horizontal segments from left to right. Each
+// rectangle goes where its top ends up lowest, leftmost on ties.
+typedef struct skyline_segment_s {
+  uint32_t x;
+  uint32_t y;
+  uint32_t width;
+} skyline_segment_t;
+
+// Height the rectangle would sit at if its left edge were at segment i, or
+// UINT32_MAX if it doesn't fit there
+static uint32_t skyline_fit(const skyline_segment_t* skyline, size_t i, uint32_t width, uint32_t height, uint32_t atlas_width, uint32_t atlas_height) {
+  if (skyline[i].x + width > atlas_width) {
+    return UINT32_MAX;
+  }
+  uint32_t y = 0;
+  uint32_t covered = 0;
+  for (; covered < width; i++) {
+    if (skyline[i].y > y) {
+      y = skyline[i].y;
+    }
+    covered += skyline[i].width;
+  }
+  if (y + height > atlas_height) {
+    return UINT32_MAX;
+  }
+  return y;
+}
+
+static int skyline_pack(atlas_rect_t* rects, const size_t* order, size_t count, uint32_t atlas_width, uint32_t atlas_height) {
+  // Every placement adds at most one segment
+  skyline_segment_t* skyline = malloc((count + 1) * sizeof(skyline_segment_t));
+  size_t segment_count = 1;
+  skyline[0] = (skyline_segment_t) {0, 0, atlas_width};
+  for (size_t r = 0; r < count; r++) {
+    atlas_rect_t* rect = &rects[order[r]];
+    size_t best = SIZE_MAX;
+    uint32_t best_y = UINT32_MAX;
+    for (size_t i = 0; i < segment_count; i++) {
+      uint32_t y = skyline_fit(skyline, i, rect->width, rect->height, atlas_width, atlas_height);
+      if (y < best_y) {
+        best_y = y;
+        best = i;
+      }
+    }
+    if (best == SIZE_MAX) {
+      free(skyline);
+      return 0;
+    }
+    rect->x = skyline[best].x;
+    rect->y = best_y;
+
+    // Replace the segments under the rectangle with its top edge, splitting
+    // the last one if the rectangle ends partway through it
+    uint32_t right = rect->x + rect->width;
+    size_t end = best;
+    while (end < segment_count && skyline[end].x + skyline[end].width <= right) {
+      end++;
+    }
+    skyline_segment_t top = {rect->x, best_y + rect->height, rect->width};
+    if (end < segment_count && skyline[end].x < right) {
+      uint32_t cut = right - skyline[end].x;
+      skyline[end].x += cut;
+      skyline[end].width -= cut;
+    }
+    memmove(&skyline[best + 1], &skyline[end], (segment_count - end) * sizeof(skyline_segment_t));
+    segment_count -= end - best - 1;
+    skyline[best] = top;
+
+    // Merge neighbours at the same height
+    size_t merged = 0;
+    for (size_t i = 1; i < segment_count; i++) {
+      if (skyline[i].y == skyline[merged].y) {
+        skyline[merged].width += skyline[i].width;
+      } else {
+        skyline[++merged] = skyline[i];
+      }
+    }
+    segment_count = merged + 1;
+  }
+  free(skyline);
+  return 1;
+}
+
+static const atlas_rect_t* sort_rects;
+
+static int compare_rect_order(const void* a, const void* b) {
+  const atlas_rect_t* ra = &sort_rects[*(const size_t*) a];
+  const atlas_rect_t* rb = &sort_rects[*(const size_t*) b];
+  if (ra->height != rb->height) {
+    return ra->height < rb->height ? 1 : -1;
+  }
+  if (ra->width != rb->width) {
+    return ra->width < rb->width ? 1 : -1;
+  }
+  // Keep the input order otherwise so the layout is deterministic
+  return *(const size_t*) a < *(const size_t*) b ? -1 : 1;
+}
+
+// Places every rectangle in the smallest power of two atlas, trying square
+// shapes before 2:1 ones of the same area. Returns 0 if nothing up to
+// max_size by max_size fits.
+int pack_atlas(atlas_rect_t* rects, size_t count, uint32_t max_size, uint32_t* width, uint32_t* height) {
+  uint64_t area = 0;
+  uint32_t max_width = 1;
+  uint32_t max_height = 1;
+  for (size_t i = 0; i < count; i++) {
+    area += (uint64_t) rects[i].width * rects[i].height;
+    if (rects[i].width > max_width) max_width = rects[i].width;
+    if (rects[i].height > max_height) max_height = rects[i].height;
+  }
+
+  size_t* order = malloc(count * sizeof(size_t));
+  for (size_t i = 0; i < count; i++) {
+    order[i] = i;
+  }
+  sort_rects = rects;
+  qsort(order, count, sizeof(size_t), compare_rect_order);
+
+  for (uint32_t size = 1; size <= max_size; size *= 2) {
+    uint32_t shapes[3][2] = {
+      {size / 2, size},
+      {size, size / 2},
+      {size, size}
+    };
+    for (int s = 0; s < 3; s++) {
+      uint32_t w = shapes[s][0];
+      uint32_t h = shapes[s][1];
+      if (w < max_width || h < max_height || (uint64_t) w * h < area) {
+        continue;
+      }
+      if (skyline_pack(rects, order, count, w, h)) {
+        *width = w;
+        *height = h;
+        free(order);
+        return 1;
+      }
+    }
+  }
+  free(order);
+  return 0;
+}
@@ -0,0 +1,12 @@
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct atlas_rect_s {
+  uint32_t width;
+  uint32_t height;
+  // Filled in by pack_atlas
+  uint32_t x;
+  uint32_t y;
+} atlas_rect_t;
+
+int pack_atlas(atlas_rect_t* rects, size_t count, uint32_t max_size, uint32_t* width, uint32_t* height);
@@ -0,0 +1,149 @@
+#include <stdint.h>
+#include <stddef.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define BASE64_X86 1
+#endif
+
+#include "base64.h"
+#include "simd.h"
+
+static const char base64_table[64] = {
+  'A', 'B', 'C', 'D', 'E', 'F', 'G', 'H',
+  'I', 'J', 'K', 'L', 'M', 'N', 'O', 'P',
+  'Q', 'R', 'S', 'T', 'U', 'V', 'W', 'X',
+  'Y', 'Z', 'a', 'b', 'c', 'd', 'e', 'f',
+  'g', 'h', 'i', 'j', 'k', 'l', 'm', 'n',
+  'o', 'p', 'q', 'r', 's', 't', 'u', 'v',
+  'w', 'x', 'y', 'z', '0', '1', '2', '3',
+  '4', '5', '6', '7', '8', '9', '+', '/'
+};
+
+// Number of characters needed to encode size bytes, including padding but not
+// the NUL terminator
+size_t base64_encoded_size(size_t size) {
+  return 4 * ((size + 2) / 3);
+}
+
+// Encodes whole 3-byte groups starting at bytes[i]. Returns the index of the
+// first byte that wasn't consumed.
+static size_t base64_encode_scalar(char* out, const uint8_t* bytes, size_t size, size_t i) {
+  for (; i + 3 <= size; i += 3) {
+    char* o = &out[4 * (i / 3)];
+    o[0] = base64_table[bytes[i + 0] >> 2];
+    o[1] = base64_table[((bytes[i + 0] & 0x03) << 4) | (bytes[i + 1] >> 4)];
+    o[2] = base64_table[((bytes[i + 1] & 0x0f) << 2) | (bytes[i + 2] >> 6)];
+    o[3] = base64_table[bytes[i + 2] & 0x3f];
+  }
+  return i;
+}
+
+#ifdef BASE64_X86
+// The vector kernels follow Wojciech Muła's "Base64 encoding with SIMD
+// instructions": shuffle each 3-byte group into a 32-bit lane, split it into
+// four 6-bit indices with two multiplies, then map indices to ASCII by adding a
+// per-range offset picked with pshufb.
+
+__attribute__((target("ssse3")))
+static __m128i base64_indices_ssse3(__m128i in) {
+  in = _mm_shuffle_epi8(in, _mm_set_epi8(
+    10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1));
+  __m128i t0 = _mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00));
+  __m128i t1 = _mm_mulhi_epu16(t0, _mm_set1_epi32(0x04000040));
+  __m128i t2 = _mm_and_si128(in, _mm_set1_epi32(0x003f03f0));
+  __m128i t3 = _mm_mullo_epi16(t2, _mm_set1_epi32(0x01000010));
+  return _mm_or_si128(t1, t3);
+}
+
+__attribute__((target("ssse3")))
+static __m128i base64_ascii_ssse3(__m128i indices) {
+  const __m128i offsets = _mm_setr_epi8(
+    'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+    '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62,
+    '/' - 63, 'A', 0, 0);
+  // 0..25 -> 13, 26..51 -> 0, 52..61 -> 1..10, 62 -> 11, 63 -> 12
+  __m128i range = _mm_subs_epu8(indices, _mm_set1_epi8(51));
+  __m128i less = _mm_cmpgt_epi8(_mm_set1_epi8(26), indices);
+  range = _mm_or_si128(range, _mm_and_si128(less, _mm_set1_epi8(13)));
+  return _mm_add_epi8(_mm_shuffle_epi8(offsets, range), indices);
+}
+
+__attribute__((target("ssse3")))
+static size_t base64_encode_ssse3(char* out, const uint8_t* bytes, size_t size) {
+  size_t i = 0;
+  // Each iteration consumes 12 bytes but loads 16
+  for (; i + 16 <= size; i += 12) {
+    __m128i in = _mm_loadu_si128((const __m128i*) &bytes[i]);
+    __m128i encoded = base64_ascii_ssse3(base64_indices_ssse3(in));
+    _mm_storeu_si128((__m128i*) &out[4 * (i / 3)], encoded);
+  }
+  return i;
+}
+
+__attribute__((target("avx2")))
+static size_t base64_encode_avx2(char* out, const uint8_t* bytes, size_t size) {
+  const __m256i shuffle = _mm256_set_epi8(
+    10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1,
+    10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1);
+  const __m256i offsets = _mm256_setr_epi8(
+    'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+    '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62,
+    '/' - 63, 'A', 0, 0,
+    'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+    '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62,
+    '/' - 63, 'A', 0, 0);
+  size_t i = 0;
+  // Each iteration consumes 24 bytes, 12 per 128-bit lane. The upper lane
+  // loads 16 bytes starting at i + 12.
+  for (; i + 28 <= size; i += 24) {
+    __m128i lo = _mm_loadu_si128((const __m128i*) &bytes[i]);
+    __m128i hi = _mm_loadu_si128((const __m128i*) &bytes[i + 12]);
+    __m256i in = _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
+    in = _mm256_shuffle_epi8(in, shuffle);
+    __m256i t0 = _mm256_and_si256(in, _mm256_set1_epi32(0x0fc0fc00));
+    __m256i t1 = _mm256_mulhi_epu16(t0, _mm256_set1_epi32(0x04000040));
+    __m256i t2 = _mm256_and_si256(in, _mm256_set1_epi32(0x003f03f0));
+    __m256i t3 = _mm256_mullo_epi16(t2, _mm256_set1_epi32(0x01000010));
+    __m256i indices = _mm256_or_si256(t1, t3);
+    __m256i range = _mm256_subs_epu8(indices, _mm256_set1_epi8(51));
+    __m256i less = _mm256_cmpgt_epi8(_mm256_set1_epi8(26), indices);
+    range = _mm256_or_si256(range, _mm256_and_si256(less, _mm256_set1_epi8(13)));
+    __m256i encoded = _mm256_add_epi8(_mm256_shuffle_epi8(offsets, range), indices);
+    _mm256_storeu_si256((__m256i*) &out[4 * (i / 3)], encoded);
+  }
+  return i;
+}
+#endif
+
+// Writes the base64 encoding of bytes into out, which must have room for
+// base64_encoded_size(size) + 1 characters. The output is NUL terminated.
+// Returns the number of characters written, not counting the terminator.
+size_t base64_encode_into(char* out, const uint8_t* bytes, size_t size) {
+  size_t i = 0;
+#ifdef BASE64_X86
+  if (simd_limit >= SIMD_256 && __builtin_cpu_supports("avx2")) {
+    i = base64_encode_avx2(out, bytes, size);
+  } else if (simd_limit >= SIMD_128 && __builtin_cpu_supports("ssse3")) {
+    i = base64_encode_ssse3(out, bytes, size);
+  }
+#endif
+  i = base64_encode_scalar(out, bytes, size, i);
+
+  char* tail = &out[4 * (i / 3)];
+  if (size - i == 1) {
+    tail[0] = base64_table[bytes[i] >> 2];
+    tail[1] = base64_table[(bytes[i] & 0x03) << 4];
+    tail[2] = '=';
+    tail[3] = '=';
+    tail += 4;
+  } else if (size - i == 2) {
+    tail[0] = base64_table[bytes[i] >> 2];
+    tail[1] = base64_table[((bytes[i] & 0x03) << 4) | (bytes[i + 1] >> 4)];
+    tail[2] = base64_table[(bytes[i + 1] & 0x0f) << 2];
+    tail[3] = '=';
+    tail += 4;
+  }
+  *tail = '\0';
+  return tail - out;
+}
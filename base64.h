@@ -0,0 +1,5 @@
+#include <stddef.h>
+#include <stdint.h>
+
+size_t base64_encoded_size(size_t size);
+size_t base64_encode_into(char* out, const uint8_t* bytes, size_t size);
@@ -0,0 +1,447 @@
+#include <float.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#include "base64.h"
+#include "matrix.h"
+#include "simd.h"
+
+// Throughput of the vector kernels at each width the CPU supports, against
+// their scalar fallbacks. Each width's output is checked against the scalar
+// output first, so a fast but wrong kernel fails instead of winning.
+
+static const char* simd_names[] = { "scalar", "128-bit", "256-bit" };
+
+static int simd_supported(int level) {
+#if defined(__x86_64__) || defined(__i386__)
+  if (level == SIMD_256) {
+    return __builtin_cpu_supports("avx2");
+  }
+  if (level == SIMD_128) {
+    return __builtin_cpu_supports("ssse3") && __builtin_cpu_supports("sse4.1");
+  }
+  return 1;
+#elif defined(__ARM_NEON)
+  return level <= SIMD_128;
+#else
+  return level == SIMD_SCALAR;
+#endif
+}
+
+static double seconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void fill_random(void* buffer, size_t size) {
+  uint8_t* bytes = buffer;
+  uint32_t state = 0x2545f491;
+  for (size_t i = 0; i < size; i++) {
+    state = state * 1664525 + 1013904223;
+    bytes[i] = state >> 24;
+  }
+}
+
+#define BASE64_SIZE (64 << 20)
+
+static int bench_base64() {
+  uint8_t* bytes = malloc(BASE64_SIZE);
+  char* expected = malloc(base64_encoded_size(BASE64_SIZE) + 1);
+  char* out = malloc(base64_encoded_size(BASE64_SIZE) + 1);
+  fill_random(bytes, BASE64_SIZE);
+  simd_limit = SIMD_SCALAR;
+  base64_encode_into(expected, bytes, BASE64_SIZE);
+  int failed = 0;
+  for (int level = SIMD_SCALAR; level <= SIMD_256; level++) {
+    if (!simd_supported(level)) {
+      printf("base64 %-8s not supported\n", simd_names[level]);
+      continue;
+    }
+    simd_limit = level;
+    // Every length up to 300 covers each kernel's tail handling
+    for (size_t size = 0; size <= 300; size++) {
+      base64_encode_into(out, bytes, size);
+      simd_limit = SIMD_SCALAR;
+      base64_encode_into(expected, bytes, size);
+      simd_limit = level;
+      if (strcmp(out, expected) != 0) {
+        printf("base64 %-8s differs from scalar at %zu bytes\n", simd_names[level], size);
+        failed = 1;
+      }
+    }
+    double best = 1e9;
+    for (int run = 0; run < 5; run++) {
+      double start = seconds();
+      base64_encode_into(out, bytes, BASE64_SIZE);
+      double elapsed = seconds() - start;
+      best = elapsed < best ? elapsed : best;
+    }
+    printf("base64 %-8s %6.2f GB/s\n", simd_names[level], BASE64_SIZE / best / 1e9);
+  }
+  simd_limit = SIMD_256;
+  free(bytes);
+  free(expected);
+  free(out);
+  return failed;
+}
+
+#define VERTEX_COUNT (1 << 20)
+
+// The scale rip_model converts with, flipping x and y
+static const float vertex_scale[3] = { -1.0 / 4096.0, -1.0 / 4096.0, 1.0 / 4096.0 };
+
+// Converts count vertices at the current simd_limit, returning whether the
+// floats and bounds match expected exactly
+static int vertices_match(float* out, const vertex_t* vertices, size_t count, const float* expected, const float* expected_bounds) {
+  float bounds[6] = { INFINITY, INFINITY, INFINITY, -INFINITY, -INFINITY, -INFINITY };
+  vertices_to_floats(out, &bounds[0], &bounds[3], vertices, count, vertex_scale);
+  return memcmp(out, expected, 3 * count * sizeof(float)) == 0 &&
+    memcmp(bounds, expected_bounds, sizeof(bounds)) == 0;
+}
+
+static int bench_vertices() {
+  vertex_t* vertices = malloc(VERTEX_COUNT * sizeof(vertex_t));
+  float* expected = malloc(3 * VERTEX_COUNT * sizeof(float));
+  float* out = malloc(3 * VERTEX_COUNT * sizeof(float));
+  fill_random(vertices, VERTEX_COUNT * sizeof(vertex_t));
+  int failed = 0;
+  for (int level = SIMD_SCALAR; level <= SIMD_256; level++) {
+    if (!simd_supported(level)) {
+      printf("vertices_to_floats %-8s not supported\n", simd_names[level]);
+      continue;
+    }
+    // Lengths around the kernels' 8 and 16 vertex blocks exercise the tails
+    for (size_t count = 0; count <= 40; count++) {
+      float expected_bounds[6] = { INFINITY, INFINITY, INFINITY, -INFINITY, -INFINITY, -INFINITY };
+      simd_limit = SIMD_SCALAR;
+      vertices_to_floats(expected, &expected_bounds[0], &expected_bounds[3], vertices, count, vertex_scale);
+      simd_limit = level;
+      if (!vertices_match(out, vertices, count, expected, expected_bounds)) {
+        printf("vertices_to_floats %-8s differs from scalar at %zu vertices\n", simd_names[level], count);
+        failed = 1;
+      }
+    }
+    double best = 1e9;
+    for (int run = 0; run < 10; run++) {
+      float bounds[6] = { INFINITY, INFINITY, INFINITY, -INFINITY, -INFINITY, -INFINITY };
+      double start = seconds();
+      vertices_to_floats(out, &bounds[0], &bounds[3], vertices, VERTEX_COUNT, vertex_scale);
+      double elapsed = seconds() - start;
+      best = elapsed < best ? elapsed : best;
+    }
+    printf("vertices_to_floats %-8s %6.2f ns/vertex\n", simd_names[level], best / VERTEX_COUNT * 1e9);
+  }
+  simd_limit = SIMD_256;
+  free(vertices);
+  free(expected);
+  free(out);
+  return failed;
+}
+
+#define MATRIX_COUNT ((1 << 20) + 5)
+
+// Largest differences decompose_matrices may show against its scalar path,
+// which divides by sqrtf where the vector kernels refine an approximate
+// reciprocal square root: scales within 4 float ulps, relative to the scale
+// or to 1 below it, rotations within 2e-6 radians, and quaternion lengths
+// within 4 ulps of 1. The kernels measure about half of each.
+#define DECOMPOSE_SCALE_ERROR (4 * FLT_EPSILON)
+#define DECOMPOSE_ANGLE_ERROR 2e-6
+#define DECOMPOSE_LENGTH_ERROR (4 * FLT_EPSILON)
+
+// Fills count SoA 4.12 matrices. Most are rotations, scaled along each axis
+// by 0.25 to 1.75 or not at all, every fourth has random elements, and some
+// are zero or have a single non-zero element, to cover each branch of the
+// quaternion extraction and degenerate input.
+static void fill_matrices(int16_t* elements, size_t count) {
+  uint32_t state = 0x6b43a9b5;
+  for (size_t i = 0; i < count; i++) {
+    double random[8];
+    for (int r = 0; r < 8; r++) {
+      state = state * 1664525 + 1013904223;
+      random[r] = state / 4294967296.0;
+    }
+    int16_t m[9];
+    if (i % 4 == 3) {
+      for (int e = 0; e < 9; e++) {
+        state = state * 1664525 + 1013904223;
+        m[e] = state >> 16;
+      }
+    } else if (i % 97 == 0) {
+      memset(m, 0, sizeof(m));
+      m[4] = i % 2 ? 4096 : 0;
+    } else {
+      double q[4];
+      double length = 0;
+      for (int c = 0; c < 4; c++) {
+        q[c] = random[c] * 2 - 1;
+        length += q[c] * q[c];
+      }
+      length = sqrt(length);
+      double w = q[0] / length, x = q[1] / length, y = q[2] / length, z = q[3] / length;
+      double r[9] = {
+        1 - 2 * (y * y + z * z), 2 * (x * y - z * w), 2 * (x * z + y * w),
+        2 * (x * y + z * w), 1 - 2 * (x * x + z * z), 2 * (y * z - x * w),
+        2 * (x * z - y * w), 2 * (y * z + x * w), 1 - 2 * (x * x + y * y)
+      };
+      for (int e = 0; e < 9; e++) {
+        double scale = i % 3 == 0 ? 1 : 0.25 + 1.5 * random[4 + e % 3];
+        m[e] = lrint(r[e] * scale * 4096);
+      }
+    }
+    for (int e = 0; e < 9; e++) {
+      elements[e * count + i] = m[e];
+    }
+  }
+}
+
+static int bench_decompose() {
+  int16_t* elements = malloc(9 * MATRIX_COUNT * sizeof(int16_t));
+  float* expected_scales = malloc(3 * MATRIX_COUNT * sizeof(float));
+  float* expected_quaternions = malloc(4 * MATRIX_COUNT * sizeof(float));
+  float* scales = malloc(3 * MATRIX_COUNT * sizeof(float));
+  float* quaternions = malloc(4 * MATRIX_COUNT * sizeof(float));
+  fill_matrices(elements, MATRIX_COUNT);
+  simd_limit = SIMD_SCALAR;
+  decompose_matrices(elements, MATRIX_COUNT, expected_scales, expected_quaternions);
+  int failed = 0;
+  for (int level = SIMD_SCALAR; level <= SIMD_256; level++) {
+    if (!simd_supported(level)) {
+      printf("decompose_matrices %-8s not supported\n", simd_names[level]);
+      continue;
+    }
+    simd_limit = level;
+    // MATRIX_COUNT isn't a multiple of 8, so the scalar tail runs too
+    decompose_matrices(elements, MATRIX_COUNT, scales, quaternions);
+    double scale_error = 0;
+    double angle_error = 0;
+    double length_error = 0;
+    for (size_t i = 0; i < MATRIX_COUNT; i++) {
+      for (int c = 0; c < 3; c++) {
+        double expected = expected_scales[c * MATRIX_COUNT + i];
+        double error = fabs(scales[c * MATRIX_COUNT + i] - expected) / fmax(fabs(expected), 1);
+        scale_error = fmax(scale_error, error);
+      }
+      // q and -q are the same rotation, which turns by 4 asin(|q - q'| / 2)
+      // relative to q'
+      double dot = 0;
+      double length = 0;
+      for (int c = 0; c < 4; c++) {
+        dot += (double) quaternions[c * MATRIX_COUNT + i] * expected_quaternions[c * MATRIX_COUNT + i];
+        length += (double) quaternions[c * MATRIX_COUNT + i] * quaternions[c * MATRIX_COUNT + i];
+      }
+      length = sqrt(length);
+      double difference = 0;
+      for (int c = 0; c < 4; c++) {
+        double d = quaternions[c * MATRIX_COUNT + i] / length - (dot < 0 ? -1 : 1) * expected_quaternions[c * MATRIX_COUNT + i];
+        difference += d * d;
+      }
+      angle_error = fmax(angle_error, 4 * asin(fmin(1, sqrt(difference) / 2)));
+      length_error = fmax(length_error, fabs(length - 1));
+    }
+    if (scale_error > DECOMPOSE_SCALE_ERROR || angle_error > DECOMPOSE_ANGLE_ERROR || length_error > DECOMPOSE_LENGTH_ERROR) {
+      printf("decompose_matrices %-8s strays from scalar\n", simd_names[level]);
+      failed = 1;
+    }
+    double best = 1e9;
+    for (int run = 0; run < 10; run++) {
+      double start = seconds();
+      decompose_matrices(elements, MATRIX_COUNT, scales, quaternions);
+      double elapsed = seconds() - start;
+      best = elapsed < best ? elapsed : best;
+    }
+    printf("decompose_matrices %-8s %6.2f ns/matrix, error %.1e scale, %.1e rad, %.1e length\n",
+      simd_names[level], best / MATRIX_COUNT * 1e9, scale_error, angle_error, length_error);
+  }
+  simd_limit = SIMD_256;
+  free(elements);
+  free(expected_scales);
+  free(expected_quaternions);
+  free(scales);
+  free(quaternions);
+  return failed;
+}
+
+// RotTrans straight from the GTE's description, in 64 bits with no MAC
+// wrapping, for inputs that can't overflow 44 bits
+static uint32_t gte_reference(vertex_t* out, const vertex_t* in, size_t count, matrix_t m, const int32_t* translation) {
+  uint32_t flags = 0;
+  for (size_t i = 0; i < count; i++) {
+    int64_t v[3] = { in[i].x, in[i].y, in[i].z };
+    int16_t ir[3];
+    for (int row = 0; row < 3; row++) {
+      int64_t mac = (int64_t) translation[row] * 4096;
+      for (int k = 0; k < 3; k++) {
+        mac += m.x[3 * row + k] * v[k];
+      }
+      // An arithmetic shift, which floors
+      mac >>= 12;
+      if (mac > INT16_MAX || mac < INT16_MIN) {
+        flags |= GTE_FLAG_IR1_SATURATED >> row;
+        mac = mac > INT16_MAX ? INT16_MAX : INT16_MIN;
+      }
+      ir[row] = mac;
+    }
+    out[i] = (vertex_t) { ir[0], ir[1], ir[2] };
+  }
+  return flags & GTE_FLAG_ERRORS ? flags | GTE_FLAG_ERROR : flags;
+}
+
+static uint32_t random_state;
+
+static int32_t random_int(int64_t min, int64_t max) {
+  random_state = random_state * 1664525 + 1013904223;
+  return min + (int64_t) ((random_state >> 8) * (uint64_t) (max - min + 1) >> 24);
+}
+
+// A random 4.12 rotation, from a random unit quaternion
+static matrix_t random_rotation() {
+  double q[4];
+  double length = 0;
+  for (int c = 0; c < 4; c++) {
+    q[c] = random_int(-4096, 4096) / 4096.0;
+    length += q[c] * q[c];
+  }
+  length = sqrt(length);
+  double w = q[0] / length, x = q[1] / length, y = q[2] / length, z = q[3] / length;
+  double r[9] = {
+    1 - 2 * (y * y + z * z), 2 * (x * y - z * w), 2 * (x * z + y * w),
+    2 * (x * y + z * w), 1 - 2 * (x * x + z * z), 2 * (y * z - x * w),
+    2 * (x * z - y * w), 2 * (y * z + x * w), 1 - 2 * (x * x + y * y)
+  };
+  matrix_t m;
+  for (int e = 0; e < 9; e++) {
+    m.x[e] = lrint(r[e] * 4096);
+  }
+  return m;
+}
+
+#define GTE_DEPTH 6
+#define GTE_RANGE 2048
+
+// Largest difference allowed between posing through GTE_DEPTH levels with
+// gte_compose and RotTrans and posing with the same matrices composed in
+// double and rounded once, for rotations and vertex and translation
+// components within GTE_RANGE. Each level floors the composed rotation by
+// up to one 4.12 step per element, which moves a vertex by up to
+// sqrt(3) * |v| / 4096, and its translation by up to sqrt(3) units plus
+// sqrt(3) * |t| / 4096. Rotations carry those errors down unchanged in
+// length, and the last RotTrans and the float rounding add 1.5 more.
+#define GTE_POSE_ERROR (1.5 + GTE_DEPTH * 1.7321 * (1 + 2 * 1.7321 * GTE_RANGE / 4096))
+
+static int bench_gte() {
+  vertex_t* vertices = malloc(VERTEX_COUNT * sizeof(vertex_t));
+  vertex_t* expected = malloc(VERTEX_COUNT * sizeof(vertex_t));
+  vertex_t* out = malloc(VERTEX_COUNT * sizeof(vertex_t));
+  fill_random(vertices, VERTEX_COUNT * sizeof(vertex_t));
+  int failed = 0;
+  for (int level = SIMD_SCALAR; level <= SIMD_256; level++) {
+    if (!simd_supported(level)) {
+      printf("gte_rotate_translate %-8s not supported\n", simd_names[level]);
+      continue;
+    }
+    simd_limit = level;
+    random_state = 0x9e3779b9;
+    // Full range matrices saturate IR, and translations past 30 bits take
+    // the scalar path at every width. None overflow the 44-bit MAC.
+    for (int trial = 0; trial < 200; trial++) {
+      size_t count = trial % 41;
+      matrix_t m;
+      for (int e = 0; e < 9; e++) {
+        m.x[e] = trial % 2 ? random_int(INT16_MIN, INT16_MAX) : random_int(-4096, 4096);
+      }
+      int32_t range = trial % 3 == 0 ? INT16_MAX : trial % 3 == 1 ? 1 << 20 : INT32_MAX - (1 << 20);
+      int32_t translation[3];
+      for (int row = 0; row < 3; row++) {
+        translation[row] = random_int(-range, range);
+      }
+      uint32_t expected_flags = gte_reference(expected, vertices, count, m, translation);
+      uint32_t flags = gte_rotate_translate(out, vertices, count, m, translation);
+      if (flags != expected_flags || memcmp(out, expected, count * sizeof(vertex_t)) != 0) {
+        printf("gte_rotate_translate %-8s differs from the reference at %zu vertices\n", simd_names[level], count);
+        failed = 1;
+        break;
+      }
+    }
+    // Chains of random rotations and translations, posed in fixed point and
+    // in float
+    double pose_error = 0;
+    for (int trial = 0; trial < 200; trial++) {
+      matrix_t rotation = {{ 4096, 0, 0, 0, 4096, 0, 0, 0, 4096 }};
+      int32_t translation[3] = { 0, 0, 0 };
+      double world[12] = { 1, 0, 0, 0, 1, 0, 0, 0, 1, 0, 0, 0 };
+      for (int depth = 0; depth < GTE_DEPTH; depth++) {
+        matrix_t local = random_rotation();
+        vertex_t local_translation = {
+          random_int(-GTE_RANGE, GTE_RANGE), random_int(-GTE_RANGE, GTE_RANGE), random_int(-GTE_RANGE, GTE_RANGE)
+        };
+        gte_compose(&rotation, translation, rotation, translation, local, local_translation);
+        double t[3] = { local_translation.x, local_translation.y, local_translation.z };
+        double composed[12];
+        for (int row = 0; row < 3; row++) {
+          for (int column = 0; column < 3; column++) {
+            composed[3 * row + column] = 0;
+            for (int k = 0; k < 3; k++) {
+              composed[3 * row + column] += world[3 * row + k] * local.x[3 * k + column] / 4096.0;
+            }
+          }
+          composed[9 + row] = world[9 + row];
+          for (int k = 0; k < 3; k++) {
+            composed[9 + row] += world[3 * row + k] * t[k];
+          }
+        }
+        memcpy(world, composed, sizeof(world));
+      }
+      float transform[12];
+      for (int k = 0; k < 12; k++) {
+        transform[k] = world[k];
+      }
+      vertex_t* chain_vertices = &vertices[64 * trial];
+      for (size_t i = 0; i < 64; i++) {
+        chain_vertices[i].x = random_int(-GTE_RANGE, GTE_RANGE);
+        chain_vertices[i].y = random_int(-GTE_RANGE, GTE_RANGE);
+        chain_vertices[i].z = random_int(-GTE_RANGE, GTE_RANGE);
+      }
+      gte_rotate_translate(out, chain_vertices, 64, rotation, translation);
+      transform_vertices(expected, chain_vertices, 64, transform);
+      for (size_t i = 0; i < 64; i++) {
+        double dx = out[i].x - expected[i].x, dy = out[i].y - expected[i].y, dz = out[i].z - expected[i].z;
+        pose_error = fmax(pose_error, sqrt(dx * dx + dy * dy + dz * dz));
+      }
+    }
+    if (pose_error > GTE_POSE_ERROR) {
+      printf("gte_rotate_translate %-8s strays from the float pose\n", simd_names[level]);
+      failed = 1;
+    }
+    matrix_t m = random_rotation();
+    int32_t translation[3] = { 100, -200, 300 };
+    double best = 1e9;
+    for (int run = 0; run < 10; run++) {
+      double start = seconds();
+      gte_rotate_translate(out, vertices, VERTEX_COUNT, m, translation);
+      double elapsed = seconds() - start;
+      best = elapsed < best ? elapsed : best;
+    }
+    printf("gte_rotate_translate %-8s %6.2f ns/vertex, %.2f units from the float pose\n",
+      simd_names[level], best / VERTEX_COUNT * 1e9, pose_error);
+  }
+  simd_limit = SIMD_256;
+  free(vertices);
+  free(expected);
+  free(out);
+  return failed;
+}
+
+int main() {
+  int failed = 0;
+  failed |= bench_base64();
+  failed |= bench_vertices();
+  failed |= bench_decompose();
+  failed |= bench_gte();
+  return failed;
+}
@@ -917,10 +917,17 @@ static void cgltf_write_node(cgltf_write_context* context, const cgltf_node* nod
 		CGLTF_WRITE_IDXPROP("skin", node->skin, context->data->skins);
 	}
 
-	bool has_extension = node->light || (node->has_mesh_gpu_instancing && node->mesh_gpu_instancing.attributes_count > 0);
+	bool has_extension = node->light || (node->has_mesh_gpu_instancing && node->mesh_gpu_instancing.attributes_count > 0) || node->extensions_count > 0;
 	if(has_extension)
 		cgltf_write_line(context, "\"extensions\": {");
 
+	for (cgltf_size i = 0; i < node->extensions_count; ++i)
+	{
+		cgltf_write_indent(context);
+		CGLTF_SPRINTF("\"%s\": %s", node->extensions[i].name, node->extensions[i].data);
+		context->needs_comma = 1;
+	}
+
 	if (node->light)
 	{
 		context->extension_flags |= CGLTF_EXTENSION_FLAG_LIGHTS_PUNCTUAL;
@@ -1352,17 +1359,25 @@ cgltf_size cgltf_write(const cgltf_options* options, char* buffer, cgltf_size si
 		cgltf_write_line(context, "}");
 	}
 
-	if (context->extension_flags != 0)
+	if (context->extension_flags != 0 || data->extensions_used_count > 0)
 	{
 		cgltf_write_line(context, "\"extensionsUsed\": [");
 		cgltf_write_extensions(context, context->extension_flags);
+		for (cgltf_size i = 0; i < data->extensions_used_count; ++i)
+		{
+			cgltf_write_stritem(context, data->extensions_used[i]);
+		}
 		cgltf_write_line(context, "]");
 	}
 
-	if (context->required_extension_flags != 0)
+	if (context->required_extension_flags != 0 || data->extensions_required_count > 0)
 	{
 		cgltf_write_line(context, "\"extensionsRequired\": [");
 		cgltf_write_extensions(context, context->required_extension_flags);
+		for (cgltf_size i = 0; i < data->extensions_required_count; ++i)
+		{
+			cgltf_write_stritem(context, data->extensions_required[i]);
+		}
 		cgltf_write_line(context, "]");
 	}
 
@@ -0,0 +1,116 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CLUT_X86 1
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#define CLUT_NEON 1
+#endif
+
+#include "clut.h"
+#include "simd.h"
+
+// Expands the bytes from texels[i] on. Returns count.
+static size_t expand_clut_scalar(uint8_t* out, const uint8_t* texels, size_t count, const uint8_t colors[16][4], size_t i) {
+  for (; i < count; i++) {
+    memcpy(&out[8 * i + 0], colors[texels[i] & 0x0f], 4);
+    memcpy(&out[8 * i + 4], colors[texels[i] >> 4], 4);
+  }
+  return i;
+}
+
+// The vector kernels keep the colour table as one 16 byte table per channel,
+// so that a byte shuffle with 16 nibbles as indices looks up one channel of
+// 16 texels at once
+static void clut_channels(uint8_t channels[4][16], const uint8_t colors[16][4]) {
+  for (int i = 0; i < 16; i++) {
+    for (int c = 0; c < 4; c++) {
+      channels[c][i] = colors[i][c];
+    }
+  }
+}
+
+#ifdef CLUT_X86
+// Writes the 16 RGBA texels whose nibbles are in indices
+__attribute__((target("ssse3")))
+static void expand_clut_16_ssse3(uint8_t* out, __m128i indices, __m128i r, __m128i g, __m128i b, __m128i a) {
+  __m128i rs = _mm_shuffle_epi8(r, indices);
+  __m128i gs = _mm_shuffle_epi8(g, indices);
+  __m128i bs = _mm_shuffle_epi8(b, indices);
+  __m128i as = _mm_shuffle_epi8(a, indices);
+  __m128i rg_lo = _mm_unpacklo_epi8(rs, gs);
+  __m128i rg_hi = _mm_unpackhi_epi8(rs, gs);
+  __m128i ba_lo = _mm_unpacklo_epi8(bs, as);
+  __m128i ba_hi = _mm_unpackhi_epi8(bs, as);
+  _mm_storeu_si128((__m128i*) &out[0], _mm_unpacklo_epi16(rg_lo, ba_lo));
+  _mm_storeu_si128((__m128i*) &out[16], _mm_unpackhi_epi16(rg_lo, ba_lo));
+  _mm_storeu_si128((__m128i*) &out[32], _mm_unpacklo_epi16(rg_hi, ba_hi));
+  _mm_storeu_si128((__m128i*) &out[48], _mm_unpackhi_epi16(rg_hi, ba_hi));
+}
+
+__attribute__((target("ssse3")))
+static size_t expand_clut_ssse3(uint8_t* out, const uint8_t* texels, size_t count, const uint8_t colors[16][4]) {
+  uint8_t channels[4][16];
+  clut_channels(channels, colors);
+  __m128i r = _mm_loadu_si128((const __m128i*) channels[0]);
+  __m128i g = _mm_loadu_si128((const __m128i*) channels[1]);
+  __m128i b = _mm_loadu_si128((const __m128i*) channels[2]);
+  __m128i a = _mm_loadu_si128((const __m128i*) channels[3]);
+  const __m128i mask = _mm_set1_epi8(0x0f);
+  size_t i = 0;
+  for (; i + 16 <= count; i += 16) {
+    __m128i in = _mm_loadu_si128((const __m128i*) &texels[i]);
+    __m128i lower = _mm_and_si128(in, mask);
+    __m128i upper = _mm_and_si128(_mm_srli_epi16(in, 4), mask);
+    // The low nibble is the left texel of each byte
+    expand_clut_16_ssse3(&out[8 * i], _mm_unpacklo_epi8(lower, upper), r, g, b, a);
+    expand_clut_16_ssse3(&out[8 * i + 64], _mm_unpackhi_epi8(lower, upper), r, g, b, a);
+  }
+  return i;
+}
+#endif
+
+#ifdef CLUT_NEON
+static size_t expand_clut_neon(uint8_t* out, const uint8_t* texels, size_t count, const uint8_t colors[16][4]) {
+  uint8_t channels[4][16];
+  clut_channels(channels, colors);
+  uint8x16_t r = vld1q_u8(channels[0]);
+  uint8x16_t g = vld1q_u8(channels[1]);
+  uint8x16_t b = vld1q_u8(channels[2]);
+  uint8x16_t a = vld1q_u8(channels[3]);
+  size_t i = 0;
+  for (; i + 16 <= count; i += 16) {
+    uint8x16_t in = vld1q_u8(&texels[i]);
+    uint8x16x2_t indices = vzipq_u8(vandq_u8(in, vdupq_n_u8(0x0f)), vshrq_n_u8(in, 4));
+    for (int k = 0; k < 2; k++) {
+      uint8x16x4_t rgba = {{
+        vqtbl1q_u8(r, indices.val[k]),
+        vqtbl1q_u8(g, indices.val[k]),
+        vqtbl1q_u8(b, indices.val[k]),
+        vqtbl1q_u8(a, indices.val[k])
+      }};
+      vst4q_u8(&out[8 * i + 64 * k], rgba);
+    }
+  }
+  return i;
+}
+#endif
+
+// Expands count bytes of 4bpp texels, low nibble first, into 2 * count RGBA
+// texels by looking each nibble up in a 16 entry colour table
+void expand_clut_texels(uint8_t* out, const uint8_t* texels, size_t count, const uint8_t colors[16][4]) {
+  size_t i = 0;
+#if defined(CLUT_X86)
+  if (simd_limit >= SIMD_128 && __builtin_cpu_supports("ssse3")) {
+    i = expand_clut_ssse3(out, texels, count, colors);
+  }
+#elif defined(CLUT_NEON)
+  if (simd_limit >= SIMD_128) {
+    i = expand_clut_neon(out, texels, count, colors);
+  }
+#endif
+  expand_clut_scalar(out, texels, count, colors, i);
+}
@@ -0,0 +1,4 @@
+#include <stddef.h>
+#include <stdint.h>
+
+void expand_clut_texels(uint8_t* out, const uint8_t* texels, size_t count, const uint8_t colors[16][4]);
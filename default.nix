@@ -10,14 +10,16 @@ in
 nixpkgs.stdenv.mkDerivation {
   name = "dw2-model";
   src = ./.;
-  buildInputs = [ nixpkgs.libpng ];
+  buildInputs = [ nixpkgs.libpng nixpkgs.zlib ];
   buildPhase = ''
-    gcc matrix.c rip_model.c iso_reader.c -lpng -lm -Wall -g -I . -o rip_model
+    gcc simd.c matrix.c base64.c mesh.c atlas.c clut.c png_encoder.c ktx2_encoder.c store.c keyframe_fit.c rip_model.c iso_reader.c -lpng -lz -lpthread -lm -Wall -g -I . -o rip_model
     gcc iso_reader.c index_files.c -Wall -I . -o index_files
+    gcc simd.c base64.c matrix.c bench.c -lm -Wall -O2 -I . -o bench
   '';
   installPhase = ''
     mkdir $out
     cp rip_model $out/
     cp index_files $out/
+    cp bench $out/
   '';
 }
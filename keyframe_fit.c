@@ -0,0 +1,228 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "keyframe_fit.h"
+
+// A node transform as an affine matrix: three columns of the linear part,
+// then the translation
+typedef struct affine_s {
+  double m[12];
+} affine_t;
+
+static affine_t affine_from_trs(const double* q, const double* t, const double* s) {
+  double x = q[0], y = q[1], z = q[2], w = q[3];
+  affine_t a = {{
+    (1 - 2 * (y * y + z * z)) * s[0], (2 * (x * y + z * w)) * s[0], (2 * (x * z - y * w)) * s[0],
+    (2 * (x * y - z * w)) * s[1], (1 - 2 * (x * x + z * z)) * s[1], (2 * (y * z + x * w)) * s[1],
+    (2 * (x * z + y * w)) * s[2], (2 * (y * z - x * w)) * s[2], (1 - 2 * (x * x + y * y)) * s[2],
+    t[0], t[1], t[2]
+  }};
+  return a;
+}
+
+static affine_t affine_multiply(const affine_t* p, const affine_t* c) {
+  affine_t a;
+  for (int column = 0; column < 4; column++) {
+    for (int row = 0; row < 3; row++) {
+      double v = column == 3 ? p->m[9 + row] : 0;
+      for (int k = 0; k < 3; k++) {
+        v += p->m[3 * k + row] * c->m[3 * column + k];
+      }
+      a.m[3 * column + row] = v;
+    }
+  }
+  return a;
+}
+
+static affine_t affine_inverse(const affine_t* a) {
+  const double* m = a->m;
+  // Columns of the inverse of the linear part, from cofactors
+  double c0[3] = { m[4] * m[8] - m[5] * m[7], m[5] * m[6] - m[3] * m[8], m[3] * m[7] - m[4] * m[6] };
+  double c1[3] = { m[2] * m[7] - m[1] * m[8], m[0] * m[8] - m[2] * m[6], m[1] * m[6] - m[0] * m[7] };
+  double c2[3] = { m[1] * m[5] - m[2] * m[4], m[2] * m[3] - m[0] * m[5], m[0] * m[4] - m[1] * m[3] };
+  double determinant = m[0] * c0[0] + m[3] * c0[1] + m[6] * c0[2];
+  affine_t inverse;
+  for (int row = 0; row < 3; row++) {
+    inverse.m[row] = c0[row] / determinant;
+    inverse.m[3 + row] = c1[row] / determinant;
+    inverse.m[6 + row] = c2[row] / determinant;
+  }
+  for (int row = 0; row < 3; row++) {
+    inverse.m[9 + row] = -(inverse.m[row] * m[9] + inverse.m[3 + row] * m[10] + inverse.m[6 + row] * m[11]);
+  }
+  return inverse;
+}
+
+static double distance3(const double* a, const double* b) {
+  double dx = a[0] - b[0], dy = a[1] - b[1], dz = a[2] - b[2];
+  return sqrt(dx * dx + dy * dy + dz * dz);
+}
+
+static int affine_close(const affine_t* fitted, const affine_t* sampled, const keyframe_fit_options_t* options) {
+  if (distance3(&fitted->m[9], &sampled->m[9]) > options->position_error) {
+    return 0;
+  }
+  static const double zero[3] = { 0, 0, 0 };
+  for (int column = 0; column < 3; column++) {
+    double length = distance3(&sampled->m[3 * column], zero);
+    if (distance3(&fitted->m[3 * column], &sampled->m[3 * column]) > options->angle_error * length) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// The local transform of an object at frame, interpolated between frames a
+// and b the way glTF plays LINEAR samplers: lerp for translation and scale,
+// shortest path slerp for rotation
+static affine_t interpolate(const float* rotations, const float* translations, const float* scales, size_t a, size_t b, size_t frame) {
+  double t = b > a ? (double) (frame - a) / (b - a) : 0;
+  const float* qa = &rotations[4 * a];
+  const float* qb = &rotations[4 * b];
+  double dot = 0;
+  for (int c = 0; c < 4; c++) {
+    dot += (double) qa[c] * qb[c];
+  }
+  double sign = dot < 0 ? -1 : 1;
+  dot = fabs(dot);
+  double wa = 1 - t;
+  double wb = t;
+  if (dot < 0.9995) {
+    double angle = acos(dot);
+    wa = sin((1 - t) * angle) / sin(angle);
+    wb = sin(t * angle) / sin(angle);
+  }
+  double q[4];
+  double length = 0;
+  for (int c = 0; c < 4; c++) {
+    q[c] = wa * qa[c] + sign * wb * qb[c];
+    length += q[c] * q[c];
+  }
+  length = sqrt(length);
+  double tr[3];
+  double s[3];
+  for (int c = 0; c < 4; c++) {
+    q[c] /= length;
+  }
+  for (int c = 0; c < 3; c++) {
+    tr[c] = (1 - t) * translations[3 * a + c] + t * translations[3 * b + c];
+    s[c] = (1 - t) * scales[3 * a + c] + t * scales[3 * b + c];
+  }
+  return affine_from_trs(q, tr, s);
+}
+
+// Whether keys at frames a and b reproduce every frame from a to b, both
+// included: the object itself, and every descendant carried along by it
+static int segment_fits(const float* q, const float* t, const float* s, const affine_t* parent_fitted, const affine_t* object_sampled, const affine_t* sampled, const affine_t* relatives, const size_t* descendants, size_t descendant_count, size_t frame_count, const keyframe_fit_options_t* options, size_t a, size_t b) {
+  for (size_t frame = a; frame <= b; frame++) {
+    affine_t local = interpolate(q, t, s, a, b, frame);
+    affine_t world = parent_fitted ? affine_multiply(&parent_fitted[frame], &local) : local;
+    if (!affine_close(&world, &object_sampled[frame], options)) {
+      return 0;
+    }
+    for (size_t d = 0; d < descendant_count; d++) {
+      affine_t moved = affine_multiply(&world, &relatives[frame_count * d + frame]);
+      if (!affine_close(&moved, &sampled[frame_count * descendants[d] + frame], options)) {
+        return 0;
+      }
+    }
+  }
+  return 1;
+}
+
+// Picks the frames of each object to keep as LINEAR keys, so that every
+// sampled frame is reproduced within options in world space. Tracks are
+// object-major, frame_count keys per object. Parents come before their
+// children, and -1 marks a root. Each object is fitted against its parent's
+// already fitted motion, and also has to keep the world transforms of all of
+// its descendants in place, so that errors don't pile up down the hierarchy.
+// That is also what keeps a child's own key frames, which it reproduces
+// exactly in local space, within options in world space.
+//
+// Keys are chosen greedily: from the last key, the next one is the furthest
+// frame that still reproduces every frame in between and both keys. The
+// first and last frames are always kept. keys gets each object's frames,
+// concatenated, and counts how many each has. Returns the total.
+size_t fit_keyframes(const float* rotations, const float* translations, const float* scales, const int32_t* parents, size_t object_count, size_t frame_count, const keyframe_fit_options_t* options, uint16_t* keys, size_t* counts) {
+  affine_t* sampled = malloc(object_count * frame_count * sizeof(affine_t));
+  affine_t* fitted = malloc(object_count * frame_count * sizeof(affine_t));
+  for (size_t object = 0; object < object_count; object++) {
+    const affine_t* parent_sampled = parents[object] >= 0 ? &sampled[frame_count * parents[object]] : NULL;
+    for (size_t frame = 0; frame < frame_count; frame++) {
+      affine_t local = interpolate(
+        &rotations[4 * frame_count * object], &translations[3 * frame_count * object],
+        &scales[3 * frame_count * object], frame, frame, frame);
+      sampled[frame_count * object + frame] = parent_sampled ?
+        affine_multiply(&parent_sampled[frame], &local) : local;
+    }
+  }
+  // The descendants of the object being fitted, and their transforms
+  // relative to its sampled one at every frame
+  size_t* descendants = malloc(object_count * sizeof(size_t));
+  affine_t* relatives = malloc(object_count * frame_count * sizeof(affine_t));
+  size_t total = 0;
+  for (size_t object = 0; object < object_count; object++) {
+    const float* q = &rotations[4 * frame_count * object];
+    const float* t = &translations[3 * frame_count * object];
+    const float* s = &scales[3 * frame_count * object];
+    const affine_t* object_sampled = &sampled[frame_count * object];
+    affine_t* object_fitted = &fitted[frame_count * object];
+    int32_t parent = parents[object];
+    const affine_t* parent_fitted = parent >= 0 ? &fitted[frame_count * parent] : NULL;
+
+    size_t descendant_count = 0;
+    for (size_t other = object + 1; other < object_count; other++) {
+      int32_t ancestor = parents[other];
+      while (ancestor > (int32_t) object) {
+        ancestor = parents[ancestor];
+      }
+      if (ancestor == (int32_t) object) {
+        descendants[descendant_count++] = other;
+      }
+    }
+    for (size_t frame = 0; frame < frame_count; frame++) {
+      affine_t inverse = affine_inverse(&object_sampled[frame]);
+      for (size_t d = 0; d < descendant_count; d++) {
+        relatives[frame_count * d + frame] =
+          affine_multiply(&inverse, &sampled[frame_count * descendants[d] + frame]);
+      }
+    }
+
+    uint16_t* object_keys = &keys[total];
+    size_t count = 0;
+    if (frame_count > 0) {
+      object_keys[count++] = 0;
+    }
+    size_t a = 0;
+    while (a + 1 < frame_count) {
+      // Adjacent keys are exact in local space, so they are kept even if
+      // they don't fit: only the ancestors could fix that
+      size_t b = a + 1;
+      while (b + 1 < frame_count && segment_fits(
+          q, t, s, parent_fitted, object_sampled, sampled, relatives, descendants,
+          descendant_count, frame_count, options, a, b + 1)) {
+        b++;
+      }
+      object_keys[count++] = b;
+      a = b;
+    }
+
+    for (size_t k = 0; k < count; k++) {
+      size_t first = object_keys[k];
+      size_t last = k + 1 < count ? object_keys[k + 1] : first;
+      for (size_t frame = first; frame <= last; frame++) {
+        affine_t local = interpolate(q, t, s, first, last, frame);
+        object_fitted[frame] = parent_fitted ? affine_multiply(&parent_fitted[frame], &local) : local;
+      }
+    }
+    counts[object] = count;
+    total += count;
+  }
+  free(descendants);
+  free(relatives);
+  free(sampled);
+  free(fitted);
+  return total;
+}
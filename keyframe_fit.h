@@ -0,0 +1,12 @@
+#include <stddef.h>
+#include <stdint.h>
+
+// How far a fitted pose may stray from the sampled one, in world space. A
+// node's origin may move by position_error, and each of its axes by
+// angle_error radians, which bounds both rotation and relative scale error.
+typedef struct keyframe_fit_options_s {
+  double position_error;
+  double angle_error;
+} keyframe_fit_options_t;
+
+size_t fit_keyframes(const float* rotations, const float* translations, const float* scales, const int32_t* parents, size_t object_count, size_t frame_count, const keyframe_fit_options_t* options, uint16_t* keys, size_t* counts);
@@ -0,0 +1,463 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "ktx2_encoder.h"
+
+// The encoder is meant for palette art, where a 4x4 block rarely holds more
+// than a few distinct colours. Instead of fitting a line through the
+// colours, every pair of the block's own colours is tried as endpoints,
+// which keeps flat areas and hard edges exact up to RGB565 rounding.
+
+#define VK_FORMAT_BC1_RGBA_SRGB_BLOCK 134
+#define VK_FORMAT_BC3_SRGB_BLOCK 138
+#define KHR_DF_MODEL_BC1A 128
+#define KHR_DF_MODEL_BC3 130
+#define KHR_DF_PRIMARIES_BT709 1
+#define KHR_DF_TRANSFER_SRGB 2
+#define KHR_DF_CHANNEL_BC1A_ALPHAPRESENT 1
+#define KHR_DF_CHANNEL_BC3_COLOR 0
+#define KHR_DF_CHANNEL_BC3_ALPHA 15
+
+// Rounds to the nearest value after the decoder's bit replication, which
+// isn't always the truncated one: 248 is closer to 30 -> 247 than 31 -> 255
+static uint16_t pack_565(const uint8_t* c) {
+  uint16_t r = (c[0] * 31 + 127) / 255;
+  uint16_t g = (c[1] * 63 + 127) / 255;
+  uint16_t b = (c[2] * 31 + 127) / 255;
+  return (r << 11) | (g << 5) | b;
+}
+
+static void unpack_565(uint8_t* c, uint16_t v) {
+  uint8_t r = v >> 11;
+  uint8_t g = (v >> 5) & 0x3f;
+  uint8_t b = v & 0x1f;
+  c[0] = (r << 3) | (r >> 2);
+  c[1] = (g << 2) | (g >> 4);
+  c[2] = (b << 3) | (b >> 2);
+}
+
+static uint32_t color_distance(const uint8_t* a, const uint8_t* b) {
+  int dr = a[0] - b[0];
+  int dg = a[1] - b[1];
+  int db = a[2] - b[2];
+  return dr * dr + dg * dg + db * db;
+}
+
+// The palette a BC1 decoder builds from two endpoints. With three_color, the
+// fourth entry is transparent black and isn't matched against.
+static void bc1_palette(uint8_t palette[4][3], uint16_t c0, uint16_t c1, int three_color) {
+  unpack_565(palette[0], c0);
+  unpack_565(palette[1], c1);
+  for (int k = 0; k < 3; k++) {
+    if (three_color) {
+      palette[2][k] = (palette[0][k] + palette[1][k]) / 2;
+      palette[3][k] = 0;
+    } else {
+      palette[2][k] = (2 * palette[0][k] + palette[1][k]) / 3;
+      palette[3][k] = (palette[0][k] + 2 * palette[1][k]) / 3;
+    }
+  }
+}
+
+// Picks the nearest entry for each texel that counts, and returns the total
+// error. Texels that don't count get index 3.
+static uint32_t bc1_indices(uint8_t* indices, const uint8_t block[16][4], const uint8_t* counts, uint8_t palette[4][3], int entries) {
+  uint32_t total = 0;
+  for (int i = 0; i < 16; i++) {
+    indices[i] = 3;
+    if (!counts[i]) {
+      continue;
+    }
+    uint32_t best = UINT32_MAX;
+    for (int e = 0; e < entries; e++) {
+      uint32_t d = color_distance(block[i], palette[e]);
+      if (d < best) {
+        best = d;
+        indices[i] = e;
+      }
+    }
+    total += best;
+  }
+  return total;
+}
+
+// Encodes the colour half of a block. BC1 blocks with transparent texels
+// use the three colour mode, where index 3 is transparent. BC3 colour blocks
+// always decode with four colours, and ignore the colour of transparent
+// texels.
+static void encode_color_block(uint8_t* out, const uint8_t block[16][4], int bc1) {
+  uint8_t counts[16];
+  int has_transparent = 0;
+  uint16_t colors[16];
+  int color_count = 0;
+  for (int i = 0; i < 16; i++) {
+    counts[i] = bc1 ? block[i][3] >= 128 : block[i][3] > 0;
+    has_transparent |= bc1 && !counts[i];
+    if (!counts[i]) {
+      continue;
+    }
+    uint16_t c = pack_565(block[i]);
+    int seen = 0;
+    for (int k = 0; k < color_count && !seen; k++) {
+      seen = colors[k] == c;
+    }
+    if (!seen) {
+      colors[color_count++] = c;
+    }
+  }
+  if (color_count == 0) {
+    colors[color_count++] = 0;
+  }
+
+  uint32_t best_error = UINT32_MAX;
+  uint16_t best_c0 = 0;
+  uint16_t best_c1 = 0;
+  uint8_t best_indices[16];
+  for (int a = 0; a < color_count && best_error > 0; a++) {
+    for (int b = a; b < color_count && best_error > 0; b++) {
+      uint16_t hi = colors[a] > colors[b] ? colors[a] : colors[b];
+      uint16_t lo = colors[a] > colors[b] ? colors[b] : colors[a];
+      // Four colours need c0 > c1 in BC1, three colours c0 <= c1
+      int three_color = bc1 && (has_transparent || hi == lo);
+      uint16_t c0 = three_color ? lo : hi;
+      uint16_t c1 = three_color ? hi : lo;
+      uint8_t palette[4][3];
+      bc1_palette(palette, c0, c1, three_color);
+      uint8_t indices[16];
+      uint32_t error = bc1_indices(indices, block, counts, palette, three_color ? 3 : 4);
+      if (error < best_error) {
+        best_error = error;
+        best_c0 = c0;
+        best_c1 = c1;
+        memcpy(best_indices, indices, sizeof(indices));
+      }
+    }
+  }
+  // Blocks with more colours than the palette can hold get their endpoints
+  // refit by least squares to the chosen indices
+  int three_color = bc1 && best_c0 <= best_c1;
+  for (int iteration = 0; iteration < 2 && best_error > 0 && color_count > 2; iteration++) {
+    float aa = 0, ab = 0, bb = 0;
+    float ax[3] = { 0 }, bx[3] = { 0 };
+    for (int i = 0; i < 16; i++) {
+      if (!counts[i]) {
+        continue;
+      }
+      // Weight of c0 for each index
+      static const float four_color_weights[4] = { 1, 0, 2 / 3.0f, 1 / 3.0f };
+      static const float three_color_weights[3] = { 1, 0, 0.5f };
+      float w = three_color ? three_color_weights[best_indices[i]] : four_color_weights[best_indices[i]];
+      aa += w * w;
+      ab += w * (1 - w);
+      bb += (1 - w) * (1 - w);
+      for (int k = 0; k < 3; k++) {
+        ax[k] += w * block[i][k];
+        bx[k] += (1 - w) * block[i][k];
+      }
+    }
+    float det = aa * bb - ab * ab;
+    if (det == 0) {
+      break;
+    }
+    uint8_t e0[3], e1[3];
+    for (int k = 0; k < 3; k++) {
+      float v0 = (ax[k] * bb - bx[k] * ab) / det;
+      float v1 = (bx[k] * aa - ax[k] * ab) / det;
+      e0[k] = v0 < 0 ? 0 : v0 > 255 ? 255 : v0 + 0.5f;
+      e1[k] = v1 < 0 ? 0 : v1 > 255 ? 255 : v1 + 0.5f;
+    }
+    uint16_t c0 = pack_565(e0);
+    uint16_t c1 = pack_565(e1);
+    if (three_color ? c0 > c1 : c0 < c1) {
+      uint16_t t = c0;
+      c0 = c1;
+      c1 = t;
+    }
+    if (c0 == c1 && !three_color) {
+      break;
+    }
+    uint8_t palette[4][3];
+    bc1_palette(palette, c0, c1, three_color);
+    uint8_t indices[16];
+    uint32_t error = bc1_indices(indices, block, counts, palette, three_color ? 3 : 4);
+    if (error >= best_error) {
+      break;
+    }
+    best_error = error;
+    best_c0 = c0;
+    best_c1 = c1;
+    memcpy(best_indices, indices, sizeof(indices));
+  }
+
+  out[0] = best_c0;
+  out[1] = best_c0 >> 8;
+  out[2] = best_c1;
+  out[3] = best_c1 >> 8;
+  uint32_t bits = 0;
+  for (int i = 0; i < 16; i++) {
+    // A BC3 block decodes index 3 as a colour, so transparent texels just
+    // keep whatever they were given
+    bits |= (uint32_t) best_indices[i] << (2 * i);
+  }
+  out[4] = bits;
+  out[5] = bits >> 8;
+  out[6] = bits >> 16;
+  out[7] = bits >> 24;
+}
+
+// The 8 alphas a BC3 decoder builds from two endpoints
+static void bc3_alphas(uint8_t alphas[8], uint8_t a0, uint8_t a1) {
+  alphas[0] = a0;
+  alphas[1] = a1;
+  if (a0 > a1) {
+    for (int k = 1; k < 7; k++) {
+      alphas[k + 1] = ((7 - k) * a0 + k * a1) / 7;
+    }
+  } else {
+    for (int k = 1; k < 5; k++) {
+      alphas[k + 1] = ((5 - k) * a0 + k * a1) / 5;
+    }
+    alphas[6] = 0;
+    alphas[7] = 255;
+  }
+}
+
+static uint32_t bc3_alpha_indices(uint8_t* indices, const uint8_t block[16][4], uint8_t alphas[8]) {
+  uint32_t total = 0;
+  for (int i = 0; i < 16; i++) {
+    uint32_t best = UINT32_MAX;
+    for (int e = 0; e < 8; e++) {
+      int d = block[i][3] - alphas[e];
+      if ((uint32_t) (d * d) < best) {
+        best = d * d;
+        indices[i] = e;
+      }
+    }
+    total += best;
+  }
+  return total;
+}
+
+// Tries the six alpha mode, which has exact 0 and 255 besides the endpoints,
+// over the alphas strictly between those, and the eight alpha mode over all
+// of them. Semi-transparent palette art only has 0, 127 and 255.
+static void encode_alpha_block(uint8_t* out, const uint8_t block[16][4]) {
+  uint8_t min_all = 255, max_all = 0, min_mid = 255, max_mid = 0;
+  for (int i = 0; i < 16; i++) {
+    uint8_t a = block[i][3];
+    if (a < min_all) min_all = a;
+    if (a > max_all) max_all = a;
+    if (a > 0 && a < 255) {
+      if (a < min_mid) min_mid = a;
+      if (a > max_mid) max_mid = a;
+    }
+  }
+  if (min_mid > max_mid) {
+    min_mid = max_mid = 0;
+  }
+  uint8_t candidates[2][2] = {
+    { min_mid, max_mid },
+    { max_all, min_all }
+  };
+  uint32_t best_error = UINT32_MAX;
+  uint8_t best_a[2];
+  uint8_t best_indices[16];
+  for (int c = 0; c < 2; c++) {
+    uint8_t alphas[8];
+    uint8_t indices[16];
+    bc3_alphas(alphas, candidates[c][0], candidates[c][1]);
+    uint32_t error = bc3_alpha_indices(indices, block, alphas);
+    if (error < best_error) {
+      best_error = error;
+      memcpy(best_a, candidates[c], 2);
+      memcpy(best_indices, indices, sizeof(indices));
+    }
+  }
+  out[0] = best_a[0];
+  out[1] = best_a[1];
+  uint64_t bits = 0;
+  for (int i = 0; i < 16; i++) {
+    bits |= (uint64_t) best_indices[i] << (3 * i);
+  }
+  for (int k = 0; k < 6; k++) {
+    out[2 + k] = bits >> (8 * k);
+  }
+}
+
+typedef struct block_rows_s {
+  const uint8_t* rgba;
+  size_t width;
+  size_t height;
+  ktx2_format_t format;
+  size_t first_row;
+  size_t end_row;
+  uint8_t* out;
+} block_rows_t;
+
+static void* encode_block_rows(void* arg) {
+  block_rows_t* rows = arg;
+  size_t blocks_x = (rows->width + 3) / 4;
+  size_t block_size = rows->format == KTX2_FORMAT_BC1 ? 8 : 16;
+  for (size_t by = rows->first_row; by < rows->end_row; by++) {
+    for (size_t bx = 0; bx < blocks_x; bx++) {
+      // Edge blocks repeat the last row and column
+      uint8_t block[16][4];
+      for (int i = 0; i < 16; i++) {
+        size_t x = 4 * bx + i % 4;
+        size_t y = 4 * by + i / 4;
+        if (x >= rows->width) x = rows->width - 1;
+        if (y >= rows->height) y = rows->height - 1;
+        memcpy(block[i], &rows->rgba[4 * (rows->width * y + x)], 4);
+      }
+      uint8_t* out = &rows->out[block_size * (blocks_x * by + bx)];
+      if (rows->format == KTX2_FORMAT_BC1) {
+        encode_color_block(out, block, 1);
+      } else {
+        encode_alpha_block(out, block);
+        encode_color_block(out + 8, block, 0);
+      }
+    }
+  }
+  return NULL;
+}
+
+// BC1 only keeps texels that are fully opaque or fully transparent, so
+// anything in between needs BC3
+ktx2_format_t ktx2_pick_format(const uint8_t* rgba, size_t width, size_t height) {
+  for (size_t i = 0; i < width * height; i++) {
+    if (rgba[4 * i + 3] != 0 && rgba[4 * i + 3] != 255) {
+      return KTX2_FORMAT_BC3;
+    }
+  }
+  return KTX2_FORMAT_BC1;
+}
+
+static uint8_t* put_u32(uint8_t* out, uint32_t value) {
+  out[0] = value;
+  out[1] = value >> 8;
+  out[2] = value >> 16;
+  out[3] = value >> 24;
+  return out + 4;
+}
+
+static uint8_t* put_u64(uint8_t* out, uint64_t value) {
+  return put_u32(put_u32(out, value), value >> 32);
+}
+
+// Writes one sample of a data format descriptor, covering 64 bits of a block
+static uint8_t* put_dfd_sample(uint8_t* out, uint16_t bit_offset, uint8_t channel) {
+  out[0] = bit_offset;
+  out[1] = bit_offset >> 8;
+  out[2] = 63; // bit length - 1
+  out[3] = channel;
+  memset(&out[4], 0, 4); // sample position
+  put_u32(&out[8], 0); // lower
+  put_u32(&out[12], UINT32_MAX); // upper
+  return out + 16;
+}
+
+// Encodes an 8-bit sRGB RGBA image as a single level KTX2 texture in BC1 or
+// BC3, compressing rows of blocks on one thread per CPU when threads is 0.
+// Returns a malloc'd buffer and its size.
+unsigned char* ktx2_encode(const uint8_t* rgba, size_t width, size_t height, ktx2_format_t format, int threads, size_t* size) {
+  size_t blocks_x = (width + 3) / 4;
+  size_t blocks_y = (height + 3) / 4;
+  size_t block_size = format == KTX2_FORMAT_BC1 ? 8 : 16;
+  size_t level_size = block_size * blocks_x * blocks_y;
+  size_t sample_count = format == KTX2_FORMAT_BC1 ? 1 : 2;
+  size_t dfd_size = 4 + 24 + 16 * sample_count;
+  // Identifier, header, index and the index of the one level
+  size_t header_size = 12 + 36 + 32 + 24;
+  size_t level_offset = (header_size + dfd_size + 15) & ~(size_t) 15;
+  *size = level_offset + level_size;
+  uint8_t* ktx = calloc(*size, 1);
+
+  size_t thread_count = threads;
+  if (thread_count == 0) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    thread_count = cpus > 0 ? cpus : 1;
+  }
+  if (thread_count > blocks_y) {
+    thread_count = blocks_y;
+  }
+  block_rows_t rows[thread_count];
+  pthread_t workers[thread_count];
+  int started[thread_count];
+  size_t rows_per_thread = (blocks_y + thread_count - 1) / thread_count;
+  for (size_t t = 0; t < thread_count; t++) {
+    size_t first = t * rows_per_thread;
+    rows[t] = (block_rows_t) {
+      .rgba = rgba,
+      .width = width,
+      .height = height,
+      .format = format,
+      .first_row = first < blocks_y ? first : blocks_y,
+      .end_row = first + rows_per_thread < blocks_y ? first + rows_per_thread : blocks_y,
+      .out = &ktx[level_offset]
+    };
+  }
+  for (size_t t = 1; t < thread_count; t++) {
+    started[t] = pthread_create(&workers[t], NULL, encode_block_rows, &rows[t]) == 0;
+    if (!started[t]) {
+      encode_block_rows(&rows[t]);
+    }
+  }
+  if (thread_count > 0) {
+    encode_block_rows(&rows[0]);
+  }
+  for (size_t t = 1; t < thread_count; t++) {
+    if (started[t]) {
+      pthread_join(workers[t], NULL);
+    }
+  }
+
+  static const uint8_t identifier[12] = {
+    0xab, 'K', 'T', 'X', ' ', '2', '0', 0xbb, '\r', '\n', 0x1a, '\n'
+  };
+  memcpy(ktx, identifier, 12);
+  uint8_t* out = &ktx[12];
+  out = put_u32(out, format == KTX2_FORMAT_BC1 ?
+    VK_FORMAT_BC1_RGBA_SRGB_BLOCK : VK_FORMAT_BC3_SRGB_BLOCK);
+  out = put_u32(out, 1); // type size
+  out = put_u32(out, width);
+  out = put_u32(out, height);
+  out = put_u32(out, 0); // depth
+  out = put_u32(out, 0); // layers
+  out = put_u32(out, 1); // faces
+  out = put_u32(out, 1); // levels
+  out = put_u32(out, 0); // no supercompression
+  out = put_u32(out, header_size); // DFD
+  out = put_u32(out, dfd_size);
+  out = put_u32(out, 0); // key/value data
+  out = put_u32(out, 0);
+  out = put_u64(out, 0); // supercompression global data
+  out = put_u64(out, 0);
+  out = put_u64(out, level_offset);
+  out = put_u64(out, level_size);
+  out = put_u64(out, level_size);
+
+  out = put_u32(out, dfd_size);
+  out = put_u32(out, 0); // Khronos vendor, basic descriptor
+  out = put_u32(out, 2 | (uint32_t) (24 + 16 * sample_count) << 16);
+  out[0] = format == KTX2_FORMAT_BC1 ? KHR_DF_MODEL_BC1A : KHR_DF_MODEL_BC3;
+  out[1] = KHR_DF_PRIMARIES_BT709;
+  out[2] = KHR_DF_TRANSFER_SRGB;
+  out[3] = 0; // straight alpha
+  out[4] = 3; // 4x4 texel blocks, stored as dimension - 1
+  out[5] = 3;
+  out[6] = 0;
+  out[7] = 0;
+  memset(&out[8], 0, 8);
+  out[8] = block_size;
+  out += 16;
+  if (format == KTX2_FORMAT_BC1) {
+    put_dfd_sample(out, 0, KHR_DF_CHANNEL_BC1A_ALPHAPRESENT);
+  } else {
+    out = put_dfd_sample(out, 0, KHR_DF_CHANNEL_BC3_ALPHA);
+    put_dfd_sample(out, 64, KHR_DF_CHANNEL_BC3_COLOR);
+  }
+  return ktx;
+}
@@ -0,0 +1,12 @@
+#include <stddef.h>
+#include <stdint.h>
+
+typedef enum ktx2_format_e {
+  // Colour with 1-bit alpha, 8 bytes per 4x4 block
+  KTX2_FORMAT_BC1,
+  // Colour with interpolated alpha, 16 bytes per 4x4 block
+  KTX2_FORMAT_BC3
+} ktx2_format_t;
+
+ktx2_format_t ktx2_pick_format(const uint8_t* rgba, size_t width, size_t height);
+unsigned char* ktx2_encode(const uint8_t* rgba, size_t width, size_t height, ktx2_format_t format, int threads, size_t* size);
@@ -2,7 +2,17 @@
 #include <stdio.h>
 #include <string.h>
 #include <math.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define MATRIX_X86 1
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define MATRIX_NEON 1
+#endif
+
 #include "matrix.h"
+#include "simd.h"
 
 // Decompose M = SR into S (scale) and R (rotation)
 void decompose(fmatrix_t m, fmatrix_t* s_out, fmatrix_t* r_out) {
@@ -127,3 +137,799 @@ void normalize_quaternion_inplace(quaternion_t* q) {
   q->y *= r;
   q->z *= r;
 }
+
+// Converts vertices[start..count) to floats scaled per axis, widening
+// bounds_min and bounds_max to cover them
+static void vertices_to_floats_scalar(float* out, float* bounds_min, float* bounds_max, const vertex_t* vertices, size_t start, size_t count, const float* scale) {
+  for (size_t i = start; i < count; i++) {
+    float p[3] = {
+      vertices[i].x * scale[0],
+      vertices[i].y * scale[1],
+      vertices[i].z * scale[2]
+    };
+    for (int k = 0; k < 3; k++) {
+      out[3 * i + k] = p[k];
+      if (p[k] < bounds_min[k]) bounds_min[k] = p[k];
+      if (p[k] > bounds_max[k]) bounds_max[k] = p[k];
+    }
+  }
+}
+
+// The vector kernels treat the vertices as a flat array of int16 components.
+// Lane j of the flattened array belongs to axis j % 3, so lanes repeat their
+// axis every 3 vectors: 3 scale vectors cover every load, and 3 min and max
+// accumulators each see a single fixed pattern of axes. The accumulators are
+// folded back into per-axis bounds at the end.
+static void fold_bounds(float* bounds_min, float* bounds_max, const float* mins, const float* maxs, size_t lanes) {
+  for (size_t j = 0; j < lanes; j++) {
+    if (mins[j] < bounds_min[j % 3]) bounds_min[j % 3] = mins[j];
+    if (maxs[j] > bounds_max[j % 3]) bounds_max[j % 3] = maxs[j];
+  }
+}
+
+#ifdef MATRIX_X86
+__attribute__((target("sse4.1")))
+static size_t vertices_to_floats_sse41(float* out, float* bounds_min, float* bounds_max, const vertex_t* vertices, size_t count, const float* scale) {
+  const int16_t* in = (const int16_t*) vertices;
+  __m128 scales[3] = {
+    _mm_setr_ps(scale[0], scale[1], scale[2], scale[0]),
+    _mm_setr_ps(scale[1], scale[2], scale[0], scale[1]),
+    _mm_setr_ps(scale[2], scale[0], scale[1], scale[2])
+  };
+  __m128 mins[3], maxs[3];
+  for (int k = 0; k < 3; k++) {
+    mins[k] = _mm_set1_ps(INFINITY);
+    maxs[k] = _mm_set1_ps(-INFINITY);
+  }
+  size_t i = 0;
+  // 8 vertices, 24 components, per iteration
+  for (; i + 8 <= count; i += 8) {
+    for (int half = 0; half < 2; half++) {
+      const int16_t* from = &in[3 * i + 12 * half];
+      __m128i a = _mm_loadu_si128((const __m128i*) from);
+      __m128i b = _mm_loadl_epi64((const __m128i*) &from[8]);
+      __m128 f[3] = {
+        _mm_cvtepi32_ps(_mm_cvtepi16_epi32(a)),
+        _mm_cvtepi32_ps(_mm_cvtepi16_epi32(_mm_srli_si128(a, 8))),
+        _mm_cvtepi32_ps(_mm_cvtepi16_epi32(b))
+      };
+      for (int k = 0; k < 3; k++) {
+        f[k] = _mm_mul_ps(f[k], scales[k]);
+        mins[k] = _mm_min_ps(mins[k], f[k]);
+        maxs[k] = _mm_max_ps(maxs[k], f[k]);
+        _mm_storeu_ps(&out[3 * i + 12 * half + 4 * k], f[k]);
+      }
+    }
+  }
+  float min_lanes[12], max_lanes[12];
+  for (int k = 0; k < 3; k++) {
+    _mm_storeu_ps(&min_lanes[4 * k], mins[k]);
+    _mm_storeu_ps(&max_lanes[4 * k], maxs[k]);
+  }
+  fold_bounds(bounds_min, bounds_max, min_lanes, max_lanes, 12);
+  return i;
+}
+
+__attribute__((target("avx2")))
+static size_t vertices_to_floats_avx2(float* out, float* bounds_min, float* bounds_max, const vertex_t* vertices, size_t count, const float* scale) {
+  const int16_t* in = (const int16_t*) vertices;
+  __m256 scales[3] = {
+    _mm256_setr_ps(scale[0], scale[1], scale[2], scale[0], scale[1], scale[2], scale[0], scale[1]),
+    _mm256_setr_ps(scale[2], scale[0], scale[1], scale[2], scale[0], scale[1], scale[2], scale[0]),
+    _mm256_setr_ps(scale[1], scale[2], scale[0], scale[1], scale[2], scale[0], scale[1], scale[2])
+  };
+  __m256 mins[3], maxs[3];
+  for (int k = 0; k < 3; k++) {
+    mins[k] = _mm256_set1_ps(INFINITY);
+    maxs[k] = _mm256_set1_ps(-INFINITY);
+  }
+  size_t i = 0;
+  // 16 vertices, 48 components, per iteration
+  for (; i + 16 <= count; i += 16) {
+    for (int v = 0; v < 6; v++) {
+      __m128i a = _mm_loadu_si128((const __m128i*) &in[3 * i + 8 * v]);
+      __m256 f = _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(a));
+      f = _mm256_mul_ps(f, scales[v % 3]);
+      mins[v % 3] = _mm256_min_ps(mins[v % 3], f);
+      maxs[v % 3] = _mm256_max_ps(maxs[v % 3], f);
+      _mm256_storeu_ps(&out[3 * i + 8 * v], f);
+    }
+  }
+  float min_lanes[24], max_lanes[24];
+  for (int k = 0; k < 3; k++) {
+    _mm256_storeu_ps(&min_lanes[8 * k], mins[k]);
+    _mm256_storeu_ps(&max_lanes[8 * k], maxs[k]);
+  }
+  fold_bounds(bounds_min, bounds_max, min_lanes, max_lanes, 24);
+  return i;
+}
+#endif
+
+#ifdef MATRIX_NEON
+static size_t vertices_to_floats_neon(float* out, float* bounds_min, float* bounds_max, const vertex_t* vertices, size_t count, const float* scale) {
+  const int16_t* in = (const int16_t*) vertices;
+  float scale_lanes[12] = {
+    scale[0], scale[1], scale[2], scale[0],
+    scale[1], scale[2], scale[0], scale[1],
+    scale[2], scale[0], scale[1], scale[2]
+  };
+  float32x4_t scales[3], mins[3], maxs[3];
+  for (int k = 0; k < 3; k++) {
+    scales[k] = vld1q_f32(&scale_lanes[4 * k]);
+    mins[k] = vdupq_n_f32(INFINITY);
+    maxs[k] = vdupq_n_f32(-INFINITY);
+  }
+  size_t i = 0;
+  // 8 vertices, 24 components, per iteration
+  for (; i + 8 <= count; i += 8) {
+    for (int v = 0; v < 6; v++) {
+      int16x4_t a = vld1_s16(&in[3 * i + 4 * v]);
+      float32x4_t f = vcvtq_f32_s32(vmovl_s16(a));
+      f = vmulq_f32(f, scales[v % 3]);
+      mins[v % 3] = vminq_f32(mins[v % 3], f);
+      maxs[v % 3] = vmaxq_f32(maxs[v % 3], f);
+      vst1q_f32(&out[3 * i + 4 * v], f);
+    }
+  }
+  float min_lanes[12], max_lanes[12];
+  for (int k = 0; k < 3; k++) {
+    vst1q_f32(&min_lanes[4 * k], mins[k]);
+    vst1q_f32(&max_lanes[4 * k], maxs[k]);
+  }
+  fold_bounds(bounds_min, bounds_max, min_lanes, max_lanes, 12);
+  return i;
+}
+#endif
+
+// Converts 4.12 vertices to 3 floats each, multiplying each axis by its
+// scale, and widens bounds_min and bounds_max to cover the results. A scale
+// of -1/4096 is exact, so the output matches dividing in double precision.
+void vertices_to_floats(float* out, float* bounds_min, float* bounds_max, const vertex_t* vertices, size_t count, const float* scale) {
+  size_t i = 0;
+#if defined(MATRIX_X86)
+  if (simd_limit >= SIMD_256 && __builtin_cpu_supports("avx2")) {
+    i = vertices_to_floats_avx2(out, bounds_min, bounds_max, vertices, count, scale);
+  } else if (simd_limit >= SIMD_128 && __builtin_cpu_supports("sse4.1")) {
+    i = vertices_to_floats_sse41(out, bounds_min, bounds_max, vertices, count, scale);
+  }
+#elif defined(MATRIX_NEON)
+  if (simd_limit >= SIMD_128) {
+    i = vertices_to_floats_neon(out, bounds_min, bounds_max, vertices, count, scale);
+  }
+#endif
+  vertices_to_floats_scalar(out, bounds_min, bounds_max, vertices, i, count, scale);
+}
+
+// Matrices in SoA layout: element e of matrix i is elements[e * count + i].
+// Scales and quaternions come out the same way, 3 and 4 arrays of count, the
+// quaternion in w, x, y, z order.
+//
+// The vector kernels run decompose, matrix_to_quaternion and
+// normalize_quaternion_inplace on a whole vector of matrices. The four
+// candidate quaternions are all formed and the scalar path's case picked
+// with blends, last case first so the earlier ones win. Every candidate is
+// the true quaternion times 1 / (2 sqrt(diagonal term)), a positive factor
+// that normalizing cancels, so only the final length needs a square root.
+// Square roots are a reciprocal square root estimate plus one Newton step,
+// which leaves them within a few float ulps.
+static void decompose_matrices_scalar(const int16_t* elements, size_t start, size_t count, float* scales, float* quaternions) {
+  for (size_t i = start; i < count; i++) {
+    matrix_t m;
+    for (int e = 0; e < 9; e++) {
+      m.x[e] = elements[e * count + i];
+    }
+    fmatrix_t scale_matrix;
+    fmatrix_t rotate_matrix;
+    decompose(matrix_to_fmatrix(m), &scale_matrix, &rotate_matrix);
+    quaternion_t q = matrix_to_quaternion(rotate_matrix);
+    normalize_quaternion_inplace(&q);
+    scales[0 * count + i] = scale_matrix.x[0];
+    scales[1 * count + i] = scale_matrix.x[4];
+    scales[2 * count + i] = scale_matrix.x[8];
+    quaternions[0 * count + i] = q.w;
+    quaternions[1 * count + i] = q.x;
+    quaternions[2 * count + i] = q.y;
+    quaternions[3 * count + i] = q.z;
+  }
+}
+
+#ifdef MATRIX_X86
+__attribute__((target("sse4.1")))
+static __m128 rsqrt_sse41(__m128 x) {
+  __m128 y = _mm_rsqrt_ps(x);
+  __m128 yy = _mm_mul_ps(y, y);
+  return _mm_mul_ps(y, _mm_sub_ps(_mm_set1_ps(1.5f), _mm_mul_ps(_mm_mul_ps(_mm_set1_ps(0.5f), x), yy)));
+}
+
+__attribute__((target("sse4.1")))
+static size_t decompose_matrices_sse41(const int16_t* elements, size_t count, float* scales, float* quaternions) {
+  const __m128 one = _mm_set1_ps(1);
+  const __m128 zero = _mm_setzero_ps();
+  size_t i = 0;
+  for (; i + 4 <= count; i += 4) {
+    __m128 m[9];
+    for (int e = 0; e < 9; e++) {
+      __m128i v = _mm_loadl_epi64((const __m128i*) &elements[e * count + i]);
+      m[e] = _mm_mul_ps(_mm_cvtepi32_ps(_mm_cvtepi16_epi32(v)), _mm_set1_ps(1 / 4096.0f));
+    }
+    for (int c = 0; c < 3; c++) {
+      __m128 squared = _mm_add_ps(_mm_add_ps(_mm_mul_ps(m[c], m[c]), _mm_mul_ps(m[3 + c], m[3 + c])), _mm_mul_ps(m[6 + c], m[6 + c]));
+      __m128 nonzero = _mm_cmpgt_ps(squared, zero);
+      __m128 inverse = _mm_blendv_ps(one, rsqrt_sse41(squared), nonzero);
+      _mm_storeu_ps(&scales[c * count + i], _mm_and_ps(_mm_mul_ps(squared, inverse), nonzero));
+      for (int row = 0; row < 3; row++) {
+        m[3 * row + c] = _mm_mul_ps(m[3 * row + c], inverse);
+      }
+    }
+    __m128 trace = _mm_add_ps(_mm_add_ps(m[0], m[4]), m[8]);
+    __m128 d57 = _mm_sub_ps(m[5], m[7]), d62 = _mm_sub_ps(m[6], m[2]), d13 = _mm_sub_ps(m[1], m[3]);
+    __m128 s13 = _mm_add_ps(m[3], m[1]), s26 = _mm_add_ps(m[6], m[2]), s57 = _mm_add_ps(m[7], m[5]);
+    __m128 q[4] = { d13, s26, s57, _mm_sub_ps(_mm_sub_ps(_mm_add_ps(one, m[8]), m[0]), m[4]) };
+    __m128 mask = _mm_cmpgt_ps(m[4], m[8]);
+    __m128 case2[4] = { d62, s13, _mm_sub_ps(_mm_sub_ps(_mm_add_ps(one, m[4]), m[0]), m[8]), s57 };
+    for (int c = 0; c < 4; c++) q[c] = _mm_blendv_ps(q[c], case2[c], mask);
+    mask = _mm_and_ps(_mm_cmpgt_ps(m[0], m[4]), _mm_cmpgt_ps(m[0], m[8]));
+    __m128 case1[4] = { d57, _mm_sub_ps(_mm_sub_ps(_mm_add_ps(one, m[0]), m[4]), m[8]), s13, s26 };
+    for (int c = 0; c < 4; c++) q[c] = _mm_blendv_ps(q[c], case1[c], mask);
+    mask = _mm_cmpgt_ps(trace, zero);
+    __m128 case0[4] = { _mm_add_ps(one, trace), d57, d62, d13 };
+    for (int c = 0; c < 4; c++) q[c] = _mm_blendv_ps(q[c], case0[c], mask);
+    __m128 length = zero;
+    for (int c = 0; c < 4; c++) length = _mm_add_ps(length, _mm_mul_ps(q[c], q[c]));
+    __m128 inverse = rsqrt_sse41(length);
+    for (int c = 0; c < 4; c++) {
+      _mm_storeu_ps(&quaternions[c * count + i], _mm_mul_ps(q[c], inverse));
+    }
+  }
+  return i;
+}
+
+__attribute__((target("avx2")))
+static __m256 rsqrt_avx2(__m256 x) {
+  __m256 y = _mm256_rsqrt_ps(x);
+  __m256 yy = _mm256_mul_ps(y, y);
+  return _mm256_mul_ps(y, _mm256_sub_ps(_mm256_set1_ps(1.5f), _mm256_mul_ps(_mm256_mul_ps(_mm256_set1_ps(0.5f), x), yy)));
+}
+
+__attribute__((target("avx2")))
+static size_t decompose_matrices_avx2(const int16_t* elements, size_t count, float* scales, float* quaternions) {
+  const __m256 one = _mm256_set1_ps(1);
+  const __m256 zero = _mm256_setzero_ps();
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m256 m[9];
+    for (int e = 0; e < 9; e++) {
+      __m128i v = _mm_loadu_si128((const __m128i*) &elements[e * count + i]);
+      m[e] = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(v)), _mm256_set1_ps(1 / 4096.0f));
+    }
+    for (int c = 0; c < 3; c++) {
+      __m256 squared = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(m[c], m[c]), _mm256_mul_ps(m[3 + c], m[3 + c])), _mm256_mul_ps(m[6 + c], m[6 + c]));
+      __m256 nonzero = _mm256_cmp_ps(squared, zero, _CMP_GT_OQ);
+      __m256 inverse = _mm256_blendv_ps(one, rsqrt_avx2(squared), nonzero);
+      _mm256_storeu_ps(&scales[c * count + i], _mm256_and_ps(_mm256_mul_ps(squared, inverse), nonzero));
+      for (int row = 0; row < 3; row++) {
+        m[3 * row + c] = _mm256_mul_ps(m[3 * row + c], inverse);
+      }
+    }
+    __m256 trace = _mm256_add_ps(_mm256_add_ps(m[0], m[4]), m[8]);
+    __m256 d57 = _mm256_sub_ps(m[5], m[7]), d62 = _mm256_sub_ps(m[6], m[2]), d13 = _mm256_sub_ps(m[1], m[3]);
+    __m256 s13 = _mm256_add_ps(m[3], m[1]), s26 = _mm256_add_ps(m[6], m[2]), s57 = _mm256_add_ps(m[7], m[5]);
+    __m256 q[4] = { d13, s26, s57, _mm256_sub_ps(_mm256_sub_ps(_mm256_add_ps(one, m[8]), m[0]), m[4]) };
+    __m256 mask = _mm256_cmp_ps(m[4], m[8], _CMP_GT_OQ);
+    __m256 case2[4] = { d62, s13, _mm256_sub_ps(_mm256_sub_ps(_mm256_add_ps(one, m[4]), m[0]), m[8]), s57 };
+    for (int c = 0; c < 4; c++) q[c] = _mm256_blendv_ps(q[c], case2[c], mask);
+    mask = _mm256_and_ps(_mm256_cmp_ps(m[0], m[4], _CMP_GT_OQ), _mm256_cmp_ps(m[0], m[8], _CMP_GT_OQ));
+    __m256 case1[4] = { d57, _mm256_sub_ps(_mm256_sub_ps(_mm256_add_ps(one, m[0]), m[4]), m[8]), s13, s26 };
+    for (int c = 0; c < 4; c++) q[c] = _mm256_blendv_ps(q[c], case1[c], mask);
+    mask = _mm256_cmp_ps(trace, zero, _CMP_GT_OQ);
+    __m256 case0[4] = { _mm256_add_ps(one, trace), d57, d62, d13 };
+    for (int c = 0; c < 4; c++) q[c] = _mm256_blendv_ps(q[c], case0[c], mask);
+    __m256 length = zero;
+    for (int c = 0; c < 4; c++) length = _mm256_add_ps(length, _mm256_mul_ps(q[c], q[c]));
+    __m256 inverse = rsqrt_avx2(length);
+    for (int c = 0; c < 4; c++) {
+      _mm256_storeu_ps(&quaternions[c * count + i], _mm256_mul_ps(q[c], inverse));
+    }
+  }
+  return i;
+}
+#endif
+
+#ifdef MATRIX_NEON
+// The estimate is only good to 8 bits, where SSE's is good to 12, so it takes
+// two Newton steps to get close to sqrtf
+static float32x4_t rsqrt_neon(float32x4_t x) {
+  float32x4_t y = vrsqrteq_f32(x);
+  y = vmulq_f32(y, vrsqrtsq_f32(vmulq_f32(x, y), y));
+  return vmulq_f32(y, vrsqrtsq_f32(vmulq_f32(x, y), y));
+}
+
+static size_t decompose_matrices_neon(const int16_t* elements, size_t count, float* scales, float* quaternions) {
+  const float32x4_t one = vdupq_n_f32(1);
+  const float32x4_t zero = vdupq_n_f32(0);
+  size_t i = 0;
+  for (; i + 4 <= count; i += 4) {
+    float32x4_t m[9];
+    for (int e = 0; e < 9; e++) {
+      int16x4_t v = vld1_s16(&elements[e * count + i]);
+      m[e] = vmulq_n_f32(vcvtq_f32_s32(vmovl_s16(v)), 1 / 4096.0f);
+    }
+    for (int c = 0; c < 3; c++) {
+      float32x4_t squared = vaddq_f32(vaddq_f32(vmulq_f32(m[c], m[c]), vmulq_f32(m[3 + c], m[3 + c])), vmulq_f32(m[6 + c], m[6 + c]));
+      uint32x4_t nonzero = vcgtq_f32(squared, zero);
+      float32x4_t inverse = vbslq_f32(nonzero, rsqrt_neon(squared), one);
+      vst1q_f32(&scales[c * count + i], vbslq_f32(nonzero, vmulq_f32(squared, inverse), zero));
+      for (int row = 0; row < 3; row++) {
+        m[3 * row + c] = vmulq_f32(m[3 * row + c], inverse);
+      }
+    }
+    float32x4_t trace = vaddq_f32(vaddq_f32(m[0], m[4]), m[8]);
+    float32x4_t d57 = vsubq_f32(m[5], m[7]), d62 = vsubq_f32(m[6], m[2]), d13 = vsubq_f32(m[1], m[3]);
+    float32x4_t s13 = vaddq_f32(m[3], m[1]), s26 = vaddq_f32(m[6], m[2]), s57 = vaddq_f32(m[7], m[5]);
+    float32x4_t q[4] = { d13, s26, s57, vsubq_f32(vsubq_f32(vaddq_f32(one, m[8]), m[0]), m[4]) };
+    uint32x4_t mask = vcgtq_f32(m[4], m[8]);
+    float32x4_t case2[4] = { d62, s13, vsubq_f32(vsubq_f32(vaddq_f32(one, m[4]), m[0]), m[8]), s57 };
+    for (int c = 0; c < 4; c++) q[c] = vbslq_f32(mask, case2[c], q[c]);
+    mask = vandq_u32(vcgtq_f32(m[0], m[4]), vcgtq_f32(m[0], m[8]));
+    float32x4_t case1[4] = { d57, vsubq_f32(vsubq_f32(vaddq_f32(one, m[0]), m[4]), m[8]), s13, s26 };
+    for (int c = 0; c < 4; c++) q[c] = vbslq_f32(mask, case1[c], q[c]);
+    mask = vcgtq_f32(trace, zero);
+    float32x4_t case0[4] = { vaddq_f32(one, trace), d57, d62, d13 };
+    for (int c = 0; c < 4; c++) q[c] = vbslq_f32(mask, case0[c], q[c]);
+    float32x4_t length = zero;
+    for (int c = 0; c < 4; c++) length = vaddq_f32(length, vmulq_f32(q[c], q[c]));
+    float32x4_t inverse = rsqrt_neon(length);
+    for (int c = 0; c < 4; c++) {
+      vst1q_f32(&quaternions[c * count + i], vmulq_f32(q[c], inverse));
+    }
+  }
+  return i;
+}
+#endif
+
+// Decomposes count 4.12 matrices into scales and normalized rotation
+// quaternions, as decompose, matrix_to_quaternion and
+// normalize_quaternion_inplace do for one matrix. All arrays are SoA, see
+// above.
+void decompose_matrices(const int16_t* elements, size_t count, float* scales, float* quaternions) {
+  size_t i = 0;
+#if defined(MATRIX_X86)
+  if (simd_limit >= SIMD_256 && __builtin_cpu_supports("avx2")) {
+    i = decompose_matrices_avx2(elements, count, scales, quaternions);
+  } else if (simd_limit >= SIMD_128 && __builtin_cpu_supports("sse4.1")) {
+    i = decompose_matrices_sse41(elements, count, scales, quaternions);
+  }
+#elif defined(MATRIX_NEON)
+  if (simd_limit >= SIMD_128) {
+    i = decompose_matrices_neon(elements, count, scales, quaternions);
+  }
+#endif
+  decompose_matrices_scalar(elements, i, count, scales, quaternions);
+}
+
+// transform holds a 3x3 matrix by rows, then a translation. Results are
+// rounded to the nearest integer and saturated to int16.
+static void transform_vertices_scalar(vertex_t* out, const vertex_t* in, size_t start, size_t count, const float* transform) {
+  for (size_t i = start; i < count; i++) {
+    float v[3] = { in[i].x, in[i].y, in[i].z };
+    int16_t r[3];
+    for (int row = 0; row < 3; row++) {
+      float f = transform[3 * row] * v[0] + transform[3 * row + 1] * v[1] + transform[3 * row + 2] * v[2] + transform[9 + row];
+      long n = lrintf(f);
+      r[row] = n < INT16_MIN ? INT16_MIN : n > INT16_MAX ? INT16_MAX : n;
+    }
+    out[i] = (vertex_t) { r[0], r[1], r[2] };
+  }
+}
+
+#ifdef MATRIX_X86
+// 8 vertices are 3 vectors of int16. The masks pick each axis out of each
+// vector, -1 bytes zeroing lanes that come from another vector.
+static const int8_t deinterleave_masks[3][3][16] = {
+  {
+    { 0, 1, 6, 7, 12, 13, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
+    { -1, -1, -1, -1, -1, -1, 2, 3, 8, 9, 14, 15, -1, -1, -1, -1 },
+    { -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 4, 5, 10, 11 }
+  },
+  {
+    { 2, 3, 8, 9, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
+    { -1, -1, -1, -1, -1, -1, 4, 5, 10, 11, -1, -1, -1, -1, -1, -1 },
+    { -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 0, 1, 6, 7, 12, 13 }
+  },
+  {
+    { 4, 5, 10, 11, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
+    { -1, -1, -1, -1, 0, 1, 6, 7, 12, 13, -1, -1, -1, -1, -1, -1 },
+    { -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 2, 3, 8, 9, 14, 15 }
+  }
+};
+
+// And back: for each output vector, where its lanes come from in the x, y
+// and z vectors
+static const int8_t interleave_masks[3][3][16] = {
+  {
+    { 0, 1, -1, -1, -1, -1, 2, 3, -1, -1, -1, -1, 4, 5, -1, -1 },
+    { -1, -1, 0, 1, -1, -1, -1, -1, 2, 3, -1, -1, -1, -1, 4, 5 },
+    { -1, -1, -1, -1, 0, 1, -1, -1, -1, -1, 2, 3, -1, -1, -1, -1 }
+  },
+  {
+    { -1, -1, 6, 7, -1, -1, -1, -1, 8, 9, -1, -1, -1, -1, 10, 11 },
+    { -1, -1, -1, -1, 6, 7, -1, -1, -1, -1, 8, 9, -1, -1, -1, -1 },
+    { 4, 5, -1, -1, -1, -1, 6, 7, -1, -1, -1, -1, 8, 9, -1, -1 }
+  },
+  {
+    { -1, -1, -1, -1, 12, 13, -1, -1, -1, -1, 14, 15, -1, -1, -1, -1 },
+    { 10, 11, -1, -1, -1, -1, 12, 13, -1, -1, -1, -1, 14, 15, -1, -1 },
+    { -1, -1, 10, 11, -1, -1, -1, -1, 12, 13, -1, -1, -1, -1, 14, 15 }
+  }
+};
+
+// Inlined, so the AVX2 kernel doesn't pay for switching to legacy SSE
+__attribute__((target("sse4.1"), always_inline))
+static inline void deinterleave_vertices(__m128i* axes, const vertex_t* in) {
+  __m128i v[3];
+  for (int k = 0; k < 3; k++) {
+    v[k] = _mm_loadu_si128((const __m128i*) ((const int16_t*) in + 8 * k));
+  }
+  for (int axis = 0; axis < 3; axis++) {
+    axes[axis] = _mm_setzero_si128();
+    for (int k = 0; k < 3; k++) {
+      __m128i mask = _mm_loadu_si128((const __m128i*) deinterleave_masks[axis][k]);
+      axes[axis] = _mm_or_si128(axes[axis], _mm_shuffle_epi8(v[k], mask));
+    }
+  }
+}
+
+__attribute__((target("sse4.1"), always_inline))
+static inline void interleave_vertices(vertex_t* out, const __m128i* axes) {
+  for (int k = 0; k < 3; k++) {
+    __m128i v = _mm_setzero_si128();
+    for (int axis = 0; axis < 3; axis++) {
+      __m128i mask = _mm_loadu_si128((const __m128i*) interleave_masks[k][axis]);
+      v = _mm_or_si128(v, _mm_shuffle_epi8(axes[axis], mask));
+    }
+    _mm_storeu_si128((__m128i*) ((int16_t*) out + 8 * k), v);
+  }
+}
+
+__attribute__((target("sse4.1")))
+static size_t transform_vertices_sse41(vertex_t* out, const vertex_t* in, size_t count, const float* transform) {
+  __m128 m[12];
+  for (int k = 0; k < 12; k++) {
+    m[k] = _mm_set1_ps(transform[k]);
+  }
+  size_t i = 0;
+  // 8 vertices per iteration, in two halves of 4
+  for (; i + 8 <= count; i += 8) {
+    __m128i axes[3];
+    deinterleave_vertices(axes, &in[i]);
+    __m128i results[3];
+    __m128i halves[2][3];
+    for (int half = 0; half < 2; half++) {
+      __m128 v[3];
+      for (int axis = 0; axis < 3; axis++) {
+        v[axis] = _mm_cvtepi32_ps(_mm_cvtepi16_epi32(half ? _mm_srli_si128(axes[axis], 8) : axes[axis]));
+      }
+      for (int row = 0; row < 3; row++) {
+        __m128 f = _mm_add_ps(_mm_mul_ps(m[3 * row], v[0]), _mm_mul_ps(m[3 * row + 1], v[1]));
+        f = _mm_add_ps(_mm_add_ps(f, _mm_mul_ps(m[3 * row + 2], v[2])), m[9 + row]);
+        halves[half][row] = _mm_cvtps_epi32(f);
+      }
+    }
+    for (int row = 0; row < 3; row++) {
+      results[row] = _mm_packs_epi32(halves[0][row], halves[1][row]);
+    }
+    interleave_vertices(&out[i], results);
+  }
+  return i;
+}
+
+__attribute__((target("avx2")))
+static size_t transform_vertices_avx2(vertex_t* out, const vertex_t* in, size_t count, const float* transform) {
+  __m256 m[12];
+  for (int k = 0; k < 12; k++) {
+    m[k] = _mm256_set1_ps(transform[k]);
+  }
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m128i axes[3];
+    deinterleave_vertices(axes, &in[i]);
+    __m256 v[3];
+    for (int axis = 0; axis < 3; axis++) {
+      v[axis] = _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(axes[axis]));
+    }
+    __m128i results[3];
+    for (int row = 0; row < 3; row++) {
+      __m256 f = _mm256_add_ps(_mm256_mul_ps(m[3 * row], v[0]), _mm256_mul_ps(m[3 * row + 1], v[1]));
+      f = _mm256_add_ps(_mm256_add_ps(f, _mm256_mul_ps(m[3 * row + 2], v[2])), m[9 + row]);
+      __m256i n = _mm256_cvtps_epi32(f);
+      results[row] = _mm_packs_epi32(_mm256_castsi256_si128(n), _mm256_extracti128_si256(n, 1));
+    }
+    interleave_vertices(&out[i], results);
+  }
+  return i;
+}
+#endif
+
+#ifdef MATRIX_NEON
+static size_t transform_vertices_neon(vertex_t* out, const vertex_t* in, size_t count, const float* transform) {
+  float32x4_t m[12];
+  for (int k = 0; k < 12; k++) {
+    m[k] = vdupq_n_f32(transform[k]);
+  }
+  size_t i = 0;
+  for (; i + 4 <= count; i += 4) {
+    int16x4x3_t axes = vld3_s16((const int16_t*) &in[i]);
+    float32x4_t v[3];
+    for (int axis = 0; axis < 3; axis++) {
+      v[axis] = vcvtq_f32_s32(vmovl_s16(axes.val[axis]));
+    }
+    int16x4x3_t results;
+    for (int row = 0; row < 3; row++) {
+      float32x4_t f = vaddq_f32(vmulq_f32(m[3 * row], v[0]), vmulq_f32(m[3 * row + 1], v[1]));
+      f = vaddq_f32(vaddq_f32(f, vmulq_f32(m[3 * row + 2], v[2])), m[9 + row]);
+      results.val[row] = vqmovn_s32(vcvtnq_s32_f32(f));
+    }
+    vst3_s16((int16_t*) &out[i], results);
+  }
+  return i;
+}
+#endif
+
+// Transforms count vertices by a 3x4 float transform, see above. out may be
+// in.
+void transform_vertices(vertex_t* out, const vertex_t* in, size_t count, const float* transform) {
+  size_t i = 0;
+#if defined(MATRIX_X86)
+  if (simd_limit >= SIMD_256 && __builtin_cpu_supports("avx2")) {
+    i = transform_vertices_avx2(out, in, count, transform);
+  } else if (simd_limit >= SIMD_128 && __builtin_cpu_supports("sse4.1")) {
+    i = transform_vertices_sse41(out, in, count, transform);
+  }
+#elif defined(MATRIX_NEON)
+  if (simd_limit >= SIMD_128) {
+    i = transform_vertices_neon(out, in, count, transform);
+  }
+#endif
+  transform_vertices_scalar(out, in, i, count, transform);
+}
+
+// The GTE's RotTrans: IR = (TR * 1000h + RT * V) >> 12 for each row, summed
+// in 44 bits and saturated to int16 in IR1 to IR3. Unlike rotate(), the
+// products aren't divided one by one, so the low bits of all three carry
+// into the result, and the shift floors instead of truncating toward zero.
+static int64_t gte_mac(int64_t value, int row, uint32_t* flags) {
+  if (value > 0x7ffffffffffll) {
+    *flags |= GTE_FLAG_MAC1_POSITIVE >> row;
+  } else if (value < -0x80000000000ll) {
+    *flags |= GTE_FLAG_MAC1_NEGATIVE >> row;
+  }
+  return (int64_t) ((uint64_t) value << 20) >> 20;
+}
+
+// One row of MVMVA with the shift: MAC = (TR * 1000h + RT * V) >> 12
+static int64_t gte_multiply_row(matrix_t m, int row, int64_t tr, const int32_t* v, uint32_t* flags) {
+  int64_t mac = gte_mac(tr * 4096 + m.x[3 * row] * v[0], row, flags);
+  mac = gte_mac(mac + m.x[3 * row + 1] * v[1], row, flags);
+  return gte_mac(mac + m.x[3 * row + 2] * v[2], row, flags) >> 12;
+}
+
+static int16_t gte_saturate(int64_t mac, int row, uint32_t* flags) {
+  if (mac > INT16_MAX || mac < INT16_MIN) {
+    *flags |= GTE_FLAG_IR1_SATURATED >> row;
+    return mac > INT16_MAX ? INT16_MAX : INT16_MIN;
+  }
+  return mac;
+}
+
+static uint32_t gte_rotate_translate_scalar(vertex_t* out, const vertex_t* in, size_t start, size_t count, matrix_t m, const int32_t* translation) {
+  uint32_t flags = 0;
+  for (size_t i = start; i < count; i++) {
+    int32_t v[3] = { in[i].x, in[i].y, in[i].z };
+    int16_t ir[3];
+    for (int row = 0; row < 3; row++) {
+      ir[row] = gte_saturate(gte_multiply_row(m, row, translation[row], v, &flags), row, &flags);
+    }
+    out[i] = (vertex_t) { ir[0], ir[1], ir[2] };
+  }
+  return flags;
+}
+
+// The vector kernels work in 32-bit lanes. Each product splits into its
+// part above bit 12 and its low 12 bits, and (TR * 1000h + p0 + p1 + p2) >> 12
+// is TR plus the high parts plus the sum of the low parts >> 12. With TR
+// within 30 bits none of that overflows 32 bits, and the MAC flags can't be
+// set either, see gte_rotate_translate.
+#ifdef MATRIX_X86
+__attribute__((target("sse4.1"), always_inline))
+static inline __m128i gte_row_sse41(const __m128i* v, const __m128i* m, __m128i t) {
+  const __m128i low_mask = _mm_set1_epi32(0xfff);
+  __m128i high = t;
+  __m128i low = _mm_setzero_si128();
+  for (int k = 0; k < 3; k++) {
+    __m128i p = _mm_mullo_epi32(m[k], v[k]);
+    high = _mm_add_epi32(high, _mm_srai_epi32(p, 12));
+    low = _mm_add_epi32(low, _mm_and_si128(p, low_mask));
+  }
+  return _mm_add_epi32(high, _mm_srai_epi32(low, 12));
+}
+
+__attribute__((target("sse4.1")))
+static size_t gte_rotate_translate_sse41(vertex_t* out, const vertex_t* in, size_t count, matrix_t m, const int32_t* translation, uint32_t* flags) {
+  __m128i rows[3][3];
+  __m128i t[3] = {
+    _mm_set1_epi32(translation[0]), _mm_set1_epi32(translation[1]), _mm_set1_epi32(translation[2])
+  };
+  for (int k = 0; k < 9; k++) {
+    rows[k / 3][k % 3] = _mm_set1_epi32(m.x[k]);
+  }
+  const __m128i max = _mm_set1_epi32(INT16_MAX);
+  const __m128i min = _mm_set1_epi32(INT16_MIN);
+  __m128i saturated[3] = { _mm_setzero_si128(), _mm_setzero_si128(), _mm_setzero_si128() };
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m128i axes[3];
+    deinterleave_vertices(axes, &in[i]);
+    __m128i halves[2][3];
+    for (int half = 0; half < 2; half++) {
+      __m128i v[3];
+      for (int axis = 0; axis < 3; axis++) {
+        v[axis] = _mm_cvtepi16_epi32(half ? _mm_srli_si128(axes[axis], 8) : axes[axis]);
+      }
+      for (int row = 0; row < 3; row++) {
+        __m128i mac = gte_row_sse41(v, rows[row], t[row]);
+        saturated[row] = _mm_or_si128(saturated[row],
+          _mm_or_si128(_mm_cmpgt_epi32(mac, max), _mm_cmplt_epi32(mac, min)));
+        halves[half][row] = mac;
+      }
+    }
+    __m128i results[3];
+    for (int row = 0; row < 3; row++) {
+      results[row] = _mm_packs_epi32(halves[0][row], halves[1][row]);
+    }
+    interleave_vertices(&out[i], results);
+  }
+  for (int row = 0; row < 3; row++) {
+    if (_mm_movemask_epi8(saturated[row])) {
+      *flags |= GTE_FLAG_IR1_SATURATED >> row;
+    }
+  }
+  return i;
+}
+
+__attribute__((target("avx2")))
+static size_t gte_rotate_translate_avx2(vertex_t* out, const vertex_t* in, size_t count, matrix_t m, const int32_t* translation, uint32_t* flags) {
+  __m256i rows[3][3];
+  __m256i t[3] = {
+    _mm256_set1_epi32(translation[0]), _mm256_set1_epi32(translation[1]), _mm256_set1_epi32(translation[2])
+  };
+  for (int k = 0; k < 9; k++) {
+    rows[k / 3][k % 3] = _mm256_set1_epi32(m.x[k]);
+  }
+  const __m256i low_mask = _mm256_set1_epi32(0xfff);
+  const __m256i max = _mm256_set1_epi32(INT16_MAX);
+  const __m256i min = _mm256_set1_epi32(INT16_MIN);
+  __m256i saturated[3] = { _mm256_setzero_si256(), _mm256_setzero_si256(), _mm256_setzero_si256() };
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m128i axes[3];
+    deinterleave_vertices(axes, &in[i]);
+    __m256i v[3];
+    for (int axis = 0; axis < 3; axis++) {
+      v[axis] = _mm256_cvtepi16_epi32(axes[axis]);
+    }
+    __m128i results[3];
+    for (int row = 0; row < 3; row++) {
+      __m256i high = t[row];
+      __m256i low = _mm256_setzero_si256();
+      for (int k = 0; k < 3; k++) {
+        __m256i p = _mm256_mullo_epi32(rows[row][k], v[k]);
+        high = _mm256_add_epi32(high, _mm256_srai_epi32(p, 12));
+        low = _mm256_add_epi32(low, _mm256_and_si256(p, low_mask));
+      }
+      __m256i mac = _mm256_add_epi32(high, _mm256_srai_epi32(low, 12));
+      saturated[row] = _mm256_or_si256(saturated[row],
+        _mm256_or_si256(_mm256_cmpgt_epi32(mac, max), _mm256_cmpgt_epi32(min, mac)));
+      results[row] = _mm_packs_epi32(_mm256_castsi256_si128(mac), _mm256_extracti128_si256(mac, 1));
+    }
+    interleave_vertices(&out[i], results);
+  }
+  for (int row = 0; row < 3; row++) {
+    if (_mm256_movemask_epi8(saturated[row])) {
+      *flags |= GTE_FLAG_IR1_SATURATED >> row;
+    }
+  }
+  return i;
+}
+#endif
+
+#ifdef MATRIX_NEON
+static size_t gte_rotate_translate_neon(vertex_t* out, const vertex_t* in, size_t count, matrix_t m, const int32_t* translation, uint32_t* flags) {
+  int32x4_t t[3] = { vdupq_n_s32(translation[0]), vdupq_n_s32(translation[1]), vdupq_n_s32(translation[2]) };
+  const int32x4_t low_mask = vdupq_n_s32(0xfff);
+  const int32x4_t max = vdupq_n_s32(INT16_MAX);
+  const int32x4_t min = vdupq_n_s32(INT16_MIN);
+  uint32x4_t saturated[3] = { vdupq_n_u32(0), vdupq_n_u32(0), vdupq_n_u32(0) };
+  size_t i = 0;
+  for (; i + 4 <= count; i += 4) {
+    int16x4x3_t axes = vld3_s16((const int16_t*) &in[i]);
+    int16x4x3_t results;
+    for (int row = 0; row < 3; row++) {
+      int32x4_t high = t[row];
+      int32x4_t low = vdupq_n_s32(0);
+      for (int k = 0; k < 3; k++) {
+        int32x4_t p = vmull_n_s16(axes.val[k], m.x[3 * row + k]);
+        high = vaddq_s32(high, vshrq_n_s32(p, 12));
+        low = vaddq_s32(low, vandq_s32(p, low_mask));
+      }
+      int32x4_t mac = vaddq_s32(high, vshrq_n_s32(low, 12));
+      saturated[row] = vorrq_u32(saturated[row], vorrq_u32(vcgtq_s32(mac, max), vcltq_s32(mac, min)));
+      results.val[row] = vqmovn_s32(mac);
+    }
+    vst3_s16((int16_t*) &out[i], results);
+  }
+  for (int row = 0; row < 3; row++) {
+    uint32_t lanes[4];
+    vst1q_u32(lanes, saturated[row]);
+    if (lanes[0] | lanes[1] | lanes[2] | lanes[3]) {
+      *flags |= GTE_FLAG_IR1_SATURATED >> row;
+    }
+  }
+  return i;
+}
+#endif
+
+// Transforms count vertices as the GTE's RotTrans does, see above, with TR
+// set to translation. out may be in. Returns the FLAG register bits set by
+// any of them, with the error bit 31 set the way the GTE sets it.
+uint32_t gte_rotate_translate(vertex_t* out, const vertex_t* in, size_t count, matrix_t m, const int32_t* translation) {
+  uint32_t flags = 0;
+  size_t i = 0;
+  int vector = 1;
+  for (int row = 0; row < 3; row++) {
+    vector &= translation[row] >= -(1 << 30) && translation[row] < (1 << 30);
+  }
+#if defined(MATRIX_X86)
+  if (vector && simd_limit >= SIMD_256 && __builtin_cpu_supports("avx2")) {
+    i = gte_rotate_translate_avx2(out, in, count, m, translation, &flags);
+  } else if (vector && simd_limit >= SIMD_128 && __builtin_cpu_supports("sse4.1")) {
+    i = gte_rotate_translate_sse41(out, in, count, m, translation, &flags);
+  }
+#elif defined(MATRIX_NEON)
+  if (vector && simd_limit >= SIMD_128) {
+    i = gte_rotate_translate_neon(out, in, count, m, translation, &flags);
+  }
+#endif
+  flags |= gte_rotate_translate_scalar(out, in, i, count, m, translation);
+  if (flags & GTE_FLAG_ERRORS) {
+    flags |= GTE_FLAG_ERROR;
+  }
+  return flags;
+}
+
+// Composes a child's transform with its parent's the way the libraries walk
+// a hierarchy on the GTE: each column of the child's rotation goes through
+// MVMVA with the parent's rotation, saturated to int16 in IR1 to IR3, and the
+// child's translation goes through it with the parent's translation as TR,
+// read back from the 32-bit MAC1 to MAC3. rotation and translation may be
+// the parent's. Returns the FLAG bits as gte_rotate_translate does.
+uint32_t gte_compose(matrix_t* rotation, int32_t* translation, matrix_t parent, const int32_t* parent_translation, matrix_t local, vertex_t local_translation) {
+  uint32_t flags = 0;
+  matrix_t m;
+  for (int column = 0; column < 3; column++) {
+    int32_t v[3] = { local.x[column], local.x[3 + column], local.x[6 + column] };
+    for (int row = 0; row < 3; row++) {
+      m.x[3 * row + column] = gte_saturate(gte_multiply_row(parent, row, 0, v, &flags), row, &flags);
+    }
+  }
+  int32_t v[3] = { local_translation.x, local_translation.y, local_translation.z };
+  int32_t t[3];
+  for (int row = 0; row < 3; row++) {
+    t[row] = gte_multiply_row(parent, row, parent_translation[row], v, &flags);
+  }
+  *rotation = m;
+  memcpy(translation, t, sizeof(t));
+  if (flags & GTE_FLAG_ERRORS) {
+    flags |= GTE_FLAG_ERROR;
+  }
+  return flags;
+}
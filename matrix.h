@@ -19,6 +19,15 @@ typedef struct quaternion_s {
   float z;
 } quaternion_t;
 
+// Bits of the GTE's FLAG register that gte_rotate_translate and gte_compose
+// set. MAC2 and MAC3 and IR2 and IR3 are the bits below MAC1 and IR1.
+#define GTE_FLAG_ERROR (1u << 31)
+#define GTE_FLAG_MAC1_POSITIVE (1u << 30)
+#define GTE_FLAG_MAC1_NEGATIVE (1u << 27)
+#define GTE_FLAG_IR1_SATURATED (1u << 24)
+// The bits that also set GTE_FLAG_ERROR, which IR3 saturating doesn't
+#define GTE_FLAG_ERRORS 0x7f87e000u
+
 vertex_t rotate(matrix_t m, vertex_t v);
 vertex_t translate(vertex_t a, vertex_t b);
 fmatrix_t matrix_to_fmatrix(matrix_t m);
@@ -27,3 +36,8 @@ void display_matrix_debug(matrix_t* m);
 void display_quaternion_debug(quaternion_t* q);
 void normalize_quaternion_inplace(quaternion_t* q);
 void decompose(fmatrix_t m, fmatrix_t* s_out, fmatrix_t* r_out);
+void vertices_to_floats(float* out, float* bounds_min, float* bounds_max, const vertex_t* vertices, size_t count, const float* scale);
+void decompose_matrices(const int16_t* elements, size_t count, float* scales, float* quaternions);
+void transform_vertices(vertex_t* out, const vertex_t* in, size_t count, const float* transform);
+uint32_t gte_rotate_translate(vertex_t* out, const vertex_t* in, size_t count, matrix_t m, const int32_t* translation);
+uint32_t gte_compose(matrix_t* rotation, int32_t* translation, matrix_t parent, const int32_t* parent_translation, matrix_t local, vertex_t local_translation);
@@ -0,0 +1,783 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "mesh.h"
+
+#define WELD_EMPTY UINT32_MAX
+
+// The table never grows, so size it for the worst case where every key is
+// unique and keep the load factor at or below 1/2
+void weld_table_init(weld_table_t* table, size_t max_keys) {
+  size_t capacity = 16;
+  while (capacity < 2 * max_keys) {
+    capacity *= 2;
+  }
+  table->keys = malloc(capacity * sizeof(uint64_t));
+  table->ids = malloc(capacity * sizeof(uint32_t));
+  memset(table->ids, 0xff, capacity * sizeof(uint32_t));
+  table->capacity = capacity;
+  table->count = 0;
+}
+
+static size_t weld_hash(uint64_t key) {
+  key ^= key >> 33;
+  key *= 0xff51afd7ed558ccdULL;
+  key ^= key >> 33;
+  return (size_t) key;
+}
+
+// Returns the welded index for key, assigning the next free index if the key
+// hasn't been seen before. *is_new is set to 1 in that case.
+uint32_t weld_table_insert(weld_table_t* table, uint64_t key, int* is_new) {
+  size_t mask = table->capacity - 1;
+  size_t slot = weld_hash(key) & mask;
+  while (table->ids[slot] != WELD_EMPTY) {
+    if (table->keys[slot] == key) {
+      *is_new = 0;
+      return table->ids[slot];
+    }
+    slot = (slot + 1) & mask;
+  }
+  table->keys[slot] = key;
+  table->ids[slot] = table->count;
+  *is_new = 1;
+  return table->count++;
+}
+
+void weld_table_free(weld_table_t* table) {
+  free(table->keys);
+  free(table->ids);
+  table->keys = NULL;
+  table->ids = NULL;
+}
+
+// Average cache miss ratio: vertex shader invocations per triangle for a FIFO
+// post-transform cache of the given size. 0.5 is the best a closed mesh can
+// do, 3 means nothing is ever reused.
+float mesh_acmr(const uint32_t* indices, size_t index_count, size_t vertex_count, size_t cache_size) {
+  if (index_count < 3) {
+    return 0;
+  }
+  // Timestamps of when each vertex entered the cache, a vertex is a hit if it
+  // entered fewer than cache_size misses ago
+  size_t* entered = malloc(vertex_count * sizeof(size_t));
+  memset(entered, 0, vertex_count * sizeof(size_t));
+  size_t misses = 0;
+  for (size_t i = 0; i < index_count; i++) {
+    uint32_t v = indices[i];
+    if (entered[v] == 0 || misses + 1 - entered[v] > cache_size) {
+      misses++;
+      entered[v] = misses;
+    }
+  }
+  free(entered);
+  return (float) misses / (index_count / 3);
+}
+
+// Tom Forsyth's "Linear-Speed Vertex Cache Optimisation". Vertices are scored
+// by their position in a simulated LRU cache and by how many triangles still
+// use them, and the highest scoring triangle touching the cache is emitted
+// next.
+#define FORSYTH_CACHE_SIZE 32
+
+static float forsyth_vertex_score(int cache_position, uint32_t live_triangles) {
+  if (live_triangles == 0) {
+    return -1;
+  }
+  float score = 0;
+  if (cache_position < 0) {
+    // Not in the cache
+  } else if (cache_position < 3) {
+    // The triangle that was just emitted; using it again right away is no
+    // better than any other cached vertex, otherwise we get strips
+    score = 0.75;
+  } else {
+    float scaler = 1.0 / (FORSYTH_CACHE_SIZE - 3);
+    score = 1.0 - (cache_position - 3) * scaler;
+    score = powf(score, 1.5);
+  }
+  score += 2.0 / sqrtf(live_triangles);
+  return score;
+}
+
+// Reorders the triangles in indices in place, vertex indices are unchanged
+void optimize_vertex_cache(uint32_t* indices, size_t index_count, size_t vertex_count) {
+  size_t triangle_count = index_count / 3;
+  if (triangle_count < 2) {
+    return;
+  }
+
+  // Triangles using each vertex, packed into one array. Vertex v's triangles
+  // start at adjacency_start[v], and the first live_triangles[v] of them
+  // haven't been emitted yet.
+  uint32_t* live_triangles = calloc(vertex_count, sizeof(uint32_t));
+  uint32_t* adjacency_start = malloc(vertex_count * sizeof(uint32_t));
+  uint32_t* adjacency = malloc(index_count * sizeof(uint32_t));
+  for (size_t i = 0; i < index_count; i++) {
+    live_triangles[indices[i]]++;
+  }
+  uint32_t* fill = malloc(vertex_count * sizeof(uint32_t));
+  uint32_t offset = 0;
+  for (size_t v = 0; v < vertex_count; v++) {
+    adjacency_start[v] = offset;
+    fill[v] = offset;
+    offset += live_triangles[v];
+  }
+  for (size_t i = 0; i < index_count; i++) {
+    adjacency[fill[indices[i]]++] = i / 3;
+  }
+  free(fill);
+
+  int* cache_position = malloc(vertex_count * sizeof(int));
+  float* vertex_score = malloc(vertex_count * sizeof(float));
+  for (size_t v = 0; v < vertex_count; v++) {
+    cache_position[v] = -1;
+    vertex_score[v] = forsyth_vertex_score(-1, live_triangles[v]);
+  }
+  float* triangle_score = malloc(triangle_count * sizeof(float));
+  uint8_t* emitted = calloc(triangle_count, sizeof(uint8_t));
+  for (size_t t = 0; t < triangle_count; t++) {
+    triangle_score[t] =
+      vertex_score[indices[3 * t + 0]] +
+      vertex_score[indices[3 * t + 1]] +
+      vertex_score[indices[3 * t + 2]];
+  }
+
+  uint32_t* output = malloc(index_count * sizeof(uint32_t));
+  uint32_t cache[FORSYTH_CACHE_SIZE + 3];
+  size_t cache_count = 0;
+  size_t input_cursor = 0;
+  for (size_t out = 0; out < triangle_count; out++) {
+    // Pick the best triangle touching the cache, or the first remaining one in
+    // input order if the cache has nothing left to offer
+    int64_t best = -1;
+    float best_score = -1;
+    for (size_t c = 0; c < cache_count; c++) {
+      uint32_t v = cache[c];
+      uint32_t* triangles = &adjacency[adjacency_start[v]];
+      for (uint32_t a = 0; a < live_triangles[v]; a++) {
+        uint32_t t = triangles[a];
+        if (triangle_score[t] > best_score) {
+          best = t;
+          best_score = triangle_score[t];
+        }
+      }
+    }
+    if (best < 0) {
+      while (emitted[input_cursor]) {
+        input_cursor++;
+      }
+      best = input_cursor;
+    }
+
+    emitted[best] = 1;
+    memcpy(&output[3 * out], &indices[3 * best], 3 * sizeof(uint32_t));
+
+    // Move the triangle's vertices to the front of the LRU cache
+    uint32_t new_cache[FORSYTH_CACHE_SIZE + 3];
+    size_t new_cache_count = 0;
+    for (int k = 0; k < 3; k++) {
+      uint32_t v = indices[3 * best + k];
+      new_cache[new_cache_count++] = v;
+      // Drop this triangle from the vertex's adjacency so it isn't scanned
+      // again
+      uint32_t* triangles = &adjacency[adjacency_start[v]];
+      for (uint32_t a = 0; a < live_triangles[v]; a++) {
+        if (triangles[a] == best) {
+          triangles[a] = triangles[live_triangles[v] - 1];
+          live_triangles[v]--;
+          break;
+        }
+      }
+    }
+    for (size_t c = 0; c < cache_count; c++) {
+      uint32_t v = cache[c];
+      if (v != new_cache[0] && v != new_cache[1] && v != new_cache[2]) {
+        new_cache[new_cache_count++] = v;
+      }
+    }
+    for (size_t c = FORSYTH_CACHE_SIZE; c < new_cache_count; c++) {
+      cache_position[new_cache[c]] = -1;
+    }
+    cache_count = new_cache_count < FORSYTH_CACHE_SIZE ?
+      new_cache_count : FORSYTH_CACHE_SIZE;
+    memcpy(cache, new_cache, cache_count * sizeof(uint32_t));
+
+    // Rescore every vertex whose cache position changed, including the ones
+    // that just fell out, and the triangles that use them
+    for (size_t c = 0; c < new_cache_count; c++) {
+      uint32_t v = new_cache[c];
+      if (c < FORSYTH_CACHE_SIZE) {
+        cache_position[v] = c;
+      }
+      float score = forsyth_vertex_score(cache_position[v], live_triangles[v]);
+      float delta = score - vertex_score[v];
+      vertex_score[v] = score;
+      uint32_t* triangles = &adjacency[adjacency_start[v]];
+      for (uint32_t a = 0; a < live_triangles[v]; a++) {
+        triangle_score[triangles[a]] += delta;
+      }
+    }
+  }
+
+  memcpy(indices, output, index_count * sizeof(uint32_t));
+  free(output);
+  free(emitted);
+  free(triangle_score);
+  free(vertex_score);
+  free(cache_position);
+  free(adjacency);
+  free(adjacency_start);
+  free(live_triangles);
+}
+
+// Renumbers vertices in the order the index buffer first uses them so that
+// vertex fetches walk memory forwards. Rewrites indices in place and fills
+// remap[old] = new; the caller is responsible for moving the attributes.
+void optimize_vertex_fetch_remap(uint32_t* remap, uint32_t* indices, size_t index_count, size_t vertex_count) {
+  memset(remap, 0xff, vertex_count * sizeof(uint32_t));
+  uint32_t next = 0;
+  for (size_t i = 0; i < index_count; i++) {
+    uint32_t v = indices[i];
+    if (remap[v] == UINT32_MAX) {
+      remap[v] = next++;
+    }
+    indices[i] = remap[v];
+  }
+  // Vertices no face refers to go at the end
+  for (size_t v = 0; v < vertex_count; v++) {
+    if (remap[v] == UINT32_MAX) {
+      remap[v] = next++;
+    }
+  }
+}
+
+static void meshlet_compute_bounds(meshlet_set_t* set, size_t m, const float* positions) {
+  meshlet_t* meshlet = &set->meshlets[m];
+  meshlet_bounds_t* bounds = &set->bounds[m];
+  const uint32_t* vertices = &set->vertices[meshlet->vertex_offset];
+  const uint8_t* triangles = &set->triangles[3 * meshlet->triangle_offset];
+
+  // Ritter's bounding sphere: start from the two points furthest apart along
+  // the widest axis, then grow to cover anything left outside
+  size_t min_ix[3] = {0, 0, 0};
+  size_t max_ix[3] = {0, 0, 0};
+  for (size_t v = 0; v < meshlet->vertex_count; v++) {
+    const float* p = &positions[3 * vertices[v]];
+    for (int k = 0; k < 3; k++) {
+      if (p[k] < positions[3 * vertices[min_ix[k]] + k]) min_ix[k] = v;
+      if (p[k] > positions[3 * vertices[max_ix[k]] + k]) max_ix[k] = v;
+    }
+  }
+  int widest = 0;
+  float widest_distance = -1;
+  for (int k = 0; k < 3; k++) {
+    const float* a = &positions[3 * vertices[min_ix[k]]];
+    const float* b = &positions[3 * vertices[max_ix[k]]];
+    float d = (b[0] - a[0]) * (b[0] - a[0]) +
+      (b[1] - a[1]) * (b[1] - a[1]) +
+      (b[2] - a[2]) * (b[2] - a[2]);
+    if (d > widest_distance) {
+      widest_distance = d;
+      widest = k;
+    }
+  }
+  const float* a = &positions[3 * vertices[min_ix[widest]]];
+  const float* b = &positions[3 * vertices[max_ix[widest]]];
+  float center[3] = {
+    (a[0] + b[0]) / 2, (a[1] + b[1]) / 2, (a[2] + b[2]) / 2
+  };
+  float radius = sqrtf(widest_distance) / 2;
+  for (size_t v = 0; v < meshlet->vertex_count; v++) {
+    const float* p = &positions[3 * vertices[v]];
+    float d[3] = { p[0] - center[0], p[1] - center[1], p[2] - center[2] };
+    float distance = sqrtf(d[0] * d[0] + d[1] * d[1] + d[2] * d[2]);
+    if (distance > radius) {
+      float new_radius = (radius + distance) / 2;
+      float shift = (new_radius - radius) / distance;
+      for (int k = 0; k < 3; k++) {
+        center[k] += d[k] * shift;
+      }
+      radius = new_radius;
+    }
+  }
+  memcpy(bounds->center, center, sizeof(center));
+  bounds->radius = radius;
+
+  // The cone axis is the average face normal, and the cutoff comes from the
+  // normal that strays furthest from it. Meshlets with normals more than 90
+  // degrees apart can't be cone culled, which a cutoff of 1 expresses.
+  float normals[MESHLET_MAX_TRIANGLES][3];
+  size_t normal_count = 0;
+  float axis[3] = {0, 0, 0};
+  for (size_t t = 0; t < meshlet->triangle_count; t++) {
+    const float* p0 = &positions[3 * vertices[triangles[3 * t + 0]]];
+    const float* p1 = &positions[3 * vertices[triangles[3 * t + 1]]];
+    const float* p2 = &positions[3 * vertices[triangles[3 * t + 2]]];
+    float e1[3] = { p1[0] - p0[0], p1[1] - p0[1], p1[2] - p0[2] };
+    float e2[3] = { p2[0] - p0[0], p2[1] - p0[1], p2[2] - p0[2] };
+    float n[3] = {
+      e1[1] * e2[2] - e1[2] * e2[1],
+      e1[2] * e2[0] - e1[0] * e2[2],
+      e1[0] * e2[1] - e1[1] * e2[0]
+    };
+    float length = sqrtf(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+    if (length == 0) {
+      continue;
+    }
+    for (int k = 0; k < 3; k++) {
+      normals[normal_count][k] = n[k] / length;
+      axis[k] += normals[normal_count][k];
+    }
+    normal_count++;
+  }
+  float axis_length = sqrtf(axis[0] * axis[0] + axis[1] * axis[1] + axis[2] * axis[2]);
+  float min_dot = 1;
+  if (axis_length > 0) {
+    for (int k = 0; k < 3; k++) {
+      axis[k] /= axis_length;
+    }
+    for (size_t n = 0; n < normal_count; n++) {
+      float dot = normals[n][0] * axis[0] + normals[n][1] * axis[1] + normals[n][2] * axis[2];
+      if (dot < min_dot) {
+        min_dot = dot;
+      }
+    }
+  } else {
+    min_dot = 0;
+  }
+  memcpy(bounds->cone_axis, axis, sizeof(axis));
+  bounds->cone_cutoff = min_dot <= 0 ? 1 : sqrtf(1 - min_dot * min_dot);
+}
+
+// Greedily splits a triangle list into meshlets in the order given, which
+// should already be cache optimized so that neighbouring triangles share
+// vertices. Meshlets are appended to set, so calling this once per material
+// group keeps the groups apart. positions holds 3 floats per vertex.
+void build_meshlets(meshlet_set_t* set, const uint32_t* indices, size_t index_count, const float* positions, size_t vertex_count) {
+  size_t triangle_count = index_count / 3;
+  // Worst case is one meshlet per triangle
+  size_t max_meshlets = set->meshlet_count + triangle_count;
+  set->meshlets = realloc(set->meshlets, max_meshlets * sizeof(meshlet_t));
+  set->bounds = realloc(set->bounds, max_meshlets * sizeof(meshlet_bounds_t));
+  set->vertices = realloc(set->vertices, (set->vertex_count + index_count) * sizeof(uint32_t));
+  set->triangles = realloc(set->triangles, 3 * (set->triangle_count + triangle_count));
+
+  // Position of each vertex in the current meshlet, 0xff if not in it
+  uint8_t* local = malloc(vertex_count);
+  memset(local, 0xff, vertex_count);
+  meshlet_t current = {
+    .vertex_offset = set->vertex_count,
+    .triangle_offset = set->triangle_count
+  };
+  for (size_t t = 0; t <= triangle_count; t++) {
+    int flush = t == triangle_count;
+    if (!flush) {
+      size_t new_vertices = 0;
+      for (int k = 0; k < 3; k++) {
+        uint32_t v = indices[3 * t + k];
+        int repeated = (k > 0 && indices[3 * t] == v) ||
+          (k > 1 && indices[3 * t + 1] == v);
+        if (local[v] == 0xff && !repeated) {
+          new_vertices++;
+        }
+      }
+      flush = current.vertex_count + new_vertices > MESHLET_MAX_VERTICES ||
+        current.triangle_count + 1 > MESHLET_MAX_TRIANGLES;
+    }
+    if (flush && current.triangle_count > 0) {
+      for (size_t v = 0; v < current.vertex_count; v++) {
+        local[set->vertices[current.vertex_offset + v]] = 0xff;
+      }
+      set->meshlets[set->meshlet_count] = current;
+      meshlet_compute_bounds(set, set->meshlet_count, positions);
+      set->meshlet_count++;
+      set->vertex_count += current.vertex_count;
+      set->triangle_count += current.triangle_count;
+      current = (meshlet_t) {
+        .vertex_offset = set->vertex_count,
+        .triangle_offset = set->triangle_count
+      };
+    }
+    if (t == triangle_count) {
+      break;
+    }
+    for (int k = 0; k < 3; k++) {
+      uint32_t v = indices[3 * t + k];
+      if (local[v] == 0xff) {
+        local[v] = current.vertex_count;
+        set->vertices[current.vertex_offset + current.vertex_count++] = v;
+      }
+      set->triangles[3 * (current.triangle_offset + current.triangle_count) + k] = local[v];
+    }
+    current.triangle_count++;
+  }
+  free(local);
+}
+
+void free_meshlets(meshlet_set_t* set) {
+  free(set->meshlets);
+  free(set->bounds);
+  free(set->vertices);
+  free(set->triangles);
+  memset(set, 0, sizeof(meshlet_set_t));
+}
+
+// Quadric error metric from Garland and Heckbert's "Surface Simplification
+// Using Quadric Error Metrics". Each quadric is the area weighted sum of the
+// squared distances to the planes of a vertex's triangles, so dividing by the
+// weight gives a mean squared distance.
+typedef struct quadric_s {
+  double a00, a11, a22, a01, a12, a02;
+  double b0, b1, b2;
+  double c;
+  double w;
+} quadric_t;
+
+static void quadric_add_plane(quadric_t* q, const float* p0, const float* p1, const float* p2) {
+  double e1[3] = {p1[0] - p0[0], p1[1] - p0[1], p1[2] - p0[2]};
+  double e2[3] = {p2[0] - p0[0], p2[1] - p0[1], p2[2] - p0[2]};
+  double n[3] = {
+    e1[1] * e2[2] - e1[2] * e2[1],
+    e1[2] * e2[0] - e1[0] * e2[2],
+    e1[0] * e2[1] - e1[1] * e2[0]
+  };
+  double length = sqrt(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+  if (length == 0) {
+    return;
+  }
+  double w = length / 2;
+  n[0] /= length;
+  n[1] /= length;
+  n[2] /= length;
+  double d = -(n[0] * p0[0] + n[1] * p0[1] + n[2] * p0[2]);
+  q->a00 += w * n[0] * n[0];
+  q->a11 += w * n[1] * n[1];
+  q->a22 += w * n[2] * n[2];
+  q->a01 += w * n[0] * n[1];
+  q->a12 += w * n[1] * n[2];
+  q->a02 += w * n[0] * n[2];
+  q->b0 += w * n[0] * d;
+  q->b1 += w * n[1] * d;
+  q->b2 += w * n[2] * d;
+  q->c += w * d * d;
+  q->w += w;
+}
+
+static void quadric_add(quadric_t* q, const quadric_t* r) {
+  q->a00 += r->a00;
+  q->a11 += r->a11;
+  q->a22 += r->a22;
+  q->a01 += r->a01;
+  q->a12 += r->a12;
+  q->a02 += r->a02;
+  q->b0 += r->b0;
+  q->b1 += r->b1;
+  q->b2 += r->b2;
+  q->c += r->c;
+  q->w += r->w;
+}
+
+static double quadric_error(const quadric_t* q, const quadric_t* r, const float* p) {
+  quadric_t s = *q;
+  quadric_add(&s, r);
+  if (s.w == 0) {
+    return 0;
+  }
+  double x = p[0], y = p[1], z = p[2];
+  double e = s.a00 * x * x + s.a11 * y * y + s.a22 * z * z
+    + 2 * (s.a01 * x * y + s.a12 * y * z + s.a02 * x * z)
+    + 2 * (s.b0 * x + s.b1 * y + s.b2 * z)
+    + s.c;
+  return fabs(e) / s.w;
+}
+
+typedef struct collapse_s {
+  uint32_t from;
+  uint32_t to;
+  double error;
+} collapse_t;
+
+static int compare_collapses(const void* a, const void* b) {
+  double ea = ((const collapse_t*) a)->error;
+  double eb = ((const collapse_t*) b)->error;
+  return (ea > eb) - (ea < eb);
+}
+
+static int compare_edges(const void* a, const void* b) {
+  uint64_t ea = *(const uint64_t*) a;
+  uint64_t eb = *(const uint64_t*) b;
+  return (ea > eb) - (ea < eb);
+}
+
+static void triangle_normal(double* n, const float* p0, const float* p1, const float* p2) {
+  double e1[3] = {p1[0] - p0[0], p1[1] - p0[1], p1[2] - p0[2]};
+  double e2[3] = {p2[0] - p0[0], p2[1] - p0[1], p2[2] - p0[2]};
+  n[0] = e1[1] * e2[2] - e1[2] * e2[1];
+  n[1] = e1[2] * e2[0] - e1[0] * e2[2];
+  n[2] = e1[0] * e2[1] - e1[1] * e2[0];
+}
+
+// Returns the first vertex inserted at the same position as vertex v, or v
+// itself if it's the first. slots is an open addressing table of vertex
+// indices, WELD_EMPTY when free, hashed on all 96 bits of the position and
+// compared in full, so positions that share a hash are told apart.
+static uint32_t position_table_insert(uint32_t* slots, size_t mask, const float* positions, uint32_t v) {
+  uint32_t bits[3];
+  memcpy(bits, &positions[3 * v], sizeof(bits));
+  uint64_t key = ((uint64_t) bits[1] << 32 | bits[0]) ^ weld_hash(bits[2] * 0x9e3779b97f4a7c15ULL);
+  size_t slot = weld_hash(key) & mask;
+  while (slots[slot] != WELD_EMPTY) {
+    if (memcmp(&positions[3 * slots[slot]], &positions[3 * v], 3 * sizeof(float)) == 0) {
+      return slots[slot];
+    }
+    slot = (slot + 1) & mask;
+  }
+  slots[slot] = v;
+  return v;
+}
+
+// Edge collapse simplification. Only vertices in the interior of a single
+// attribute region move: a vertex that shares its position with another
+// vertex sits on a UV seam or a palette page boundary, and a vertex on an open
+// edge is on the mesh border, so both stay where they are along with anything
+// the caller locks. Collapses keep the surviving vertex's position and
+// attributes, so no new vertices are made.
+//
+// Writes at most index_count indices to destination and returns how many
+// were written. Stops once target_index_count is reached or the next collapse
+// would move the surface by more than target_error, measured relative to the
+// mesh extent. result_error receives the largest error that was accepted.
+size_t simplify_mesh(uint32_t* destination, const uint32_t* indices, size_t index_count, const float* positions, size_t vertex_count, const uint8_t* locked, size_t target_index_count, float target_error, float* result_error) {
+  memcpy(destination, indices, index_count * sizeof(uint32_t));
+  *result_error = 0;
+  if (index_count == 0) {
+    return 0;
+  }
+
+  // Normalize positions so errors are relative to the mesh extent
+  float* scaled = malloc(3 * sizeof(float) * vertex_count);
+  float min[3] = {INFINITY, INFINITY, INFINITY};
+  float max[3] = {-INFINITY, -INFINITY, -INFINITY};
+  for (size_t i = 0; i < index_count; i++) {
+    const float* p = &positions[3 * indices[i]];
+    for (int k = 0; k < 3; k++) {
+      min[k] = fminf(min[k], p[k]);
+      max[k] = fmaxf(max[k], p[k]);
+    }
+  }
+  float extent = fmaxf(fmaxf(max[0] - min[0], max[1] - min[1]), max[2] - min[2]);
+  float scale = extent > 0 ? 1 / extent : 1;
+  for (size_t v = 0; v < vertex_count; v++) {
+    for (int k = 0; k < 3; k++) {
+      scaled[3 * v + k] = (positions[3 * v + k] - min[k]) * scale;
+    }
+  }
+
+  // Vertices at the same position share a position id: the first vertex found
+  // there
+  size_t position_capacity = 16;
+  while (position_capacity < 2 * vertex_count) {
+    position_capacity *= 2;
+  }
+  uint32_t* position_slots = malloc(position_capacity * sizeof(uint32_t));
+  memset(position_slots, 0xff, position_capacity * sizeof(uint32_t));
+  uint32_t* position_id = malloc(vertex_count * sizeof(uint32_t));
+  uint8_t* is_locked = malloc(vertex_count);
+  for (size_t v = 0; v < vertex_count; v++) {
+    uint32_t first = position_table_insert(position_slots, position_capacity - 1, positions, v);
+    position_id[v] = first;
+    is_locked[v] = locked ? locked[v] : 0;
+    if (first != v) {
+      is_locked[v] = 1;
+      is_locked[first] = 1;
+    }
+  }
+  free(position_slots);
+
+  // Edges used by a single triangle are on the border
+  size_t triangle_count = index_count / 3;
+  uint64_t* edges = malloc(index_count * sizeof(uint64_t));
+  for (size_t t = 0; t < triangle_count; t++) {
+    for (int k = 0; k < 3; k++) {
+      uint32_t a = position_id[indices[3 * t + k]];
+      uint32_t b = position_id[indices[3 * t + (k + 1) % 3]];
+      edges[3 * t + k] = a < b ? ((uint64_t) a << 32) | b : ((uint64_t) b << 32) | a;
+    }
+  }
+  qsort(edges, index_count, sizeof(uint64_t), compare_edges);
+  for (size_t i = 0; i < index_count;) {
+    size_t j = i + 1;
+    while (j < index_count && edges[j] == edges[i]) {
+      j++;
+    }
+    if (j - i == 1) {
+      uint32_t a = edges[i] >> 32;
+      uint32_t b = edges[i] & 0xffffffff;
+      is_locked[a] = 1;
+      is_locked[b] = 1;
+    }
+    i = j;
+  }
+  free(edges);
+  // Copies of a locked position are locked too
+  for (size_t v = 0; v < vertex_count; v++) {
+    if (is_locked[position_id[v]]) {
+      is_locked[v] = 1;
+    }
+  }
+
+  quadric_t* quadrics = calloc(vertex_count, sizeof(quadric_t));
+  for (size_t t = 0; t < triangle_count; t++) {
+    const float* p0 = &scaled[3 * destination[3 * t + 0]];
+    const float* p1 = &scaled[3 * destination[3 * t + 1]];
+    const float* p2 = &scaled[3 * destination[3 * t + 2]];
+    quadric_t q = {0};
+    quadric_add_plane(&q, p0, p1, p2);
+    for (int k = 0; k < 3; k++) {
+      quadric_add(&quadrics[destination[3 * t + k]], &q);
+    }
+  }
+
+  uint32_t* adjacency_start = malloc((vertex_count + 1) * sizeof(uint32_t));
+  uint32_t* adjacency = malloc(index_count * sizeof(uint32_t));
+  uint32_t* remap = malloc(vertex_count * sizeof(uint32_t));
+  uint8_t* touched = malloc(vertex_count);
+  collapse_t* collapses = malloc(2 * index_count * sizeof(collapse_t));
+  double max_error = (double) target_error * target_error;
+  double accepted_error = 0;
+
+  while (3 * triangle_count > target_index_count) {
+    // Triangles around each vertex
+    memset(adjacency_start, 0, (vertex_count + 1) * sizeof(uint32_t));
+    for (size_t i = 0; i < 3 * triangle_count; i++) {
+      adjacency_start[destination[i] + 1]++;
+    }
+    for (size_t v = 0; v < vertex_count; v++) {
+      adjacency_start[v + 1] += adjacency_start[v];
+    }
+    for (size_t i = 0; i < 3 * triangle_count; i++) {
+      adjacency[adjacency_start[destination[i]]++] = i / 3;
+    }
+    for (size_t v = vertex_count; v > 0; v--) {
+      adjacency_start[v] = adjacency_start[v - 1];
+    }
+    adjacency_start[0] = 0;
+
+    size_t collapse_count = 0;
+    for (size_t t = 0; t < triangle_count; t++) {
+      for (int k = 0; k < 3; k++) {
+        uint32_t a = destination[3 * t + k];
+        uint32_t b = destination[3 * t + (k + 1) % 3];
+        if (!is_locked[a]) {
+          collapses[collapse_count++] = (collapse_t) {a, b,
+            quadric_error(&quadrics[a], &quadrics[b], &scaled[3 * b])};
+        }
+        if (!is_locked[b]) {
+          collapses[collapse_count++] = (collapse_t) {b, a,
+            quadric_error(&quadrics[b], &quadrics[a], &scaled[3 * a])};
+        }
+      }
+    }
+    qsort(collapses, collapse_count, sizeof(collapse_t), compare_collapses);
+
+    for (size_t v = 0; v < vertex_count; v++) {
+      remap[v] = v;
+    }
+    memset(touched, 0, vertex_count);
+    size_t remaining = triangle_count;
+    size_t applied = 0;
+    for (size_t c = 0; c < collapse_count && 3 * remaining > target_index_count; c++) {
+      collapse_t collapse = collapses[c];
+      if (collapse.error > max_error) {
+        break;
+      }
+      uint32_t a = collapse.from;
+      uint32_t b = collapse.to;
+      if (touched[a] || touched[b]) {
+        continue;
+      }
+      // Reject collapses that flip or flatten a triangle
+      int flips = 0;
+      size_t removed = 0;
+      for (uint32_t i = adjacency_start[a]; i < adjacency_start[a + 1]; i++) {
+        const uint32_t* tri = &destination[3 * adjacency[i]];
+        if (tri[0] == b || tri[1] == b || tri[2] == b) {
+          removed++;
+          continue;
+        }
+        double before[3], after[3];
+        const float* p[3];
+        for (int k = 0; k < 3; k++) {
+          p[k] = &scaled[3 * tri[k]];
+        }
+        triangle_normal(before, p[0], p[1], p[2]);
+        for (int k = 0; k < 3; k++) {
+          if (tri[k] == a) {
+            p[k] = &scaled[3 * b];
+          }
+        }
+        triangle_normal(after, p[0], p[1], p[2]);
+        double dot = before[0] * after[0] + before[1] * after[1] + before[2] * after[2];
+        double before_length = sqrt(before[0] * before[0] + before[1] * before[1] + before[2] * before[2]);
+        double after_length = sqrt(after[0] * after[0] + after[1] * after[1] + after[2] * after[2]);
+        if (dot <= 0.25 * before_length * after_length) {
+          flips = 1;
+          break;
+        }
+      }
+      if (flips) {
+        continue;
+      }
+      // Keep the neighbourhood fixed for the rest of the pass so the flip
+      // checks above stay valid
+      for (uint32_t i = adjacency_start[a]; i < adjacency_start[a + 1]; i++) {
+        const uint32_t* tri = &destination[3 * adjacency[i]];
+        touched[tri[0]] = 1;
+        touched[tri[1]] = 1;
+        touched[tri[2]] = 1;
+      }
+      remap[a] = b;
+      quadric_add(&quadrics[b], &quadrics[a]);
+      remaining -= removed;
+      applied++;
+      if (collapse.error > accepted_error) {
+        accepted_error = collapse.error;
+      }
+    }
+    if (applied == 0) {
+      break;
+    }
+
+    // Apply the collapses and drop the triangles that became degenerate,
+    // keeping the order of the rest
+    size_t written = 0;
+    for (size_t t = 0; t < triangle_count; t++) {
+      uint32_t a = remap[destination[3 * t + 0]];
+      uint32_t b = remap[destination[3 * t + 1]];
+      uint32_t c = remap[destination[3 * t + 2]];
+      if (a == b || b == c || a == c) {
+        continue;
+      }
+      destination[3 * written + 0] = a;
+      destination[3 * written + 1] = b;
+      destination[3 * written + 2] = c;
+      written++;
+    }
+    triangle_count = written;
+  }
+
+  free(scaled);
+  free(position_id);
+  free(is_locked);
+  free(quadrics);
+  free(adjacency_start);
+  free(adjacency);
+  free(remap);
+  free(touched);
+  free(collapses);
+  *result_error = sqrt(accepted_error);
+  return 3 * triangle_count;
+}
@@ -0,0 +1,55 @@
+#include <stddef.h>
+#include <stdint.h>
+
+// Open-addressed hash table mapping a packed vertex key to its index in a
+// welded vertex buffer. Indices are handed out in insertion order.
+typedef struct weld_table_s {
+  uint64_t* keys;
+  uint32_t* ids;
+  size_t capacity;
+  uint32_t count;
+} weld_table_t;
+
+void weld_table_init(weld_table_t* table, size_t max_keys);
+uint32_t weld_table_insert(weld_table_t* table, uint64_t key, int* is_new);
+void weld_table_free(weld_table_t* table);
+
+float mesh_acmr(const uint32_t* indices, size_t index_count, size_t vertex_count, size_t cache_size);
+void optimize_vertex_cache(uint32_t* indices, size_t index_count, size_t vertex_count);
+void optimize_vertex_fetch_remap(uint32_t* remap, uint32_t* indices, size_t index_count, size_t vertex_count);
+
+// Clusters sized for mesh shaders. A meshlet's triangles index into its own
+// slice of the vertex list, which in turn indexes the mesh's vertices.
+#define MESHLET_MAX_VERTICES 64
+#define MESHLET_MAX_TRIANGLES 124
+
+typedef struct meshlet_s {
+  uint32_t vertex_offset;
+  uint32_t triangle_offset;
+  uint32_t vertex_count;
+  uint32_t triangle_count;
+} meshlet_t;
+
+// Bounding sphere and backface culling cone. The meshlet can be skipped when
+// dot(center - camera, cone_axis) >= cone_cutoff * length(center - camera) + radius
+typedef struct meshlet_bounds_s {
+  float center[3];
+  float radius;
+  float cone_axis[3];
+  float cone_cutoff;
+} meshlet_bounds_t;
+
+typedef struct meshlet_set_s {
+  meshlet_t* meshlets;
+  meshlet_bounds_t* bounds;
+  uint32_t* vertices;
+  uint8_t* triangles; // 3 local indices per triangle
+  size_t meshlet_count;
+  size_t vertex_count;
+  size_t triangle_count;
+} meshlet_set_t;
+
+void build_meshlets(meshlet_set_t* set, const uint32_t* indices, size_t index_count, const float* positions, size_t vertex_count);
+void free_meshlets(meshlet_set_t* set);
+
+size_t simplify_mesh(uint32_t* destination, const uint32_t* indices, size_t index_count, const float* positions, size_t vertex_count, const uint8_t* locked, size_t target_index_count, float target_error, float* result_error);
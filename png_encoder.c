@@ -0,0 +1,288 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "png_encoder.h"
+
+// Stripes smaller than this aren't worth a thread of their own
+#define PNG_MIN_STRIPE_BYTES (128 * 1024)
+
+enum { FILTER_NONE, FILTER_SUB, FILTER_UP, FILTER_AVERAGE, FILTER_PAETH };
+
+static uint8_t paeth(uint8_t a, uint8_t b, uint8_t c) {
+  int p = a + b - c;
+  int pa = abs(p - a);
+  int pb = abs(p - b);
+  int pc = abs(p - c);
+  if (pa <= pb && pa <= pc) {
+    return a;
+  }
+  return pb <= pc ? b : c;
+}
+
+static void filter_row(uint8_t* out, int filter, const uint8_t* row, const uint8_t* prev, size_t length, size_t bpp) {
+  size_t i = 0;
+  switch (filter) {
+    case FILTER_NONE:
+      memcpy(out, row, length);
+      break;
+    case FILTER_SUB:
+      for (; i < bpp; i++) out[i] = row[i];
+      for (; i < length; i++) out[i] = row[i] - row[i - bpp];
+      break;
+    case FILTER_UP:
+      if (!prev) {
+        memcpy(out, row, length);
+        break;
+      }
+      for (; i < length; i++) out[i] = row[i] - prev[i];
+      break;
+    case FILTER_PAETH:
+      if (!prev) {
+        filter_row(out, FILTER_SUB, row, prev, length, bpp);
+        break;
+      }
+      for (; i < bpp; i++) out[i] = row[i] - prev[i];
+      for (; i < length; i++) out[i] = row[i] - paeth(row[i - bpp], prev[i], prev[i - bpp]);
+      break;
+  }
+}
+
+// Sum of the filtered bytes taken as signed, the usual estimate of how well a
+// row will compress
+static size_t filtered_cost(const uint8_t* filtered, size_t length) {
+  size_t cost = 0;
+  for (size_t i = 0; i < length; i++) {
+    cost += abs((int8_t) filtered[i]);
+  }
+  return cost;
+}
+
+// Writes the filter byte and filtered bytes of one row. Paletted rows and
+// stored images aren't filtered, since filters don't help indices and stored
+// data isn't compressed anyway. A row that repeats the one above is all
+// zeros with Up, which is the common case in flat texture pages. Otherwise
+// the filter with the smallest cost wins, with Paeth only tried from level 6.
+static void filter_image_row(uint8_t* out, const uint8_t* row, const uint8_t* prev, size_t length, size_t bpp, int level, uint8_t* scratch) {
+  int filter = FILTER_NONE;
+  if (bpp > 1 && level > 0) {
+    if (prev && memcmp(row, prev, length) == 0) {
+      filter = FILTER_UP;
+    } else {
+      size_t best_cost = SIZE_MAX;
+      int last = level >= 6 ? FILTER_PAETH : FILTER_UP;
+      for (int f = FILTER_NONE; f <= last; f++) {
+        if (f == FILTER_AVERAGE) {
+          continue;
+        }
+        filter_row(scratch, f, row, prev, length, bpp);
+        size_t cost = filtered_cost(scratch, length);
+        if (cost < best_cost) {
+          best_cost = cost;
+          filter = f;
+        }
+      }
+    }
+  }
+  out[0] = filter;
+  filter_row(&out[1], filter, row, prev, length, bpp);
+}
+
+typedef struct stripe_s {
+  const uint8_t* data; // filtered rows of the whole image
+  size_t start;
+  size_t length;
+  int level;
+  int last;
+  uint8_t* out;
+  size_t out_size;
+  uLong adler;
+  int failed;
+} stripe_t;
+
+// Deflates one stripe into raw deflate blocks that can be concatenated, as
+// pigz does: the previous 32 KB of the image primes the window, and every
+// stripe but the last ends on a byte boundary with a sync flush
+static void* deflate_stripe(void* arg) {
+  stripe_t* stripe = arg;
+  z_stream z;
+  memset(&z, 0, sizeof(z));
+  if (deflateInit2(&z, stripe->level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+    stripe->failed = 1;
+    return NULL;
+  }
+  size_t dictionary = stripe->start < 32768 ? stripe->start : 32768;
+  if (dictionary > 0) {
+    deflateSetDictionary(&z, &stripe->data[stripe->start - dictionary], dictionary);
+  }
+  // deflateBound plus room for the sync flush's empty stored block should
+  // always fit, but if deflate fills the buffer anyway, grow it and carry
+  // on rather than lose the rest of the stripe
+  stripe->out_size = deflateBound(&z, stripe->length) + 16;
+  stripe->out = malloc(stripe->out_size);
+  z.next_in = (Bytef*) &stripe->data[stripe->start];
+  z.avail_in = stripe->length;
+  z.next_out = stripe->out;
+  z.avail_out = stripe->out_size;
+  int flush = stripe->last ? Z_FINISH : Z_SYNC_FLUSH;
+  int status = deflate(&z, flush);
+  while (status == Z_OK && z.avail_out == 0) {
+    stripe->out_size *= 2;
+    stripe->out = realloc(stripe->out, stripe->out_size);
+    z.next_out = &stripe->out[z.total_out];
+    z.avail_out = stripe->out_size - z.total_out;
+    status = deflate(&z, flush);
+    // A flush that had already completed has nothing left to write
+    if (status == Z_BUF_ERROR && !stripe->last && z.avail_in == 0) {
+      status = Z_OK;
+      break;
+    }
+  }
+  if (status != (stripe->last ? Z_STREAM_END : Z_OK) || z.avail_in != 0) {
+    stripe->failed = 1;
+  }
+  stripe->out_size = z.total_out;
+  deflateEnd(&z);
+  stripe->adler = adler32(1, &stripe->data[stripe->start], stripe->length);
+  return NULL;
+}
+
+static uint8_t* put_u32(uint8_t* out, uint32_t value) {
+  out[0] = value >> 24;
+  out[1] = value >> 16;
+  out[2] = value >> 8;
+  out[3] = value;
+  return out + 4;
+}
+
+// Appends a chunk whose data is already at out + 8
+static uint8_t* put_chunk(uint8_t* out, const char* type, size_t length) {
+  put_u32(out, length);
+  memcpy(&out[4], type, 4);
+  uLong crc = crc32(0, &out[4], length + 4);
+  return put_u32(&out[8 + length], crc);
+}
+
+// Encodes 8-bit RGBA pixels, or 8-bit indices into an RGBA colormap when
+// colormap_entries isn't 0, as a PNG. The colormap goes in PLTE, and its
+// alpha in tRNS up to the last translucent entry. Returns a malloc'd buffer
+// and its size, or NULL if deflate fails.
+unsigned char* png_encode(const uint8_t* pixels, size_t width, size_t height, const uint8_t* colormap, size_t colormap_entries, const png_encoder_options_t* options, size_t* size) {
+  size_t bpp = colormap_entries ? 1 : 4;
+  size_t row_length = bpp * width;
+  size_t filtered_length = (row_length + 1) * height;
+  uint8_t* filtered = malloc(filtered_length);
+  uint8_t* scratch = malloc(row_length);
+  for (size_t y = 0; y < height; y++) {
+    filter_image_row(
+      &filtered[(row_length + 1) * y],
+      &pixels[row_length * y], y > 0 ? &pixels[row_length * (y - 1)] : NULL,
+      row_length, bpp, options->level, scratch);
+  }
+  free(scratch);
+
+  size_t thread_count = options->threads;
+  if (thread_count == 0) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    thread_count = cpus > 0 ? cpus : 1;
+  }
+  size_t stripe_count = filtered_length / PNG_MIN_STRIPE_BYTES;
+  if (stripe_count > thread_count) stripe_count = thread_count;
+  if (stripe_count > height) stripe_count = height;
+  if (stripe_count < 1) stripe_count = 1;
+  stripe_t stripes[stripe_count];
+  pthread_t threads[stripe_count];
+  int started[stripe_count];
+  size_t rows_per_stripe = (height + stripe_count - 1) / stripe_count;
+  for (size_t s = 0; s < stripe_count; s++) {
+    size_t first_row = s * rows_per_stripe;
+    size_t end_row = first_row + rows_per_stripe < height ? first_row + rows_per_stripe : height;
+    stripes[s] = (stripe_t) {
+      .data = filtered,
+      .start = (row_length + 1) * first_row,
+      .length = (row_length + 1) * (end_row - first_row),
+      .level = options->level,
+      .last = s == stripe_count - 1
+    };
+  }
+  for (size_t s = 1; s < stripe_count; s++) {
+    started[s] = pthread_create(&threads[s], NULL, deflate_stripe, &stripes[s]) == 0;
+    if (!started[s]) {
+      deflate_stripe(&stripes[s]);
+    }
+  }
+  deflate_stripe(&stripes[0]);
+  int failed = stripes[0].failed;
+  uLong adler = stripes[0].adler;
+  size_t idat_length = 2 + stripes[0].out_size + 4;
+  for (size_t s = 1; s < stripe_count; s++) {
+    if (started[s]) {
+      pthread_join(threads[s], NULL);
+    }
+    failed |= stripes[s].failed;
+    adler = adler32_combine(adler, stripes[s].adler, stripes[s].length);
+    idat_length += stripes[s].out_size;
+  }
+  free(filtered);
+
+  size_t trns_entries = 0;
+  for (size_t i = 0; i < colormap_entries; i++) {
+    if (colormap[4 * i + 3] != 255) {
+      trns_entries = i + 1;
+    }
+  }
+  size_t capacity = 8 + (12 + 13) + (12 + idat_length) + 12;
+  if (colormap_entries) {
+    capacity += (12 + 3 * colormap_entries) + (12 + trns_entries);
+  }
+  uint8_t* png = failed ? NULL : malloc(capacity);
+  uint8_t* out = png;
+  if (png) {
+    static const uint8_t signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+    memcpy(out, signature, 8);
+    out += 8;
+
+    uint8_t* ihdr = put_u32(put_u32(&out[8], width), height);
+    ihdr[0] = 8; // bit depth
+    ihdr[1] = colormap_entries ? 3 : 6; // paletted or RGBA
+    ihdr[2] = 0; // deflate
+    ihdr[3] = 0; // adaptive filtering
+    ihdr[4] = 0; // not interlaced
+    out = put_chunk(out, "IHDR", 13);
+
+    if (colormap_entries) {
+      for (size_t i = 0; i < colormap_entries; i++) {
+        memcpy(&out[8 + 3 * i], &colormap[4 * i], 3);
+      }
+      out = put_chunk(out, "PLTE", 3 * colormap_entries);
+      if (trns_entries) {
+        for (size_t i = 0; i < trns_entries; i++) {
+          out[8 + i] = colormap[4 * i + 3];
+        }
+        out = put_chunk(out, "tRNS", trns_entries);
+      }
+    }
+
+    // The zlib header's level hint follows zlib's own choice
+    uint8_t* idat = &out[8];
+    idat[0] = 0x78;
+    idat[1] = options->level < 2 ? 0x01 : options->level < 6 ? 0x5e :
+      options->level == 6 ? 0x9c : 0xda;
+    idat += 2;
+    for (size_t s = 0; s < stripe_count; s++) {
+      memcpy(idat, stripes[s].out, stripes[s].out_size);
+      idat += stripes[s].out_size;
+    }
+    put_u32(idat, adler);
+    out = put_chunk(out, "IDAT", idat_length);
+    out = put_chunk(out, "IEND", 0);
+    *size = out - png;
+  }
+  for (size_t s = 0; s < stripe_count; s++) {
+    free(stripes[s].out);
+  }
+  return png;
+}
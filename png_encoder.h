@@ -0,0 +1,12 @@
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct png_encoder_options_s {
+  // 0 stores the filtered rows uncompressed, 1 is the fastest deflate and 9
+  // the smallest
+  int level;
+  // Row stripes deflated in parallel. 0 uses one per online CPU.
+  int threads;
+} png_encoder_options_t;
+
+unsigned char* png_encode(const uint8_t* pixels, size_t width, size_t height, const uint8_t* colormap, size_t colormap_entries, const png_encoder_options_t* options, size_t* size);
@@ -9,6 +9,14 @@
 #include <unistd.h>
 
 #include "matrix.h"
+#include "base64.h"
+#include "mesh.h"
+#include "atlas.h"
+#include "clut.h"
+#include "png_encoder.h"
+#include "ktx2_encoder.h"
+#include "store.h"
+#include "keyframe_fit.h"
 
 #include "iso_reader.h"
 #define CGLTF_WRITE_IMPLEMENTATION
@@ -83,6 +91,104 @@ typedef struct face_tri_s {
   uint8_t cmd_lower;
 } face_tri_t;
 
+#define MAX_LOD_LEVELS 4
+
+// One detail level of an object, indexing the object's full vertex buffer
+typedef struct object_lod_s {
+  uint32_t* indices; // 3 per triangle, semi-transparent triangles first
+  size_t triangle_count;
+  size_t semi_transparent_triangle_count;
+} object_lod_t;
+
+// Welded geometry for a single object, still in the units used on disc
+typedef struct object_mesh_s {
+  vertex_t* positions; // 4.12 fixed point, in the object's space
+  vertex_t* normals; // 4.12 fixed point, unit length
+  uint16_t* texels; // u, v pairs in mega-texture pixels
+  uint32_t* indices; // 3 per triangle, semi-transparent triangles first
+  size_t vertex_count;
+  size_t triangle_count;
+  size_t semi_transparent_triangle_count;
+  // Only built with -m. Semi-transparent meshlets come first.
+  meshlet_set_t meshlets;
+  size_t semi_transparent_meshlet_count;
+  // Simplified levels 1 and up, only built with -l
+  object_lod_t lods[MAX_LOD_LEVELS - 1];
+  // The atlas page holding the object's texels, and whether its opaque
+  // triangles sample transparent texels of it
+  size_t page;
+  int has_cutout;
+  // Only with -c, each vertex's row of the CLUT strip
+  uint16_t* palette_rows;
+} object_mesh_t;
+
+typedef struct export_options_s {
+  // Keep int16 positions, normalized uint16 texcoords and uint16 indices
+  // instead of converting to floats (KHR_mesh_quantization)
+  int quantize;
+  // Merge every object into one rigidly skinned primitive, with the object
+  // nodes as joints
+  int skinned;
+  // Split each object into meshlets for mesh shader pipelines
+  int meshlets;
+  // Number of detail levels, including the full one, and the error allowed
+  // for the first simplified level relative to the object's extent
+  int lod_levels;
+  float lod_error;
+  // Write normals as two octahedral 16-bit components in _NORMAL_OCT instead
+  // of a NORMAL attribute
+  int octahedral_normals;
+  // Pack only the referenced texels into a power of two atlas instead of
+  // copying whole texture pages
+  int tight_atlas;
+  // Write 8-bit paletted PNGs, splitting the atlas into pages of objects
+  // whose colours fit in 256 palette entries
+  int paletted;
+  // Encode PNGs with png_encoder at this level, 0 to 9, instead of with
+  // libpng's defaults when -1
+  int png_level;
+  // Also write block compressed KTX2 textures, as files next to the glTF
+  // that each texture's extras name
+  int ktx2;
+  // Write the sheet as CLUT indices plus a strip of CLUT rows, selected by
+  // TEXCOORD_1, instead of an RGBA atlas
+  int palette_swap;
+  // Write buffers and textures as files in STORE_DIR named by a hash of
+  // their contents, so models with identical data share one copy
+  int shared_store;
+  // Only write the frames where an object's keyframe changes, plus the last
+  // frame, instead of every frame of every object
+  int keyframes_only;
+  // Drop animation channels that hold the rest pose, give other constant
+  // channels a single key, and store rotations as normalized int16
+  int compress_tracks;
+  // When above 0, fit LINEAR keys to each object's motion instead of writing
+  // STEP frames. World space error allowed for node origins, in glTF units,
+  // and for node axes, in degrees.
+  float fit_position_error;
+  float fit_angle_error;
+  // When not -1, pose the meshes at this frame of the first animation and
+  // leave the animations out
+  int bake_frame;
+  // Pose with the GTE's fixed point arithmetic instead of in float
+  int gte_bake;
+} export_options_t;
+
+// The store for -d, next to the model directories
+#define STORE_DIR "shared"
+
+// Multiplying disc coordinates by this flips the x and y axes and applies the
+// 4.12 fixed point scale
+const float export_scale[3] = { -1.0 / 4096.0, -1.0 / 4096.0, 1.0 / 4096.0 };
+
+export_options_t export_options = {
+  .lod_levels = 1,
+  .lod_error = 0.02,
+  .png_level = -1,
+  .fit_angle_error = 0.5,
+  .bake_frame = -1
+};
+
 typedef struct paletted_texture_s {
   uint16_t* palette; // 16 entries of 16 bits each
   uint8_t* texture; // Size is 128 x 256 x 4 bpp = 16384 bytes
@@ -93,71 +199,12 @@ void die(char* message) {
   exit(1);
 }
 
-uint8_t base64_table[64] = {
-  'A', 'B', 'C', 'D', 'E', 'F', 'G', 'H',
-  'I', 'J', 'K', 'L', 'M', 'N', 'O', 'P',
-  'Q', 'R', 'S', 'T', 'U', 'V', 'W', 'X',
-  'Y', 'Z', 'a', 'b', 'c', 'd', 'e', 'f',
-  'g', 'h', 'i', 'j', 'k', 'l', 'm', 'n',
-  'o', 'p', 'q', 'r', 's', 't', 'u', 'v',
-  'w', 'x', 'y', 'z', '0', '1', '2', '3',
-  '4', '5', '6', '7', '8', '9', '+', '/'
-};
-
-char* base64_encode(unsigned char* bytes, size_t size) {
-  char* buf = malloc(4 * (size / 3) + 5);
-  buf[4 * (size / 3)] = '\0';
-  for (int i = 0; i < size / 3; i++) {
-    buf[4 * i + 0] = base64_table[
-      bytes[3 * i + 0] >> 2
-    ];
-    buf[4 * i + 1] = base64_table[
-      ((bytes[3 * i + 0] & 0x03) << 4) |
-      (bytes[3 * i + 1] >> 4)
-    ];
-    buf[4 * i + 2] = base64_table[
-      ((bytes[3 * i + 1] & 0x0f) << 2) |
-      (bytes[3 * i + 2] >> 6)
-    ];
-    buf[4 * i + 3] = base64_table[
-      bytes[3 * i + 2] & 0x3f
-    ];
-  }
-  if (size % 3 == 1) {
-    buf[4 * (size / 3)] = base64_table[
-      bytes[3 * (size / 3)] >> 2
-    ];
-    buf[4 * (size / 3) + 1] = base64_table[
-      (bytes[3 * (size / 3)] & 0x03) << 4
-    ];
-    buf[4 * (size / 3) + 2] = '=';
-    buf[4 * (size / 3) + 3] = '=';
-    buf[4 * (size / 3) + 4] = '\0';
-  }
-  if (size % 3 == 2) {
-    buf[4 * (size / 3)] = base64_table[
-      bytes[3 * (size / 3)] >> 2
-    ];
-    buf[4 * (size / 3) + 1] = base64_table[
-      ((bytes[3 * (size / 3)] & 0x03) << 4) |
-      (bytes[3 * (size / 3) + 1] >> 4)
-    ];
-    buf[4 * (size / 3) + 2] = base64_table[
-      (bytes[3 * (size / 3) + 1] & 0x0f) << 2
-    ];
-    buf[4 * (size / 3) + 3] = '=';
-    buf[4 * (size / 3) + 4] = '\0';
-  }
-  return buf;
-}
-
 char* octet_stream_encode(void* bytes, size_t size) {
-  static char* header = "data:application/octet-stream;base64,";
-  char* buf = malloc(4 * (size / 3) + strlen(header) + 5);
-  strcpy(buf, header);
-  char* encoded = base64_encode(bytes, size);
-  strcat(buf, encoded);
-  free(encoded);
+  static const char header[] = "data:application/octet-stream;base64,";
+  size_t header_len = sizeof(header) - 1;
+  char* buf = malloc(header_len + base64_encoded_size(size) + 1);
+  memcpy(buf, header, header_len);
+  base64_encode_into(buf + header_len, bytes, size);
   return buf;
 }
 
@@ -180,78 +227,199 @@ paletted_texture_t load_texture(model_t* model) {
   return new_texture;
 }
 
-// This is 5 * 1024 * 1024, should be plenty big enough to fit a
-// 1024x1024 rgb png
-#define PNG_BUFFER_SIZE 5242880
-unsigned char png_buffer[PNG_BUFFER_SIZE];
+// The encoded atlas, sized for the worst case by save_png_write_buffer
+unsigned char* png_buffer;
+
+// An encoded texture image of the export. There is a single page holding
+// every object unless paletted PNGs (-p) need more than 256 colours.
+typedef struct atlas_page_s {
+  size_t width;
+  size_t height;
+  unsigned char* png;
+  png_alloc_size_t png_size;
+  // Only with -k
+  unsigned char* ktx2;
+  size_t ktx2_size;
+  // With -d, where png and ktx2 are NULL and these are files of the store
+  // instead. ktx2_uri is also set without -d, once ktx2 has been written
+  // next to the glTF.
+  char* png_uri;
+  char* ktx2_uri;
+} atlas_page_t;
+
+atlas_page_t* atlas_pages;
+size_t atlas_page_count;
+
+// With -c, the only atlas page is the sheet's CLUT indices and this holds
+// the palette slots' colours, a 16 texel row each
+atlas_page_t clut_strip;
+
+// The RGBA colours that expand_texture_paletted gives the 16 entries of a
+// CLUT
+void clut_colors(paletted_texture_t* tex, uint8_t column, uint8_t row, int semitransparent, uint8_t colors[16][4]) {
+  uint8_t* palette = &tex->texture[row * 64 + column * 32];
+  uint8_t opacity = semitransparent ? 127 : 255;
+  for (int i = 0; i < 16; i++) {
+    uint16_t color;
+    memcpy(&color, &palette[2 * i], sizeof(uint16_t));
+    colors[i][0] = (color & 0x001f) << 3;
+    colors[i][1] = (color & 0x03e0) >> 2;
+    colors[i][2] = (color & 0x7c00) >> 7;
+    colors[i][3] = (color == 0x0000) ? 0 : opacity;
+    if (semitransparent && color == 0x8000) {
+      colors[i][3] = 0;
+    }
+  }
+}
 
+// Expands a whole 128x256 page into a new RGBA buffer
 uint8_t* expand_texture_paletted(paletted_texture_t* tex, uint8_t column, uint8_t row, int semitransparent) {
-  uint32_t stride = 64;
+  uint8_t colors[16][4];
+  clut_colors(tex, column, row, semitransparent, colors);
   uint8_t* expanded = malloc(4 * 128 * 256);
-  for (int i = 0; i < 16384; i++) {
-    uint8_t lower = tex->texture[i] & 0x0f;
-    uint8_t upper = (tex->texture[i] & 0xf0) >> 4;
-    uint8_t* palette = &tex->texture[row * stride + column * 32];
-    uint16_t color_lower;
-    uint16_t color_upper;
-    memcpy(&color_lower, &palette[2 * lower], sizeof(uint16_t));
-    memcpy(&color_upper, &palette[2 * upper], sizeof(uint16_t));
-
-    uint8_t opacity = semitransparent ? 127 : 255;
-
-    expanded[8 * i + 0] = (color_lower & 0x001f) << 3;
-    expanded[8 * i + 1] = (color_lower & 0x03e0) >> 2;
-    expanded[8 * i + 2] = (color_lower & 0x7c00) >> 7;
-    expanded[8 * i + 3] = (color_lower == 0x0000) ? 0 : opacity;
-    expanded[8 * i + 4] = (color_upper & 0x001f) << 3;
-    expanded[8 * i + 5] = (color_upper & 0x03e0) >> 2;
-    expanded[8 * i + 6] = (color_upper & 0x7c00) >> 7;
-    expanded[8 * i + 7] = (color_upper == 0x0000) ? 0 : opacity;
-
-    if (semitransparent && color_lower == 0x8000) {
-      expanded[8 * i + 3] = 0;
-    }
-    if (semitransparent && color_upper == 0x8000) {
-      expanded[8 * i + 7] = 0;
-    }
-  }
+  expand_clut_texels(expanded, tex->texture, 0x4000, colors);
   return expanded;
 }
 
 char* googa = "googa.png";
 
 // This is the buffer where raw pixels will be blitted to, used to generate the
-// png. 1024x1024 pixels RGBA
-uint8_t png_write_buffer[4*1024*1024];
+// png, RGBA. By default it's 1024 pixels wide with a row of 8 atlas slots
+// every 256 pixels, at least 1024 pixels high and growing with the number of
+// slots. A tight atlas (-a) has whatever power of two size it packed into.
+uint8_t* png_write_buffer;
+size_t png_write_width;
+size_t png_write_height;
+
+// Copies a width x height block of an expanded 128x256 page into the atlas
+void blit_rect_to_png_write_buffer(uint8_t* texture_expanded, size_t from_x, size_t from_y, size_t width, size_t height, size_t offset_x, size_t offset_y) {
+  for (int j = 0; j < height; j++) {
+    memcpy(
+      &png_write_buffer[4 * (png_write_width * (offset_y + j) + offset_x)],
+      &texture_expanded[4 * (128 * (from_y + j) + from_x)],
+      4 * width);
+  }
+}
 
+// Expands a whole page straight into the atlas, a row of 64 bytes at a time
 void blit_to_png_write_buffer(paletted_texture_t* tex, uint8_t column, uint8_t row, int semitransparent, size_t offset_x, size_t offset_y) {
-  uint8_t* texture_expanded = expand_texture_paletted(tex, column, row, semitransparent);
+  uint8_t colors[16][4];
+  clut_colors(tex, column, row, semitransparent, colors);
   for (int j = 0; j < 256; j++) {
-    for (int i = 0; i < 128; i++) {
-      size_t to_x = 4 * (offset_x + i);
-      size_t to_y = offset_y + j;
-      png_write_buffer[4 * 1024 * to_y + to_x + 0] = texture_expanded[4 * (128 *
-      j + i) + 0];
-      png_write_buffer[4 * 1024 * to_y + to_x + 1] = texture_expanded[4 * (128 *
-      j + i) + 1];
-      png_write_buffer[4 * 1024 * to_y + to_x + 2] = texture_expanded[4 * (128 *
-      j + i) + 2];
-      png_write_buffer[4 * 1024 * to_y + to_x + 3] = texture_expanded[4 * (128 *
-      j + i) + 3];
-    }
-  }
-  free(texture_expanded);
+    expand_clut_texels(
+      &png_write_buffer[4 * (png_write_width * (offset_y + j) + offset_x)],
+      &tex->texture[64 * j], 64, colors);
+  }
+}
+
+// Whether the atlas has fully transparent texels in the inclusive rectangle.
+// Those come from CLUT entries of 0x0000, which are see-through even on
+// opaque faces.
+int atlas_rect_has_cutout(size_t x0, size_t y0, size_t x1, size_t y1) {
+  if (x1 >= png_write_width) x1 = png_write_width - 1;
+  if (y1 >= png_write_height) y1 = png_write_height - 1;
+  for (size_t y = y0; y <= y1; y++) {
+    for (size_t x = x0; x <= x1; x++) {
+      if (png_write_buffer[4 * (png_write_width * y + x) + 3] == 0) {
+        return 1;
+      }
+    }
+  }
+  return 0;
+}
+
+// Adds a colour to a set of up to 257 colours, one more than a PNG palette
+// holds. Returns its index, or -1 when the set is full.
+int add_palette_color(uint32_t* set, size_t* count, uint32_t color) {
+  for (size_t i = 0; i < *count; i++) {
+    if (set[i] == color) {
+      return i;
+    }
+  }
+  if (*count == 257) {
+    return -1;
+  }
+  set[*count] = color;
+  return (*count)++;
+}
+
+// Converts png_write_buffer to 8-bit indices into a colormap of at most 256
+// RGBA entries, with the translucent entries first so that the tRNS chunk
+// stops early. Returns the number of entries, or 0 if there are too many.
+size_t palettize_png_write_buffer(uint8_t* indices, uint8_t* colormap) {
+  uint32_t colors[257];
+  size_t color_count = 0;
+  size_t pixel_count = png_write_width * png_write_height;
+  uint32_t last_color = 0;
+  int last_index = -1;
+  for (size_t i = 0; i < pixel_count; i++) {
+    uint32_t color;
+    memcpy(&color, &png_write_buffer[4 * i], sizeof(uint32_t));
+    if (color != last_color || last_index < 0) {
+      last_color = color;
+      last_index = add_palette_color(colors, &color_count, color);
+      if (last_index < 0) {
+        return 0;
+      }
+    }
+    indices[i] = last_index;
+  }
+  // The set holds a 257th colour to tell a full palette from an overfull one
+  if (color_count > 256) {
+    return 0;
+  }
+  uint8_t order[256];
+  size_t sorted = 0;
+  for (int opaque = 0; opaque < 2; opaque++) {
+    for (size_t i = 0; i < color_count; i++) {
+      if ((((uint8_t*) &colors[i])[3] == 255) == opaque) {
+        order[i] = sorted;
+        memcpy(&colormap[4 * sorted++], &colors[i], 4);
+      }
+    }
+  }
+  for (size_t i = 0; i < pixel_count; i++) {
+    indices[i] = order[indices[i]];
+  }
+  return color_count;
 }
 
-png_alloc_size_t save_png_write_buffer() {
+png_alloc_size_t save_png_write_buffer(int paletted) {
   png_image png;
   memset(&png, 0, sizeof(png_image));
   png.version = PNG_IMAGE_VERSION;
-  png.width = 1024;
-  png.height = 1024;
+  png.width = png_write_width;
+  png.height = png_write_height;
   png.colormap_entries = 0;
   png.format = PNG_FORMAT_RGBA;
   png.flags = 0;
+  uint8_t* pixels = png_write_buffer;
+  uint8_t colormap[4 * 256];
+  if (paletted) {
+    uint8_t* indices = malloc(png_write_width * png_write_height);
+    png.colormap_entries = palettize_png_write_buffer(indices, colormap);
+    if (png.colormap_entries) {
+      png.format = PNG_FORMAT_RGBA_COLORMAP;
+      pixels = indices;
+    } else {
+      fprintf(stderr, "atlas page has more than 256 colours, writing RGBA\n");
+      free(indices);
+    }
+  }
+  if (export_options.png_level >= 0) {
+    png_encoder_options_t options = { .level = export_options.png_level };
+    size_t size;
+    png_buffer = png_encode(
+      pixels, png.width, png.height,
+      colormap, png.colormap_entries, &options, &size);
+    if (!png_buffer) {
+      die("save_png_write_buffer: deflate failed");
+    }
+    if (pixels != png_write_buffer) {
+      free(pixels);
+    }
+    return size;
+  }
   char* filename = "mega-texture.png";
   /*
   png_image_write_to_file(
@@ -262,23 +430,44 @@ png_alloc_size_t save_png_write_buffer() {
     0,
     NULL);
   */
-  png_alloc_size_t memory_bytes = PNG_BUFFER_SIZE;
+  png_alloc_size_t memory_bytes = PNG_IMAGE_PNG_SIZE_MAX(png);
+  png_buffer = malloc(memory_bytes);
   png_image_write_to_memory(
     &png,
     png_buffer,
     &memory_bytes,
     0,
-    png_write_buffer,
+    pixels,
     0,
-    NULL);
+    png.colormap_entries ? colormap : NULL);
+  if (pixels != png_write_buffer) {
+    free(pixels);
+  }
   return memory_bytes;
 
 }
 
-vertex_t* load_vertices(model_t* model, uint32_t object, uint32_t* num_read) {
-  uint32_t vertex_offset = model->vertex_offsets[object];
+// Encodes 8-bit pixels in one of libpng's simplified formats
+unsigned char* encode_png(const uint8_t* pixels, size_t width, size_t height, png_uint_32 format, png_alloc_size_t* size) {
+  png_image png;
+  memset(&png, 0, sizeof(png_image));
+  png.version = PNG_IMAGE_VERSION;
+  png.width = width;
+  png.height = height;
+  png.format = format;
+  *size = PNG_IMAGE_PNG_SIZE_MAX(png);
+  unsigned char* buffer = malloc(*size);
+  if (!png_image_write_to_memory(&png, buffer, size, 0, pixels, 0, NULL)) {
+    die("encode_png: png_image_write_to_memory error");
+  }
+  return buffer;
+}
+
+// Vertex and normal pools share a layout: a count, 2 bytes of padding, then
+// 3 int16 per entry
+vertex_t* load_vertex_pool(model_t* model, uint32_t offset, uint32_t* num_read) {
   iso_seek_to_sector(model->iso, model->file_sector);
-  iso_seek_forward(model->iso, vertex_offset);
+  iso_seek_forward(model->iso, offset);
   uint32_t count;
   iso_fread(model->iso, &count, sizeof(uint32_t), 1);
   vertex_t* verts = malloc(sizeof(vertex_t) * count);
@@ -288,9 +477,20 @@ vertex_t* load_vertices(model_t* model, uint32_t object, uint32_t* num_read) {
   return verts;
 }
 
+vertex_t* load_vertices(model_t* model, uint32_t object, uint32_t* num_read) {
+  return load_vertex_pool(model, model->vertex_offsets[object], num_read);
+}
+
+vertex_t* load_normals(model_t* model, uint32_t object, uint32_t* num_read) {
+  return load_vertex_pool(model, model->normal_offsets[object], num_read);
+}
+
+// Semi-transparent faces come first in both arrays
 typedef struct polys_s {
   face_quad_t* quads;
   face_tri_t* tris;
+  uint32_t semi_transparent_quad_count;
+  uint32_t semi_transparent_tri_count;
 } polys_t;
 
 polys_t load_faces(model_t* model, uint32_t object, uint32_t* num_quads_read, uint32_t* num_tris_read) {
@@ -355,7 +555,9 @@ polys_t load_faces(model_t* model, uint32_t object, uint32_t* num_quads_read, ui
 
   return (polys_t) {
     .quads = all_quads,
-    .tris = all_tris
+    .tris = all_tris,
+    .semi_transparent_quad_count = semi_transparent_quad_count,
+    .semi_transparent_tri_count = semi_transparent_tri_count
   };
 }
 
@@ -369,6 +571,13 @@ typedef struct animation_s {
   uint32_t* frame_counts;
   size_t max_keyframe;
   char animation_labels[8];
+  // Every keyframe of every object, decoded once for all animations of the
+  // file. Keyframe k of object o is entry o * (max_keyframe + 1) + k.
+  float* keyframe_rotations; // 4 per keyframe, glTF XYZW
+  float* keyframe_translations; // 3 per keyframe
+  float* keyframe_scales; // 3 per keyframe
+  matrix_t* keyframe_matrices; // As read, for posing vertices on disc axes
+  vertex_t* keyframe_vectors;
 } animation_t;
 
 void free_animation(animation_t* animation) {
@@ -379,6 +588,107 @@ void free_animation(animation_t* animation) {
   }
   free(animation->frame_tables);
   free(animation->frame_counts);
+  free(animation->keyframe_rotations);
+  free(animation->keyframe_translations);
+  free(animation->keyframe_scales);
+  free(animation->keyframe_matrices);
+  free(animation->keyframe_vectors);
+}
+
+// Reads and decomposes the keyframe pool that the frame tables index into
+void decode_keyframes(animation_t* animation, uint32_t object_count) {
+  size_t keyframe_count = animation->max_keyframe + 1;
+  float* rotation = malloc(keyframe_count * 4 * object_count * sizeof(float));
+  float* translation = malloc(keyframe_count * 3 * object_count * sizeof(float));
+  float* scale = malloc(keyframe_count * 3 * object_count * sizeof(float));
+  matrix_t* matrices = malloc(keyframe_count * object_count * sizeof(matrix_t));
+  vertex_t* vectors = malloc(keyframe_count * object_count * sizeof(vertex_t));
+  // One object's keyframes at a time, matrices in SoA layout for
+  // decompose_matrices
+  int16_t* elements = malloc(keyframe_count * 9 * sizeof(int16_t));
+  float* scales = malloc(keyframe_count * 3 * sizeof(float));
+  float* quaternions = malloc(keyframe_count * 4 * sizeof(float));
+  for (int object = 0; object < object_count; object++) {
+    uint32_t offset = animation->transform_offsets[object];
+    iso_seek_to_sector(animation->iso, animation->file_sector);
+    iso_seek_forward(animation->iso, offset);
+    matrix_t m;
+    size_t first = object * keyframe_count;
+
+    // Read one matrix and one translation vector for each keyframe across all
+    // animations in the file. This actually reads more than it needs to because
+    // typically not all objects will have the same number of keyframes as
+    // animation.max_keyframe. So if we are near the end of the rom this code
+    // could error from reading further than it needs to.
+    for (int frame = 0; frame < keyframe_count; frame++) {
+      size_t items_read = iso_fread(
+        animation->iso,
+        &m,
+        sizeof(matrix_t),
+        1);
+      if (items_read != 1) {
+        fprintf(stderr, "items read: %lu\n", items_read);
+        die("fread failure, an error occured or EOF (rotation matrix)");
+      }
+      matrices[first + frame] = m;
+      for (int e = 0; e < 9; e++) {
+        elements[e * keyframe_count + frame] = m.x[e];
+      }
+      vertex_t t = {0};
+      items_read = iso_fread(
+        animation->iso,
+        &t,
+        sizeof(vertex_t),
+        1);
+      if (items_read != 1) {
+        die("fread failure, an error occured or EOF (translation)");
+      }
+      vectors[first + frame] = t;
+    }
+    decompose_matrices(elements, keyframe_count, scales, quaternions);
+
+    for (int frame = 0; frame < keyframe_count; frame++) {
+      quaternion_t q = {
+        .w = quaternions[0 * keyframe_count + frame],
+        .x = quaternions[1 * keyframe_count + frame],
+        .y = quaternions[2 * keyframe_count + frame],
+        .z = quaternions[3 * keyframe_count + frame]
+      };
+      float s[3] = {
+        scales[0 * keyframe_count + frame],
+        scales[1 * keyframe_count + frame],
+        scales[2 * keyframe_count + frame]
+      };
+      m = matrices[first + frame];
+      fprintf(stderr, "Scale by: [%.02f %.02f %.02f]\n", s[0], s[1], s[2]);
+      fprintf(stderr, "object %d/%d, keyframe %d/%ld\n",
+        object + 1, object_count,
+        frame + 1, keyframe_count);
+      display_matrix_debug(&m);
+      display_quaternion_debug(&q);
+      vertex_t t = vectors[first + frame];
+      size_t k = first + frame;
+      // Spec says component order is XYZW
+      rotation[k * 4 + 0] = q.x;
+      rotation[k * 4 + 1] = q.y;
+      rotation[k * 4 + 2] = -q.z;
+      rotation[k * 4 + 3] = q.w;
+      translation[k * 3 + 0] = -t.x / 4096.0;
+      translation[k * 3 + 1] = -t.y / 4096.0;
+      translation[k * 3 + 2] = t.z / 4096.0;
+      scale[k * 3 + 0] = s[0];
+      scale[k * 3 + 1] = s[1];
+      scale[k * 3 + 2] = s[2];
+    }
+  }
+  free(elements);
+  free(scales);
+  free(quaternions);
+  animation->keyframe_rotations = rotation;
+  animation->keyframe_translations = translation;
+  animation->keyframe_scales = scale;
+  animation->keyframe_matrices = matrices;
+  animation->keyframe_vectors = vectors;
 }
 
 animation_t load_animation(iso_t* iso, uint32_t sector, uint32_t object_count) {
@@ -423,6 +733,9 @@ animation_t load_animation(iso_t* iso, uint32_t sector, uint32_t object_count) {
       break;
     }
     animation_count += 1;
+    if (animation_count > sizeof(animation.animation_labels)) {
+      die("Too many animations in one file");
+    }
     animation.keyframe_offsets = realloc(animation.keyframe_offsets, sizeof(uint32_t)*animation_count);
     animation.keyframe_offsets[animation_count - 1] = keyframe_offset;
     animation.animation_labels[animation_count - 1] = animation_label;
@@ -458,7 +771,7 @@ animation_t load_animation(iso_t* iso, uint32_t sector, uint32_t object_count) {
       } else {
         // Update the max keyframe so that later we know how many transform
         // matrices to read
-        for (int j = object_count * frame_count; j < (object_count + 1) * frame_count; j++) {
+        for (int j = object_count * frame_count; j < object_count * (frame_count + 1); j++) {
           if (animation.frame_tables[i][j] > animation.max_keyframe) {
             animation.max_keyframe = animation.frame_tables[i][j];
           }
@@ -472,166 +785,184 @@ animation_t load_animation(iso_t* iso, uint32_t sector, uint32_t object_count) {
   }
   fprintf(stderr, "Max keyframe: %ld\n", animation.max_keyframe);
   animation.animation_count = animation_count;
+  decode_keyframes(&animation, object_count);
   return animation;
 }
 
-void serialize_animation(animation_t* animation, size_t animation_index, uint32_t object_count, float** rotation_out, float** translation_out, float** scale_out) {
-  size_t animation_frames_count = animation->frame_counts[animation_index];
-  size_t animation_max_keyframe = animation->max_keyframe + 1;
-  float* rotation = malloc(animation_max_keyframe * 16 * object_count); // N quaternions, each quaternion is 4 floats, times object_count
-  float* translation = malloc(animation_max_keyframe * 12 * object_count); // N translation vectors of 3 floats each, times object_count
-  float* scale = malloc(animation_max_keyframe * 12 * object_count); // N scale vectors of 3 floats each, times object_count
-  uint32_t object_start_rot = 0;
-  uint32_t object_start_dest_rot = 0;
-  uint32_t object_start_trans = 0;
-  uint32_t object_start_dest_trans = 0;
-  uint32_t object_start_scale = 0;
-  uint32_t object_start_dest_scale = 0;
+// The frames of an animation written for each object, concatenated object
+// by object into frames. counts gets each object's number of frames. Returns
+// the total.
+size_t animation_key_frames(animation_t* animation, size_t animation_index, uint32_t object_count, uint16_t* frames, size_t* counts) {
+  size_t frame_count = animation->frame_counts[animation_index];
+  uint8_t* table = animation->frame_tables[animation_index];
+  size_t total = 0;
   for (int object = 0; object < object_count; object++) {
-    uint32_t offset = animation->transform_offsets[object];
-    iso_seek_to_sector(animation->iso, animation->file_sector);
-    iso_seek_forward(animation->iso, offset);
-    matrix_t m;
-
-    // Read one matrix and one translation vector for each keyframe across all
-    // animations in the file. This actually reads more than it needs to because
-    // typically not all objects will have the same number of keyframes as
-    // animation.max_keyframe. So if we are near the end of the rom this code
-    // could error from reading further than it needs to.
-    for (int frame = 0; frame < animation_max_keyframe; frame++) {
-      size_t items_read = iso_fread(
-        animation->iso,
-        &m,
-        sizeof(matrix_t),
-        1);
-      if (items_read != 1) {
-        fprintf(stderr, "items read: %lu\n", items_read);
-        die("fread failure, an error occured or EOF (rotation matrix)");
-      }
-      fmatrix_t fm = matrix_to_fmatrix(m);
-      fmatrix_t rotate_matrix;
-      fmatrix_t scale_matrix;
-      decompose(fm, &scale_matrix, &rotate_matrix);
-      fprintf(stderr, "Scale by: [%.02f %.02f %.02f]\n",
-        scale_matrix.x[0],
-        scale_matrix.x[4],
-        scale_matrix.x[8]);
-      quaternion_t q = matrix_to_quaternion(rotate_matrix);
-      normalize_quaternion_inplace(&q);
-      fprintf(stderr, "object %d/%d, keyframe %d/%ld\n",
-        object + 1, object_count,
-        frame + 1, animation_max_keyframe);
-      display_matrix_debug(&m);
-      display_quaternion_debug(&q);
-      vertex_t t = {0};
-      items_read = iso_fread(
-        animation->iso,
-        &t,
-        sizeof(vertex_t),
-        1);
-      if (items_read != 1) {
-        die("fread failure, an error occured or EOF (translation)");
+    counts[object] = 0;
+    for (int frame = 0; frame < frame_count; frame++) {
+      // With STEP interpolation a frame that repeats the previous keyframe
+      // changes nothing. The last frame is kept so that every channel spans
+      // the whole animation.
+      if (export_options.keyframes_only && frame > 0 && frame < frame_count - 1 &&
+          table[frame * object_count + object] == table[(frame - 1) * object_count + object]) {
+        continue;
       }
-      // Spec says component order is XYZW
-      rotation[object_start_rot + frame * 4 + 0] = q.x;
-      rotation[object_start_rot + frame * 4 + 1] = q.y;
-      rotation[object_start_rot + frame * 4 + 2] = -q.z;
-      rotation[object_start_rot + frame * 4 + 3] = q.w;
-      translation[object_start_trans + frame * 3 + 0] = -t.x / 4096.0;
-      translation[object_start_trans + frame * 3 + 1] = -t.y / 4096.0;
-      translation[object_start_trans + frame * 3 + 2] = t.z / 4096.0;
-      scale[object_start_scale + frame * 3 + 0] = scale_matrix.x[0];
-      scale[object_start_scale + frame * 3 + 1] = scale_matrix.x[4];
-      scale[object_start_scale + frame * 3 + 2] = scale_matrix.x[8];
-    }
-    object_start_rot += animation_max_keyframe * 4;
-    object_start_trans += animation_max_keyframe * 3;
-    object_start_scale += animation_max_keyframe * 3;
-  }
-  float* rotation_final = malloc(animation_frames_count * 16 * object_count);
-  // TODO: 12, not 16?
-  float* translation_final = malloc(animation_frames_count * 16 * object_count);
-  // TODO: 12, not 16?
-  float* scale_final = malloc(animation_frames_count * 16 * object_count);
+      frames[total++] = frame;
+      counts[object]++;
+    }
+  }
+  return total;
+}
+
+// Gathers the given frames of an animation from the file's keyframe pool,
+// with frames and counts as from animation_key_frames
+void serialize_animation(animation_t* animation, size_t animation_index, uint32_t object_count, const uint16_t* frames, const size_t* counts, float** rotation_out, float** translation_out, float** scale_out) {
+  size_t keyframe_count = animation->max_keyframe + 1;
+  size_t total = 0;
+  for (int object = 0; object < object_count; object++) {
+    total += counts[object];
+  }
+  float* rotation_final = malloc(total * 4 * sizeof(float));
+  float* translation_final = malloc(total * 3 * sizeof(float));
+  float* scale_final = malloc(total * 3 * sizeof(float));
+  size_t dest = 0;
   for (int object = 0; object < object_count; object++) {
-    object_start_rot = animation_max_keyframe * 4 * object;
-    object_start_dest_rot = animation_frames_count * 4 * object;
-    object_start_trans = animation_max_keyframe * 3 * object;
-    object_start_dest_trans = animation_frames_count * 3 * object;
-    object_start_scale = animation_max_keyframe * 3 * object;
-    object_start_dest_scale = animation_frames_count * 3 * object;
-    for (int frame = 0; frame < animation_frames_count; frame++) {
-      uint8_t from = animation->frame_tables[animation_index][frame * object_count + object];
+    size_t first = object * keyframe_count;
+    for (size_t end = dest + counts[object]; dest < end; dest++) {
+      uint8_t from = animation->frame_tables[animation_index][frames[dest] * object_count + object];
       memcpy(
-        &rotation_final[object_start_dest_rot + frame * 4],
-        &rotation[object_start_rot + from * 4],
+        &rotation_final[dest * 4],
+        &animation->keyframe_rotations[(first + from) * 4],
         4 * sizeof(float));
       memcpy(
-        &translation_final[object_start_dest_trans + frame * 3],
-        &translation[object_start_trans + from * 3],
+        &translation_final[dest * 3],
+        &animation->keyframe_translations[(first + from) * 3],
         3 * sizeof(float));
       memcpy(
-        &scale_final[object_start_dest_scale + frame * 3],
-        &scale[object_start_scale + from * 3],
+        &scale_final[dest * 3],
+        &animation->keyframe_scales[(first + from) * 3],
         3 * sizeof(float));
     }
   }
-  free(rotation);
-  free(translation);
-  free(scale);
   *rotation_out = rotation_final;
   *translation_out = translation_final;
   *scale_out = scale_final;
 }
 
-// We transform a vertex by looking up its object's transform matrix and
-// translation on the given frame number, and then potentially recursing with the parent object
-vertex_t transform_vertex(vertex_t v, model_t* model, animation_t* animation, uint32_t object, uint32_t frame) {
-  uint32_t offset = animation->transform_offsets[object];
-  iso_seek_to_sector(animation->iso, animation->file_sector);
-  // We should actually be looking up the correct frame in the frame table but
-  // it doesn't make much difference for our test model
-  iso_seek_forward(animation->iso, offset + frame * 24);
-  matrix_t m;
-  size_t items_read = iso_fread(
-    animation->iso,
-    &m,
-    sizeof(matrix_t),
-    1);
-  if (items_read != 1) {
-    die("fread failure, an error occured or EOF (matrix)");
+// Like animation_key_frames, but picks LINEAR keys that reproduce every
+// frame of the animation within the -f and -g errors, in world space through
+// node_tree
+size_t animation_fitted_frames(animation_t* animation, size_t animation_index, uint32_t object_count, int32_t* node_tree, uint16_t* frames, size_t* counts) {
+  size_t frame_count = animation->frame_counts[animation_index];
+  for (int object = 0; object < object_count; object++) {
+    counts[object] = frame_count;
+    for (int frame = 0; frame < frame_count; frame++) {
+      frames[object * frame_count + frame] = frame;
+    }
   }
-  vertex_t translation = {0};
-  items_read = iso_fread(
-    animation->iso,
-    &translation,
-    sizeof(vertex_t),
-    1);
-  if (items_read != 1) {
-    die("fread failure, an error occured or EOF (translation)");
-  }
-  if (sizeof(matrix_t) + sizeof(vertex_t) != 24) {
-    die("alignment issue");
-  }
-  vertex_t v_rotated = rotate(m, v);
-  vertex_t v_translated = translate(translation, v_rotated);
-  if (model->skeleton[object] > 0) {
-    uint32_t parent = -1;
-    for (int i = object - 1; i >= 0; i--) {
-      if (model->skeleton[i] + 1 == model->skeleton[object]) {
-        parent = i;
-        break;
+  float* rotation;
+  float* translation;
+  float* scale;
+  serialize_animation(
+    animation, animation_index, object_count, frames, counts,
+    &rotation, &translation, &scale);
+  keyframe_fit_options_t options = {
+    .position_error = export_options.fit_position_error,
+    .angle_error = export_options.fit_angle_error * M_PI / 180
+  };
+  size_t total = fit_keyframes(
+    rotation, translation, scale, node_tree, object_count, frame_count,
+    &options, frames, counts);
+  free(rotation);
+  free(translation);
+  free(scale);
+  return total;
+}
+
+// Negates rotations where needed so that each key is in the same hemisphere
+// as the one before it, and LINEAR playback takes the shorter way round even
+// in players that don't check
+void align_rotation_signs(float* rotations, const size_t* counts, uint32_t object_count) {
+  size_t key = 0;
+  for (int object = 0; object < object_count; object++) {
+    for (size_t k = 1; k < counts[object]; k++) {
+      float* q = &rotations[4 * (key + k)];
+      const float* previous = q - 4;
+      if (q[0] * previous[0] + q[1] * previous[1] + q[2] * previous[2] + q[3] * previous[3] < 0) {
+        for (int c = 0; c < 4; c++) {
+          q[c] = -q[c];
+        }
       }
     }
-    if (parent == -1) {
-      die("Couldn't find the parent object");
+    key += counts[object];
+  }
+}
+
+// Computes the world transform of every object at a frame of an animation,
+// from the matrices and translations in the keyframe pool. Each is 12 floats
+// on disc axes: a 3x3 matrix by rows, then a translation, for
+// transform_vertices. An object's keyframe applies first, then its parent's
+// world transform. Parents come before their children in the node tree, so
+// a single pass composes every chain.
+void evaluate_pose(animation_t* animation, size_t animation_index, size_t frame, int32_t* node_tree, uint32_t object_count, float* world) {
+  uint8_t* table = &animation->frame_tables[animation_index][frame * object_count];
+  size_t keyframe_count = animation->max_keyframe + 1;
+  for (uint32_t object = 0; object < object_count; object++) {
+    size_t k = object * keyframe_count + table[object];
+    fmatrix_t m = matrix_to_fmatrix(animation->keyframe_matrices[k]);
+    vertex_t t = animation->keyframe_vectors[k];
+    float local[12] = {
+      m.x[0], m.x[1], m.x[2],
+      m.x[3], m.x[4], m.x[5],
+      m.x[6], m.x[7], m.x[8],
+      t.x, t.y, t.z
+    };
+    float* out = &world[12 * object];
+    if (node_tree[object] < 0) {
+      memcpy(out, local, sizeof(local));
+      continue;
+    }
+    const float* parent = &world[12 * node_tree[object]];
+    for (int row = 0; row < 3; row++) {
+      for (int column = 0; column < 3; column++) {
+        out[3 * row + column] =
+          parent[3 * row] * local[column] +
+          parent[3 * row + 1] * local[3 + column] +
+          parent[3 * row + 2] * local[6 + column];
+      }
+      out[9 + row] = parent[3 * row] * local[9] + parent[3 * row + 1] * local[10] +
+        parent[3 * row + 2] * local[11] + parent[9 + row];
     }
-    return transform_vertex(v_translated, model, animation, parent, frame);
-  } else {
-    return v_translated;
   }
 }
 
+// Poses an object's vertices at a frame of an animation the way a game
+// would on the GTE: the object's world matrix is composed from the root
+// down with gte_compose, and the vertices go through RotTrans with it once.
+// Normals go without the translations. Returns the FLAG bits set on the way.
+uint32_t pose_vertices_gte(animation_t* animation, size_t animation_index, size_t frame, int32_t* node_tree, uint32_t object_count, uint32_t object, vertex_t* vertices, size_t count, int translate) {
+  uint8_t* table = &animation->frame_tables[animation_index][frame * object_count];
+  size_t keyframe_count = animation->max_keyframe + 1;
+  int32_t chain[object_count];
+  size_t depth = 0;
+  for (int32_t o = object; o >= 0; o = node_tree[o]) {
+    chain[depth++] = o;
+  }
+  matrix_t rotation = {{ 4096, 0, 0, 0, 4096, 0, 0, 0, 4096 }};
+  int32_t translation[3] = { 0, 0, 0 };
+  uint32_t flags = 0;
+  while (depth > 0) {
+    int32_t o = chain[--depth];
+    size_t k = o * keyframe_count + table[o];
+    flags |= gte_compose(&rotation, translation, rotation, translation,
+      animation->keyframe_matrices[k], animation->keyframe_vectors[k]);
+  }
+  if (!translate) {
+    memset(translation, 0, sizeof(translation));
+  }
+  flags |= gte_rotate_translate(vertices, vertices, count, rotation, translation);
+  return flags;
+}
+
 void read_blink(iso_t* iso, blink_t* blink) {
   size_t items_read;
   items_read = iso_fread(
@@ -800,354 +1131,936 @@ model_t load_model(iso_t* iso, uint32_t sector) {
   return new_model;
 }
 
-void make_epic_gltf_file(char* working_dir, float** vertices, size_t* vertex_count, uint32_t** tri_indices, size_t* triangle_count, float** texcoords, size_t* texcoord_count, animation_t* animations, size_t animation_file_count, char* animation_labels, int32_t* node_tree, size_t object_count, size_t png_alloc, blink_t* blinks, size_t blink_count) {
-  size_t total_vertices = 0;
-  for (int i = 0; i < object_count; i++) {
-    total_vertices += vertex_count[i];
-  }
-  float* all_vertices = malloc(sizeof(float) * 3 * total_vertices);
-  size_t vertex_array_offset = 0;
-  for (int i = 0; i < object_count; i++) {
-    memcpy(&all_vertices[vertex_array_offset], vertices[i], 4 * 3 * vertex_count[i]);
-    vertex_array_offset += 3 * vertex_count[i];
+// Base64 encodes size bytes into the next free buffer and adds a view that
+// covers all of it. Buffers and views are allocated in lockstep, so the view
+// shares the buffer's index.
+cgltf_buffer_view* add_buffer(cgltf_buffer* buffers, cgltf_buffer_view* buffer_views, size_t* buffer_count, char* name, char* view_name, void* bytes, size_t size, size_t stride, cgltf_buffer_view_type type) {
+  cgltf_buffer* buffer = &buffers[*buffer_count];
+  cgltf_buffer_view* view = &buffer_views[*buffer_count];
+  (*buffer_count)++;
+  char* uri;
+  if (export_options.shared_store) {
+    uint64_t key = store_hash(bytes, size, 0);
+    size_t stored_size;
+    if (!store_lookup(STORE_DIR, key, "bin", &stored_size)) {
+      if (!store_put(STORE_DIR, key, "bin", bytes, size)) {
+        die("add_buffer: failed to write to the store");
+      }
+    } else if (stored_size != size) {
+      die("add_buffer: store hash collision");
+    }
+    uri = store_uri(STORE_DIR, key, "bin");
+  } else {
+    uri = octet_stream_encode(bytes, size);
   }
+  *buffer = (cgltf_buffer) {
+    .name = name,
+    .size = size,
+    .uri = uri
+  };
+  *view = (cgltf_buffer_view) {
+    .name = view_name,
+    .buffer = buffer,
+    .offset = 0,
+    .size = size,
+    .stride = stride,
+    .type = type
+  };
+  fprintf(stderr, "%s encoded buffer size: %ld\n", name, size);
+  return view;
+}
 
-  size_t total_triangles = 0;
-  for (int i = 0; i < object_count; i++) {
-    total_triangles += triangle_count[i];
-  }
-  uint32_t* all_triangles = malloc(sizeof(uint32_t) * 3 * total_triangles);
-  size_t index_array_offset = 0;
-  for (int i = 0; i < object_count; i++) {
-    memcpy(&all_triangles[index_array_offset], tri_indices[i], 4 * 3 * triangle_count[i]);
-    index_array_offset += 3 * triangle_count[i];
+void write_index(uint8_t* out, size_t index_size, size_t at, uint32_t index) {
+  if (index_size == sizeof(uint16_t)) {
+    uint16_t short_index = index;
+    memcpy(&out[at * index_size], &short_index, sizeof(uint16_t));
+  } else {
+    memcpy(&out[at * index_size], &index, sizeof(uint32_t));
   }
+}
 
-  size_t total_texcoords = 0;
-  for (int i = 0; i < object_count; i++) {
-    total_texcoords += texcoord_count[i];
-  }
-  float* all_texcoords = malloc(sizeof(float) * 2 * total_texcoords);
-  size_t texcoord_array_offset = 0;
-  for (int i = 0; i < object_count; i++) {
-    memcpy(&all_texcoords[texcoord_array_offset], texcoords[i], 4 * 2 * texcoord_count[i]);
-    texcoord_array_offset += 2 * texcoord_count[i];
+// Level 0 is the object's full geometry
+object_lod_t object_lod(object_mesh_t* mesh, int level) {
+  if (level == 0) {
+    return (object_lod_t) {
+      .indices = mesh->indices,
+      .triangle_count = mesh->triangle_count,
+      .semi_transparent_triangle_count = mesh->semi_transparent_triangle_count
+    };
   }
+  return mesh->lods[level - 1];
+}
 
-  char* vertex_encoded = octet_stream_encode(all_vertices, 4 * 3 * total_vertices);
-  fprintf(stderr, "vertex encoded buffer size: %d\n", 4 * 3 * total_vertices);
-  free(all_vertices);
-  char* index_encoded = octet_stream_encode(all_triangles, 4 * 3 * total_triangles);
-  fprintf(stderr, "index encoded buffer size: %d\n", 4 * 3 * total_triangles);
-  free(all_triangles);
+// Octahedral encoding from Cigolle et al., "A Survey of Efficient
+// Representations for Independent Unit Vectors". Decode with
+// n = (x, y, 1 - |x| - |y|), then if n.z < 0, n.xy = (1 - |n.yx|) * sign(n.xy),
+// and normalize.
+void encode_octahedral(int16_t* out, const float* n) {
+  float l1 = fabsf(n[0]) + fabsf(n[1]) + fabsf(n[2]);
+  float x = n[0] / l1;
+  float y = n[1] / l1;
+  if (n[2] < 0) {
+    float fx = (1 - fabsf(y)) * (x >= 0 ? 1 : -1);
+    float fy = (1 - fabsf(x)) * (y >= 0 ? 1 : -1);
+    x = fx;
+    y = fy;
+  }
+  out[0] = lroundf(x * 32767);
+  out[1] = lroundf(y * 32767);
+}
 
-  char* texcoord_encoded = octet_stream_encode(all_texcoords, 4 * 2 * total_texcoords);
-  fprintf(stderr, "texcoord encoded buffer size: %d\n", 4 * 2 * total_texcoords);
-  free(all_texcoords);
+// An object's animation tracks, in the order of its channels
+enum { TRACK_ROTATION, TRACK_TRANSLATION, TRACK_SCALE, TRACK_COUNT };
 
-  char* png_encoded = octet_stream_encode(png_buffer, png_alloc);
-  fprintf(stderr, "texture png encoded buffer size: %d\n", png_alloc);
+const size_t track_widths[TRACK_COUNT] = { 4, 3, 3 };
 
-  size_t total_animation_count = 0;
-  for (int i = 0; i < animation_file_count; i++) {
-    total_animation_count += animations[i].animation_count;
+char* track_buffer_names[TRACK_COUNT] = {
+  "animation_rotation_output",
+  "animation_translation_output",
+  "animation_scale_output"
+};
+
+char* track_view_names[TRACK_COUNT] = {
+  "animation_rotation_output_view",
+  "animation_translation_output_view",
+  "animation_scale_output_view"
+};
+
+// The node transform that applies when a track has no channel
+const float track_rest[TRACK_COUNT][4] = {
+  { 0, 0, 0, 1 },
+  { 0, 0, 0 },
+  { 1, 1, 1 }
+};
+
+// Keys of a rotation or scale track closer than this are taken as equal.
+// Smaller differences come from rounding the 4.12 matrices they were
+// decomposed from, half a unit on each of three elements. Translations are
+// exact copies of the integers on disc, so only equal ones match.
+#define TRACK_TOLERANCE (0.8660254 / 4096)
+
+const float track_tolerances[TRACK_COUNT] = { TRACK_TOLERANCE, 0, TRACK_TOLERANCE };
+
+// The angle in radians between two rotations
+double quaternion_angle(const float* a, const float* b) {
+  double dot = 0;
+  double length_a = 0;
+  double length_b = 0;
+  for (int c = 0; c < 4; c++) {
+    dot += (double) a[c] * b[c];
+    length_a += (double) a[c] * a[c];
+    length_b += (double) b[c] * b[c];
+  }
+  double cosine = fabs(dot) / sqrt(length_a * length_b);
+  return cosine < 1 ? 2 * acos(cosine) : 0;
+}
+
+// How far a key is from another, as an angle in radians for rotations and
+// the largest component difference otherwise
+double track_key_error(int track, const float* a, const float* b) {
+  if (track == TRACK_ROTATION) {
+    return quaternion_angle(a, b);
+  }
+  double error = 0;
+  for (size_t c = 0; c < track_widths[track]; c++) {
+    error = fmax(error, fabs(a[c] - b[c]));
   }
+  return error;
+}
 
-  cgltf_buffer buffers[4 * total_animation_count + 4];
-  buffers[0] = (cgltf_buffer) {
-    .name = "vertex_buffer",
-    .size = 4 * 3 * total_vertices,
-    .uri = vertex_encoded
-  };
-  buffers[1] = (cgltf_buffer) {
-    .name = "vertex_index_buffer",
-    .size = 4 * 3 * total_triangles,
-    // 3 indices of 32-bit size, little-endian, "0 1 2"
-    .uri = index_encoded
-  };
+int track_keys_close(int track, const float* a, const float* b) {
+  for (size_t c = 0; c < track_widths[track]; c++) {
+    if (fabsf(a[c] - b[c]) > track_tolerances[track]) {
+      return 0;
+    }
+  }
+  return 1;
+}
 
-  size_t animation_counter = 0;
-  // Create a buffer for each animation
-  for (size_t animation_file = 0; animation_file < animation_file_count; animation_file++) {
-    animation_t* animation = &animations[animation_file];
-    for (size_t anim = 0; anim < animation->animation_count; anim++) {
-      size_t frame_count = animation->frame_counts[anim];
-      float animation_input[frame_count];
-      for (int i = 0; i < frame_count; i++) {
-        animation_input[i] = (float) (i * 0.0333333); // 30 FPS
+// Shrinks an animation's tracks in place for -t. A track whose keys all
+// stay within track_tolerances of the rest pose gets no keys at all, one
+// whose keys stay that close to its first key keeps just that one, and the
+// others keep all of theirs. firsts and counts get where each object's
+// tracks now start and how many keys they have, totals the keys left in each
+// track, and errors is raised to the largest change made to a key of each
+// track.
+void compress_tracks(uint32_t object_count, const size_t* key_counts, float* tracks[TRACK_COUNT], size_t (*firsts)[TRACK_COUNT], size_t (*counts)[TRACK_COUNT], size_t* totals, double* errors) {
+  for (int track = 0; track < TRACK_COUNT; track++) {
+    size_t width = track_widths[track];
+    size_t from = 0;
+    size_t to = 0;
+    for (int object = 0; object < object_count; object++) {
+      const float* keys = &tracks[track][from * width];
+      size_t count = key_counts[object];
+      int rest = count > 0;
+      int constant = count > 0;
+      for (size_t k = 0; k < count; k++) {
+        rest = rest && track_keys_close(track, &keys[k * width], track_rest[track]);
+        constant = constant && track_keys_close(track, &keys[k * width], keys);
       }
-      char* animation_input_encoded = octet_stream_encode(animation_input, frame_count * sizeof(float));
-      fprintf(stderr, "animation input %d encoded buffer size: %d\n", animation_counter, frame_count * sizeof(float));
-      buffers[animation_counter * 4 + 2] = (cgltf_buffer)
-        {
-          .name = "animation_input",
-          .size = frame_count * sizeof(float),
-          .uri = animation_input_encoded,
-        };
-
-      float* rotation_anim;
-      float* translation_anim;
-      float* scale_anim;
-      serialize_animation(animation, anim, object_count, &rotation_anim, &translation_anim, &scale_anim);
-      char* rotation_encoded = octet_stream_encode(rotation_anim,
-        object_count * frame_count * 4 * sizeof(float));
-      fprintf(stderr, "rotation encoded buffer size: %d\n", object_count * frame_count * 4 * sizeof(float));
-      free(rotation_anim);
-      char* translation_encoded = octet_stream_encode(translation_anim,
-        object_count * frame_count * 3 * sizeof(float));
-      fprintf(stderr, "translation encoded buffer size: %d\n", object_count * frame_count * 4 * sizeof(float));
-      free(translation_anim);
-      char* scale_encoded = octet_stream_encode(scale_anim,
-        object_count * frame_count * 3 * sizeof(float));
-      fprintf(stderr, "scale encoded buffer size: %d\n", object_count * frame_count * 4 * sizeof(float));
-      free(scale_anim);
-
-      buffers[animation_counter * 4 + 3] = (cgltf_buffer)
-        {
-          .name = "animation_rotation_output",
-          .size = object_count * frame_count * 4 * sizeof(float),
-          .uri = rotation_encoded,
-        };
-      buffers[animation_counter * 4 + 4] = (cgltf_buffer)
-        {
-          .name = "animation_translation_output",
-          .size = object_count * frame_count * 3 * sizeof(float),
-          .uri = translation_encoded
-        };
-      buffers[animation_counter * 4 + 5] = (cgltf_buffer)
-        {
-          .name = "animation_scale_output",
-          .size = object_count * frame_count * 3 * sizeof(float),
-          .uri = scale_encoded
-        };
-      animation_counter++;
+      if (rest || constant) {
+        const float* kept = rest ? track_rest[track] : keys;
+        for (size_t k = 0; k < count; k++) {
+          errors[track] = fmax(errors[track], track_key_error(track, &keys[k * width], kept));
+        }
+        count = rest ? 0 : 1;
+      }
+      memmove(&tracks[track][to * width], keys, count * width * sizeof(float));
+      firsts[object][track] = to;
+      counts[object][track] = count;
+      from += key_counts[object];
+      to += count;
     }
+    totals[track] = to;
   }
-  buffers[total_animation_count * 4 + 2] = (cgltf_buffer)
-    {
-      .name = "texcoord",
-      .size = 4 * 2 * total_texcoords,
-      .uri = texcoord_encoded
-    };
-  buffers[total_animation_count * 4 + 3] = (cgltf_buffer)
-    {
-      .name = "texture_buffer",
-      .size = png_alloc,
-      .uri = png_encoded
-    };
-  cgltf_buffer_view buffer_views[4 * total_animation_count + 4];
-  buffer_views[0] = (cgltf_buffer_view)
-    {
-      .name = "vertex_buffer_view",
-      .buffer = &buffers[0],
-      .offset = 0,
-      .size = 4 * 3 * total_vertices,
-      .stride = 12,
-      .type = cgltf_buffer_view_type_vertices
-    };
-  buffer_views[1] = (cgltf_buffer_view)
-    {
-      .name = "vertex_index_buffer_view",
-      .buffer = &buffers[1],
-      .offset = 0,
-      .size = 4 * 3 * total_triangles,
-      //.stride = 0,
-      .type = cgltf_buffer_view_type_indices
-    };
+  // An animation needs at least one channel, so a clip that holds the rest
+  // pose throughout keeps the first object's rotation
+  if (totals[TRACK_ROTATION] + totals[TRACK_TRANSLATION] + totals[TRACK_SCALE] == 0 && object_count > 0) {
+    counts[0][TRACK_ROTATION] = 1;
+    totals[TRACK_ROTATION] = 1;
+  }
+}
 
-  animation_counter = 0;
-  // Create a buffer for each animation
-  for (size_t animation_file = 0; animation_file < animation_file_count; animation_file++) {
-    animation_t* animation = &animations[animation_file];
-    for (int anim = 0; anim < animation->animation_count; anim++) {
-      size_t frame_count = animation->frame_counts[anim];
-      buffer_views[animation_counter * 4 + 2] = (cgltf_buffer_view)
-        {
-          .name = "animation_input",
-          .buffer = &buffers[animation_counter * 4 + 2],
-          .offset = 0,
-          .size = frame_count * sizeof(float)
-        };
-      buffer_views[animation_counter * 4 + 3] = (cgltf_buffer_view)
-        {
-          .name = "animation_rotation_output_view",
-          .buffer = &buffers[animation_counter * 4 + 3],
-          .offset = 0,
-          .size = object_count * frame_count * 4 * sizeof(float),
-        };
-      buffer_views[animation_counter * 4 + 4] = (cgltf_buffer_view)
-        {
-          .name = "animation_translation_output_view",
-          .buffer = &buffers[animation_counter * 4 + 4],
-          .offset = 0,
-          .size = object_count * frame_count * 3 * sizeof(float),
-        };
-      buffer_views[animation_counter * 4 + 5] = (cgltf_buffer_view)
-        {
-          .name = "animation_scale_output_view",
-          .buffer = &buffers[animation_counter * 4 + 5],
-          .offset = 0,
-          .size = object_count * frame_count * 3 * sizeof(float),
-        };
-      animation_counter++;
+// Packs XYZW rotations as normalized int16. Returns the largest angle, in
+// radians, between a rotation and its packed form.
+double pack_rotations(int16_t* out, const float* rotations, size_t count) {
+  double max_error = 0;
+  for (size_t i = 0; i < count; i++) {
+    float unpacked[4];
+    for (int c = 0; c < 4; c++) {
+      out[4 * i + c] = lround(rotations[4 * i + c] * 32767.0);
+      unpacked[c] = out[4 * i + c] / 32767.0;
     }
+    max_error = fmax(max_error, quaternion_angle(&rotations[4 * i], unpacked));
   }
-  buffer_views[total_animation_count * 4 + 2] = (cgltf_buffer_view)
-    {
-      .name = "texcoord_view",
-      .buffer = &buffers[total_animation_count * 4 + 2],
-      .offset = 0,
-      .size = 4 * 2 * total_texcoords,
-      .stride = 8
-    };
-  buffer_views[total_animation_count * 4 + 3] = (cgltf_buffer_view)
-    {
-      .name = "texture_view",
-      .buffer = &buffers[total_animation_count * 4 + 3],
-      .offset = 0,
-      .size = png_alloc
-    };
-  cgltf_accessor accessors[4 * object_count * total_animation_count + 3 * object_count];
-  size_t object_vertex_offset = 0;
+  return max_error;
+}
+
+void make_epic_gltf_file(char* working_dir, object_mesh_t* objects, animation_t* animations, size_t animation_file_count, char* animation_labels, int32_t* node_tree, size_t object_count, blink_t* blinks, size_t blink_count) {
+  int quantize = export_options.quantize;
+  int skinned = export_options.skinned;
+  int lod_levels = export_options.lod_levels;
+  size_t total_vertices = 0;
+  size_t total_triangles = 0;
+  size_t level_triangles[lod_levels];
+  size_t max_vertex_count = 0;
+  size_t vertex_base[object_count];
+  memset(level_triangles, 0, sizeof(level_triangles));
+  for (int i = 0; i < object_count; i++) {
+    vertex_base[i] = total_vertices;
+    total_vertices += objects[i].vertex_count;
+    for (int level = 0; level < lod_levels; level++) {
+      level_triangles[level] += object_lod(&objects[i], level).triangle_count;
+    }
+    if (objects[i].vertex_count > max_vertex_count) {
+      max_vertex_count = objects[i].vertex_count;
+    }
+  }
+  // A skinned export puts every object in one primitive
+  if (skinned) {
+    max_vertex_count = total_vertices;
+  }
+
+  // Quantized positions are padded to 8 bytes because vertex attributes have
+  // to be 4-byte aligned. 0xffff is reserved for primitive restart, so 16 bit
+  // indices are only usable below that.
+  size_t position_size = quantize ? 4 * sizeof(int16_t) : 3 * sizeof(float);
+  size_t texcoord_size = quantize ? 2 * sizeof(uint16_t) : 2 * sizeof(float);
+  int octahedral = export_options.octahedral_normals;
+  size_t normal_size = octahedral ? 2 * sizeof(int16_t) :
+    quantize ? 4 * sizeof(int16_t) : 3 * sizeof(float);
+  size_t index_size = quantize && max_vertex_count < 0xffff ?
+    sizeof(uint16_t) : sizeof(uint32_t);
+
+  float bounds_min[object_count + 1][3];
+  float bounds_max[object_count + 1][3];
+  for (int k = 0; k < 3; k++) {
+    bounds_min[object_count][k] = +999999;
+    bounds_max[object_count][k] = -999999;
+  }
+  uint8_t* all_vertices = malloc(position_size * total_vertices);
+  uint8_t* all_texcoords = malloc(texcoord_size * total_vertices);
+  int palette_swap = export_options.palette_swap;
+  uint8_t* all_palette_rows = palette_swap ? malloc(texcoord_size * total_vertices) : NULL;
+  uint8_t* all_normals = malloc(normal_size * total_vertices);
+  for (int i = 0; i < object_count; i++) {
+    object_mesh_t* mesh = &objects[i];
+    for (int k = 0; k < 3; k++) {
+      bounds_min[i][k] = +999999;
+      bounds_max[i][k] = -999999;
+    }
+    if (!quantize) {
+      vertices_to_floats(
+        (float*) &all_vertices[position_size * vertex_base[i]],
+        bounds_min[i], bounds_max[i],
+        mesh->positions, mesh->vertex_count, export_scale);
+    }
+    for (int j = 0; j < mesh->vertex_count; j++) {
+      vertex_t v = mesh->positions[j];
+      // Slightly adjust the UV coordinates to make sampling of texels
+      // more consistent
+      float e = 0.0001;
+      float u = mesh->texels[2 * j + 0] / (double) atlas_pages[mesh->page].width + e;
+      float t = mesh->texels[2 * j + 1] / (double) atlas_pages[mesh->page].height + e;
+      size_t vertex_index = vertex_base[i] + j;
+      if (quantize) {
+        // The axis flips and the 4.12 scale are applied by the mesh node, or
+        // by the inverse bind matrices when skinned
+        int16_t qp[4] = { v.x, v.y, v.z, 0 };
+        uint16_t qt[2] = {
+          u >= 1.0 ? 0xffff : lround(u * 0xffff),
+          t >= 1.0 ? 0xffff : lround(t * 0xffff)
+        };
+        memcpy(&all_vertices[position_size * vertex_index], qp, position_size);
+        memcpy(&all_texcoords[texcoord_size * vertex_index], qt, texcoord_size);
+        for (int k = 0; k < 3; k++) {
+          if (qp[k] < bounds_min[i][k]) bounds_min[i][k] = qp[k];
+          if (qp[k] > bounds_max[i][k]) bounds_max[i][k] = qp[k];
+        }
+      } else {
+        float ft[2] = { u, t };
+        memcpy(&all_texcoords[texcoord_size * vertex_index], ft, texcoord_size);
+      }
+      // The CLUT row goes in v, at the middle of the row's texels
+      if (palette_swap) {
+        float row = (mesh->palette_rows[j] + 0.5) / clut_strip.height;
+        uint16_t qr[2] = { 0, lroundf(row * 0xffff) };
+        float fr[2] = { 0, row };
+        memcpy(&all_palette_rows[texcoord_size * vertex_index],
+          quantize ? (void*) qr : (void*) fr, texcoord_size);
+      }
+
+      // Normals go through the same axis flips as positions. Quantized
+      // positions leave those to the node, whose scale flips the normals too.
+      vertex_t nv = mesh->normals[j];
+      float n[3] = { nv.x, nv.y, nv.z };
+      if (!quantize) {
+        n[0] = -n[0];
+        n[1] = -n[1];
+      }
+      float length = sqrtf(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+      if (length == 0) {
+        n[2] = length = 1;
+      }
+      for (int k = 0; k < 3; k++) {
+        n[k] /= length;
+      }
+      uint8_t* normal_out = &all_normals[normal_size * vertex_index];
+      if (octahedral) {
+        int16_t qn[2];
+        encode_octahedral(qn, n);
+        memcpy(normal_out, qn, normal_size);
+      } else if (quantize) {
+        int16_t qn[4] = {
+          lroundf(n[0] * 32767), lroundf(n[1] * 32767), lroundf(n[2] * 32767), 0
+        };
+        memcpy(normal_out, qn, normal_size);
+      } else {
+        memcpy(normal_out, n, normal_size);
+      }
+    }
+    for (int k = 0; k < 3; k++) {
+      if (bounds_min[i][k] < bounds_min[object_count][k]) {
+        bounds_min[object_count][k] = bounds_min[i][k];
+      }
+      if (bounds_max[i][k] > bounds_max[object_count][k]) {
+        bounds_max[object_count][k] = bounds_max[i][k];
+      }
+    }
+  }
+
+  // When skinned, indices are rebased onto the shared vertex buffer and the
+  // semi-transparent triangles of every object go before the opaque ones.
+  // Detail levels follow each other, all sharing the vertex buffer.
+  for (int level = 0; level < lod_levels; level++) {
+    total_triangles += level_triangles[level];
+  }
+  uint8_t* all_triangles = malloc(index_size * 3 * total_triangles);
+  size_t index_start[lod_levels][object_count];
+  size_t level_start[lod_levels];
+  size_t index_array_offset = 0;
+  for (int level = 0; level < lod_levels; level++) {
+    level_start[level] = index_array_offset;
+    for (int pass = 0; pass < (skinned ? 2 : 1); pass++) {
+      for (int i = 0; i < object_count; i++) {
+        object_lod_t lod = object_lod(&objects[i], level);
+        size_t start = 0;
+        size_t end = 3 * lod.triangle_count;
+        uint32_t base = 0;
+        if (skinned) {
+          size_t split = 3 * lod.semi_transparent_triangle_count;
+          start = pass == 0 ? 0 : split;
+          end = pass == 0 ? split : end;
+          base = vertex_base[i];
+        }
+        index_start[level][i] = index_array_offset;
+        for (size_t j = start; j < end; j++) {
+          write_index(all_triangles, index_size, index_array_offset++, lod.indices[j] + base);
+        }
+      }
+    }
+  }
+
+  size_t total_animation_count = 0;
+  for (int i = 0; i < animation_file_count; i++) {
+    total_animation_count += animations[i].animation_count;
+  }
+  // Bounds for the arrays below, which can't be empty
+  size_t animation_slots = total_animation_count > 0 ? total_animation_count : 1;
+  // Where each object's frames start in its animation's buffers, and how
+  // many there are
+  size_t key_firsts[animation_slots][object_count];
+  size_t key_counts[animation_slots][object_count];
+  // The same for each track of each object, which differ with -t
+  size_t track_firsts[animation_slots][object_count][TRACK_COUNT];
+  size_t track_counts[animation_slots][object_count][TRACK_COUNT];
+  // With -t, the largest change made to a key of each track, and what
+  // packing added to rotations
+  double track_errors[TRACK_COUNT] = { 0 };
+  double packing_error = 0;
+
+  // Each mesh is split into an opaque and a semi-transparent primitive, either
+  // of which may be empty
+  size_t mesh_count = skinned ? 1 : object_count;
+  size_t mesh_index_start[lod_levels][mesh_count];
+  size_t mesh_semi_triangles[lod_levels][mesh_count];
+  size_t mesh_opaque_triangles[lod_levels][mesh_count];
+  for (int level = 0; level < lod_levels; level++) {
+    for (int m = 0; m < mesh_count; m++) {
+      mesh_index_start[level][m] = skinned ? level_start[level] : index_start[level][m];
+      mesh_semi_triangles[level][m] = 0;
+      mesh_opaque_triangles[level][m] = 0;
+    }
+    for (int i = 0; i < object_count; i++) {
+      object_lod_t lod = object_lod(&objects[i], level);
+      int m = skinned ? 0 : i;
+      mesh_semi_triangles[level][m] += lod.semi_transparent_triangle_count;
+      mesh_opaque_triangles[level][m] +=
+        lod.triangle_count - lod.semi_transparent_triangle_count;
+    }
+  }
+
+  // Opaque primitives only get alpha testing if one of their triangles'
+  // texel rectangles has transparent texels
+  int mesh_has_cutout[mesh_count];
+  size_t mesh_page[mesh_count];
+  memset(mesh_has_cutout, 0, sizeof(mesh_has_cutout));
   for (int i = 0; i < object_count; i++) {
-    accessors[i] = (cgltf_accessor) {
+    mesh_has_cutout[skinned ? 0 : i] |= objects[i].has_cutout;
+    mesh_page[skinned ? 0 : i] = objects[i].page;
+  }
+
+  size_t image_count = atlas_page_count;
+  size_t texture_count = atlas_page_count;
+  if (palette_swap) {
+    image_count++;
+    texture_count++;
+  }
+  size_t max_buffers = 4 * total_animation_count + 13 + image_count;
+  cgltf_buffer buffers[max_buffers];
+  cgltf_buffer_view buffer_views[max_buffers];
+  size_t buffer_count = 0;
+
+  cgltf_buffer_view* vertex_view = add_buffer(
+    buffers, buffer_views, &buffer_count,
+    "vertex_buffer", "vertex_buffer_view",
+    all_vertices, position_size * total_vertices, position_size,
+    cgltf_buffer_view_type_vertices);
+  free(all_vertices);
+  // 3 indices of 16 or 32-bit size, little-endian, "0 1 2"
+  cgltf_buffer_view* index_view = add_buffer(
+    buffers, buffer_views, &buffer_count,
+    "vertex_index_buffer", "vertex_index_buffer_view",
+    all_triangles, index_size * 3 * total_triangles, 0,
+    cgltf_buffer_view_type_indices);
+  free(all_triangles);
+  cgltf_buffer_view* texcoord_view = add_buffer(
+    buffers, buffer_views, &buffer_count,
+    "texcoord", "texcoord_view",
+    all_texcoords, texcoord_size * total_vertices, texcoord_size,
+    cgltf_buffer_view_type_vertices);
+  free(all_texcoords);
+  cgltf_buffer_view* palette_row_view = NULL;
+  if (palette_swap) {
+    palette_row_view = add_buffer(
+      buffers, buffer_views, &buffer_count,
+      "palette_row", "palette_row_view",
+      all_palette_rows, texcoord_size * total_vertices, texcoord_size,
+      cgltf_buffer_view_type_vertices);
+    free(all_palette_rows);
+  }
+  cgltf_buffer_view* normal_view = add_buffer(
+    buffers, buffer_views, &buffer_count,
+    "normal", "normal_view",
+    all_normals, normal_size * total_vertices, normal_size,
+    cgltf_buffer_view_type_vertices);
+  free(all_normals);
+
+  // Every vertex is rigidly bound to the object it came from
+  cgltf_buffer_view* joint_view = NULL;
+  cgltf_buffer_view* weight_view = NULL;
+  cgltf_buffer_view* inverse_bind_view = NULL;
+  size_t joint_size = object_count <= 256 ? 4 * sizeof(uint8_t) : 4 * sizeof(uint16_t);
+  if (skinned) {
+    uint8_t* joints = calloc(total_vertices, joint_size);
+    uint8_t* weights = calloc(total_vertices, 4);
+    for (int i = 0; i < object_count; i++) {
+      for (size_t j = vertex_base[i]; j < vertex_base[i] + objects[i].vertex_count; j++) {
+        if (joint_size == 4 * sizeof(uint8_t)) {
+          joints[joint_size * j] = i;
+        } else {
+          uint16_t joint = i;
+          memcpy(&joints[joint_size * j], &joint, sizeof(uint16_t));
+        }
+        weights[4 * j] = 0xff;
+      }
+    }
+    joint_view = add_buffer(
+      buffers, buffer_views, &buffer_count,
+      "joint_buffer", "joint_buffer_view",
+      joints, joint_size * total_vertices, joint_size,
+      cgltf_buffer_view_type_vertices);
+    weight_view = add_buffer(
+      buffers, buffer_views, &buffer_count,
+      "weight_buffer", "weight_buffer_view",
+      weights, 4 * total_vertices, 4,
+      cgltf_buffer_view_type_vertices);
+    free(joints);
+    free(weights);
+
+    // Object nodes have no rest transform beyond their translation, so the
+    // bind matrix of a joint is the sum of its ancestors' translations (all
+    // zero at the moment). Quantized positions are dequantized here too,
+    // since the skinned mesh node's own transform is ignored.
+    float inverse_bind[16 * object_count];
+    memset(inverse_bind, 0, sizeof(inverse_bind));
+    for (int i = 0; i < object_count; i++) {
+      float* m = &inverse_bind[16 * i];
+      m[0] = quantize ? -1.0 / 4096.0 : 1.0;
+      m[5] = quantize ? -1.0 / 4096.0 : 1.0;
+      m[10] = quantize ? 1.0 / 4096.0 : 1.0;
+      m[15] = 1.0;
+    }
+    inverse_bind_view = add_buffer(
+      buffers, buffer_views, &buffer_count,
+      "inverse_bind_buffer", "inverse_bind_buffer_view",
+      inverse_bind, sizeof(inverse_bind), 0,
+      cgltf_buffer_view_type_invalid);
+  }
+
+  // Meshlets of every primitive are concatenated, and each primitive's extras
+  // say which range belongs to it. Offsets inside meshlet records are absolute
+  // and vertex indices are relative to the primitive's vertex attributes.
+  size_t mesh_meshlet_start[mesh_count];
+  size_t mesh_meshlet_count[mesh_count];
+  size_t mesh_semi_meshlet_count[mesh_count];
+  cgltf_buffer_view* meshlet_views[4] = {NULL, NULL, NULL, NULL};
+  if (export_options.meshlets) {
+    size_t total_meshlets = 0;
+    size_t total_meshlet_vertices = 0;
+    size_t total_meshlet_triangles = 0;
+    for (int i = 0; i < object_count; i++) {
+      total_meshlets += objects[i].meshlets.meshlet_count;
+      total_meshlet_vertices += objects[i].meshlets.vertex_count;
+      total_meshlet_triangles += objects[i].meshlets.triangle_count;
+    }
+    meshlet_t* all_meshlets = malloc(total_meshlets * sizeof(meshlet_t));
+    meshlet_bounds_t* all_bounds = malloc(total_meshlets * sizeof(meshlet_bounds_t));
+    uint32_t* all_meshlet_vertices = malloc(total_meshlet_vertices * sizeof(uint32_t));
+    uint8_t* all_meshlet_triangles = malloc(3 * total_meshlet_triangles);
+    size_t meshlet_cursor = 0;
+    size_t vertex_cursor = 0;
+    size_t triangle_cursor = 0;
+    for (int m = 0; m < mesh_count; m++) {
+      mesh_meshlet_start[m] = meshlet_cursor;
+      mesh_semi_meshlet_count[m] = 0;
+      // Like the index buffer, a skinned export puts every object's
+      // semi-transparent meshlets first
+      for (int pass = 0; pass < 2; pass++) {
+        for (int i = 0; i < object_count; i++) {
+          if (!skinned && i != m) {
+            continue;
+          }
+          meshlet_set_t* set = &objects[i].meshlets;
+          size_t semi = objects[i].semi_transparent_meshlet_count;
+          size_t start = pass == 0 ? 0 : semi;
+          size_t end = pass == 0 ? semi : set->meshlet_count;
+          uint32_t base = skinned ? vertex_base[i] : 0;
+          for (size_t k = start; k < end; k++) {
+            meshlet_t meshlet = set->meshlets[k];
+            for (size_t v = 0; v < meshlet.vertex_count; v++) {
+              all_meshlet_vertices[vertex_cursor + v] =
+                set->vertices[meshlet.vertex_offset + v] + base;
+            }
+            memcpy(&all_meshlet_triangles[3 * triangle_cursor],
+              &set->triangles[3 * meshlet.triangle_offset],
+              3 * meshlet.triangle_count);
+            meshlet.vertex_offset = vertex_cursor;
+            meshlet.triangle_offset = triangle_cursor;
+            vertex_cursor += meshlet.vertex_count;
+            triangle_cursor += meshlet.triangle_count;
+            all_bounds[meshlet_cursor] = set->bounds[k];
+            all_meshlets[meshlet_cursor++] = meshlet;
+          }
+          if (pass == 0) {
+            mesh_semi_meshlet_count[m] += end - start;
+          }
+        }
+      }
+      mesh_meshlet_count[m] = meshlet_cursor - mesh_meshlet_start[m];
+    }
+    meshlet_views[0] = add_buffer(
+      buffers, buffer_views, &buffer_count,
+      "meshlet_buffer", "meshlet_buffer_view",
+      all_meshlets, total_meshlets * sizeof(meshlet_t), 0,
+      cgltf_buffer_view_type_invalid);
+    meshlet_views[1] = add_buffer(
+      buffers, buffer_views, &buffer_count,
+      "meshlet_vertex_buffer", "meshlet_vertex_buffer_view",
+      all_meshlet_vertices, total_meshlet_vertices * sizeof(uint32_t), 0,
+      cgltf_buffer_view_type_invalid);
+    meshlet_views[2] = add_buffer(
+      buffers, buffer_views, &buffer_count,
+      "meshlet_triangle_buffer", "meshlet_triangle_buffer_view",
+      all_meshlet_triangles, 3 * total_meshlet_triangles, 0,
+      cgltf_buffer_view_type_invalid);
+    meshlet_views[3] = add_buffer(
+      buffers, buffer_views, &buffer_count,
+      "meshlet_bounds_buffer", "meshlet_bounds_buffer_view",
+      all_bounds, total_meshlets * sizeof(meshlet_bounds_t), 0,
+      cgltf_buffer_view_type_invalid);
+    free(all_meshlets);
+    free(all_bounds);
+    free(all_meshlet_vertices);
+    free(all_meshlet_triangles);
+  }
+
+  // Create a buffer for each animation
+  // The input view of each animation, then one per track, NULL for a track
+  // that -t left without keys
+  cgltf_buffer_view* animation_views[animation_slots][1 + TRACK_COUNT];
+  int fitted = export_options.fit_position_error > 0;
+  int object_inputs = export_options.keyframes_only || fitted;
+  size_t frames_total = 0;
+  size_t keys_total = 0;
+  size_t animation_counter = 0;
+  for (size_t animation_file = 0; animation_file < animation_file_count; animation_file++) {
+    animation_t* animation = &animations[animation_file];
+    for (size_t anim = 0; anim < animation->animation_count; anim++) {
+      size_t frame_count = animation->frame_counts[anim];
+      uint16_t frames[object_count * frame_count];
+      size_t key_total;
+      if (fitted) {
+        key_total = animation_fitted_frames(
+          animation, anim, object_count, node_tree, frames, key_counts[animation_counter]);
+      } else {
+        key_total = animation_key_frames(
+          animation, anim, object_count, frames, key_counts[animation_counter]);
+      }
+      frames_total += object_count * frame_count;
+      keys_total += key_total;
+      for (int i = 0; i < object_count; i++) {
+        key_firsts[animation_counter][i] =
+          i > 0 ? key_firsts[animation_counter][i - 1] + key_counts[animation_counter][i - 1] : 0;
+      }
+      // Every object shares one input of all frames, unless only keyframes
+      // are written and each object has its own
+      size_t input_count = object_inputs ? key_total : frame_count;
+      float animation_input[input_count];
+      for (int i = 0; i < input_count; i++) {
+        size_t frame = object_inputs ? frames[i] : i;
+        animation_input[i] = (float) (frame * 0.0333333); // 30 FPS
+      }
+      animation_views[animation_counter][0] = add_buffer(
+        buffers, buffer_views, &buffer_count,
+        "animation_input", "animation_input",
+        animation_input, input_count * sizeof(float), 0,
+        cgltf_buffer_view_type_invalid);
+
+      float* tracks[TRACK_COUNT];
+      serialize_animation(
+        animation, anim, object_count, frames, key_counts[animation_counter],
+        &tracks[TRACK_ROTATION], &tracks[TRACK_TRANSLATION], &tracks[TRACK_SCALE]);
+      if (fitted) {
+        align_rotation_signs(tracks[TRACK_ROTATION], key_counts[animation_counter], object_count);
+      }
+      size_t track_totals[TRACK_COUNT] = { key_total, key_total, key_total };
+      if (export_options.compress_tracks) {
+        compress_tracks(
+          object_count, key_counts[animation_counter], tracks,
+          track_firsts[animation_counter], track_counts[animation_counter],
+          track_totals, track_errors);
+      } else {
+        for (int i = 0; i < object_count; i++) {
+          for (int track = 0; track < TRACK_COUNT; track++) {
+            track_firsts[animation_counter][i][track] = key_firsts[animation_counter][i];
+            track_counts[animation_counter][i][track] = key_counts[animation_counter][i];
+          }
+        }
+      }
+      for (int track = 0; track < TRACK_COUNT; track++) {
+        size_t size = track_totals[track] * track_widths[track] * sizeof(float);
+        void* bytes = tracks[track];
+        if (export_options.compress_tracks && track == TRACK_ROTATION) {
+          size = track_totals[track] * 4 * sizeof(int16_t);
+          bytes = malloc(size);
+          double error = pack_rotations(bytes, tracks[track], track_totals[track]);
+          packing_error = fmax(packing_error, error);
+          free(tracks[track]);
+        }
+        animation_views[animation_counter][1 + track] = NULL;
+        if (size > 0) {
+          animation_views[animation_counter][1 + track] = add_buffer(
+            buffers, buffer_views, &buffer_count,
+            track_buffer_names[track], track_view_names[track],
+            bytes, size, 0,
+            cgltf_buffer_view_type_invalid);
+        }
+        free(bytes);
+      }
+      animation_counter++;
+    }
+  }
+  if (fitted) {
+    fprintf(stderr, "fitted %zu LINEAR keys to %zu frames, %.1f%% of them\n",
+      keys_total, frames_total, frames_total ? 100.0 * keys_total / frames_total : 0);
+  }
+  if (export_options.compress_tracks) {
+    fprintf(stderr, "compressed animation tracks, rotations within %.4f degrees, scales within %.6f\n",
+      (track_errors[TRACK_ROTATION] + packing_error) * 180 / M_PI,
+      track_errors[TRACK_SCALE]);
+  }
+
+  // PNGs of every page, then their KTX2 versions, then the CLUT strip. Pages
+  // in the store are images with a URI instead.
+  cgltf_buffer_view* texture_view_buffers[image_count];
+  memset(texture_view_buffers, 0, sizeof(texture_view_buffers));
+  for (size_t page = 0; page < atlas_page_count; page++) {
+    if (!atlas_pages[page].png_uri) {
+      texture_view_buffers[page] = add_buffer(
+        buffers, buffer_views, &buffer_count,
+        "texture_buffer", "texture_view",
+        atlas_pages[page].png, atlas_pages[page].png_size, 0,
+        cgltf_buffer_view_type_invalid);
+    }
+  }
+  if (palette_swap) {
+    texture_view_buffers[image_count - 1] = add_buffer(
+      buffers, buffer_views, &buffer_count,
+      "clut_buffer", "clut_view",
+      clut_strip.png, clut_strip.png_size, 0,
+      cgltf_buffer_view_type_invalid);
+  }
+
+  size_t max_accessors = (4 + 2 * lod_levels) * mesh_count + 3 + (4 * object_count + 1) * total_animation_count;
+  cgltf_accessor accessors[max_accessors];
+  size_t accessor_count = 0;
+  cgltf_accessor* position_accessors[mesh_count];
+  // Semi-transparent then opaque for each mesh of each level, NULL if empty
+  cgltf_accessor* index_accessors[2 * lod_levels * mesh_count];
+  cgltf_accessor* texcoord_accessors[mesh_count];
+  cgltf_accessor* palette_row_accessors[mesh_count];
+  cgltf_accessor* normal_accessors[mesh_count];
+  for (int i = 0; i < mesh_count; i++) {
+    size_t bounds = skinned ? object_count : i;
+    position_accessors[i] = &accessors[accessor_count++];
+    *position_accessors[i] = (cgltf_accessor) {
       .name = "vertex",
-      .component_type = cgltf_component_type_r_32f,
+      .component_type = quantize ?
+        cgltf_component_type_r_16 : cgltf_component_type_r_32f,
       .type = cgltf_type_vec3,
-      .offset = object_vertex_offset,
-      .count = vertex_count[i],
-      .stride = 12, // 3 * 32 bit
-      .buffer_view = &buffer_views[0],
+      .offset = skinned ? 0 : position_size * vertex_base[i],
+      .count = skinned ? total_vertices : objects[i].vertex_count,
+      .stride = position_size,
+      .buffer_view = vertex_view,
       .has_min = 1,
       .has_max = 1,
     };
-    object_vertex_offset += 12 * vertex_count[i];
-
-    float min_x = +999999;
-    float min_y = +999999;
-    float min_z = +999999;
-    float max_x = -999999;
-    float max_y = -999999;
-    float max_z = -999999;
-    for (int j = 0; j < vertex_count[i]; j++) {
-      float vx = vertices[i][3 * j + 0];
-      float vy = vertices[i][3 * j + 1];
-      float vz = vertices[i][3 * j + 2];
-      if (vx < min_x) min_x = vx;
-      if (vy < min_y) min_y = vy;
-      if (vz < min_z) min_z = vz;
-      if (vx > max_x) max_x = vx;
-      if (vy > max_y) max_y = vy;
-      if (vz > max_z) max_z = vz;
-    }
-    accessors[i].min[0] = min_x;
-    accessors[i].min[1] = min_y;
-    accessors[i].min[2] = min_z;
-    accessors[i].max[0] = max_x;
-    accessors[i].max[1] = max_y;
-    accessors[i].max[2] = max_z;
-  }
-
-  size_t accessor_offset = 0;
-  for (int i = 0; i < object_count; i++) {
-    accessors[i + object_count] = (cgltf_accessor) {
-      .name = "vertex_index",
-      .component_type = cgltf_component_type_r_32u,
-      .normalized = 0, // ???
-      .type = cgltf_type_scalar,
-      .offset = accessor_offset,
-      .count = 3 * triangle_count[i],
-      .stride = 4, // 32 bit
-      .buffer_view = &buffer_views[1],
-      .has_min = 0,
-      .has_max = 0,
-      .is_sparse = 0
+    for (int k = 0; k < 3; k++) {
+      position_accessors[i]->min[k] = bounds_min[bounds][k];
+      position_accessors[i]->max[k] = bounds_max[bounds][k];
+    }
+
+    for (int level = 0; level < lod_levels; level++) {
+      size_t counts[2] = {
+        mesh_semi_triangles[level][i],
+        mesh_opaque_triangles[level][i]
+      };
+      size_t offset = mesh_index_start[level][i];
+      for (int group = 0; group < 2; group++) {
+        cgltf_accessor** index_accessor = &index_accessors[2 * (level * mesh_count + i) + group];
+        *index_accessor = NULL;
+        if (counts[group] > 0) {
+          *index_accessor = &accessors[accessor_count++];
+          **index_accessor = (cgltf_accessor) {
+            .name = "vertex_index",
+            .component_type = index_size == sizeof(uint16_t) ?
+              cgltf_component_type_r_16u : cgltf_component_type_r_32u,
+            .normalized = 0, // ???
+            .type = cgltf_type_scalar,
+            .offset = index_size * offset,
+            .count = 3 * counts[group],
+            .stride = index_size,
+            .buffer_view = index_view,
+            .has_min = 0,
+            .has_max = 0,
+            .is_sparse = 0
+          };
+        }
+        offset += 3 * counts[group];
+      }
+    }
+
+    texcoord_accessors[i] = &accessors[accessor_count++];
+    *texcoord_accessors[i] = (cgltf_accessor) {
+      .name = "texcoord",
+      .component_type = quantize ?
+        cgltf_component_type_r_16u : cgltf_component_type_r_32f,
+      .normalized = quantize,
+      .type = cgltf_type_vec2,
+      .offset = skinned ? 0 : texcoord_size * vertex_base[i],
+      .count = skinned ? total_vertices : objects[i].vertex_count,
+      .stride = texcoord_size,
+      .buffer_view = texcoord_view
+    };
+
+    if (palette_swap) {
+      palette_row_accessors[i] = &accessors[accessor_count++];
+      *palette_row_accessors[i] = *texcoord_accessors[i];
+      palette_row_accessors[i]->name = "palette_row";
+      palette_row_accessors[i]->buffer_view = palette_row_view;
+    }
+
+    normal_accessors[i] = &accessors[accessor_count++];
+    *normal_accessors[i] = (cgltf_accessor) {
+      .name = "normal",
+      .component_type = octahedral || quantize ?
+        cgltf_component_type_r_16 : cgltf_component_type_r_32f,
+      .normalized = octahedral || quantize,
+      .type = octahedral ? cgltf_type_vec2 : cgltf_type_vec3,
+      .offset = skinned ? 0 : normal_size * vertex_base[i],
+      .count = skinned ? total_vertices : objects[i].vertex_count,
+      .stride = normal_size,
+      .buffer_view = normal_view
     };
-    accessor_offset += 4 * 3 * triangle_count[i];
   }
 
+  cgltf_accessor* joint_accessor = NULL;
+  cgltf_accessor* weight_accessor = NULL;
+  cgltf_accessor* inverse_bind_accessor = NULL;
+  if (skinned) {
+    joint_accessor = &accessors[accessor_count++];
+    *joint_accessor = (cgltf_accessor) {
+      .name = "joint",
+      .component_type = joint_size == 4 * sizeof(uint8_t) ?
+        cgltf_component_type_r_8u : cgltf_component_type_r_16u,
+      .type = cgltf_type_vec4,
+      .count = total_vertices,
+      .stride = joint_size,
+      .buffer_view = joint_view
+    };
+    weight_accessor = &accessors[accessor_count++];
+    *weight_accessor = (cgltf_accessor) {
+      .name = "weight",
+      .component_type = cgltf_component_type_r_8u,
+      .normalized = 1,
+      .type = cgltf_type_vec4,
+      .count = total_vertices,
+      .stride = 4,
+      .buffer_view = weight_view
+    };
+    inverse_bind_accessor = &accessors[accessor_count++];
+    *inverse_bind_accessor = (cgltf_accessor) {
+      .name = "inverse_bind_matrix",
+      .component_type = cgltf_component_type_r_32f,
+      .type = cgltf_type_mat4,
+      .count = object_count,
+      .stride = 64,
+      .buffer_view = inverse_bind_view
+    };
+  }
+
+  // Per object per animation, an input and an output for each track with
+  // keys. With -t, each animation also starts with a single key input, for
+  // constant tracks, and objects whose tracks are all constant get no input
+  // of their own.
+  cgltf_accessor* single_key_inputs[animation_slots];
+  cgltf_accessor* input_accessors[animation_slots][object_count];
+  cgltf_accessor* track_accessors[animation_slots][object_count][TRACK_COUNT];
   animation_counter = 0;
-  // Create a buffer for each animation
   for (size_t animation_file = 0; animation_file < animation_file_count; animation_file++) {
     animation_t* animation = &animations[animation_file];
     for (int anim = 0; anim < animation->animation_count; anim++) {
       size_t frame_count = animation->frame_counts[anim];
-      for (int i = 0; i < object_count; i++) {
-        accessors[2 * object_count + animation_counter * object_count * 4 + 4 * i] = (cgltf_accessor) {
+      cgltf_buffer_view** views = animation_views[animation_counter];
+      single_key_inputs[animation_counter] = NULL;
+      if (export_options.compress_tracks) {
+        // The first input of every animation is its first frame
+        cgltf_accessor* single = &accessors[accessor_count++];
+        *single = (cgltf_accessor) {
           .name = "animation_input",
           .component_type = cgltf_component_type_r_32f,
           .normalized = 0,
           .type = cgltf_type_scalar,
           .offset = 0,
-          .count = frame_count,
+          .count = 1,
           .stride = 4,
-          .buffer_view = &buffer_views[animation_counter * 4 + 2],
+          .buffer_view = views[0],
           .has_min = 1,
           .has_max = 1
         };
-        accessors[2 * object_count + animation_counter * object_count * 4 + 4 * i].min[0] = 0;
-        accessors[2 * object_count + animation_counter * object_count * 4 + 4 * i].max[0] =
-          (frame_count - 1) * 0.0333333;
-
-        accessors[2 * object_count + animation_counter * object_count * 4 + 4 * i + 1] = (cgltf_accessor) {
-          .name = "animation_rotation_output",
-          .component_type = cgltf_component_type_r_32f,
-          .normalized = 0,
-          .type = cgltf_type_vec4,
-          .offset = frame_count * 16 * i,
-          .count = frame_count,
-          .stride = 16,
-          .buffer_view = &buffer_views[animation_counter * 4 + 3]
-        };
-
-        accessors[2 * object_count + animation_counter * object_count * 4 + 4 * i + 2] = (cgltf_accessor) {
-          .name = "animation_translation_output",
-          .component_type = cgltf_component_type_r_32f,
-          .normalized = 0,
-          .type = cgltf_type_vec3,
-          .offset = frame_count * 12 * i,
-          .count = frame_count,
-          .stride = 12,
-          .buffer_view = &buffer_views[animation_counter * 4 + 4]
-        };
+        single_key_inputs[animation_counter] = single;
+      }
+      for (int i = 0; i < object_count; i++) {
+        size_t first = key_firsts[animation_counter][i];
+        size_t count = key_counts[animation_counter][i];
+        size_t* track_count = track_counts[animation_counter][i];
+        input_accessors[animation_counter][i] = NULL;
+        if (track_count[TRACK_ROTATION] > 1 || track_count[TRACK_TRANSLATION] > 1 ||
+            track_count[TRACK_SCALE] > 1 || !export_options.compress_tracks) {
+          cgltf_accessor* input = &accessors[accessor_count++];
+          *input = (cgltf_accessor) {
+            .name = "animation_input",
+            .component_type = cgltf_component_type_r_32f,
+            .normalized = 0,
+            .type = cgltf_type_scalar,
+            .offset = object_inputs ? first * 4 : 0,
+            .count = count,
+            .stride = 4,
+            .buffer_view = views[0],
+            .has_min = 1,
+            .has_max = 1
+          };
+          input->min[0] = 0;
+          input->max[0] = (frame_count - 1) * 0.0333333;
+          input_accessors[animation_counter][i] = input;
+        }
 
-        accessors[2 * object_count + animation_counter * object_count * 4 + 4 * i + 3] = (cgltf_accessor) {
-          .name = "animation_scale_output",
-          .component_type = cgltf_component_type_r_32f,
-          .normalized = 0,
-          .type = cgltf_type_vec3,
-          .offset = frame_count * 12 * i,
-          .count = frame_count,
-          .stride = 12,
-          .buffer_view = &buffer_views[animation_counter * 4 + 5]
-        };
+        for (int track = 0; track < TRACK_COUNT; track++) {
+          track_accessors[animation_counter][i][track] = NULL;
+          if (track_count[track] == 0) {
+            continue;
+          }
+          int packed = export_options.compress_tracks && track == TRACK_ROTATION;
+          size_t stride = packed ? 4 * sizeof(int16_t) : track_widths[track] * sizeof(float);
+          cgltf_accessor* output = &accessors[accessor_count++];
+          *output = (cgltf_accessor) {
+            .name = track_buffer_names[track],
+            .component_type = packed ? cgltf_component_type_r_16 : cgltf_component_type_r_32f,
+            .normalized = packed,
+            .type = track == TRACK_ROTATION ? cgltf_type_vec4 : cgltf_type_vec3,
+            .offset = track_firsts[animation_counter][i][track] * stride,
+            .count = track_count[track],
+            .stride = stride,
+            .buffer_view = views[1 + track]
+          };
+          track_accessors[animation_counter][i][track] = output;
+        }
       }
       animation_counter++;
     }
   }
 
-  size_t texcoord_offset = 0;
-  for (int i = 0; i < object_count; i++) {
-    accessors[2 * object_count + total_animation_count * object_count * 4 + i] = (cgltf_accessor) {
-      .name = "texcoord",
-      .component_type = cgltf_component_type_r_32f,
-      .normalized = 0,
-      .type = cgltf_type_vec2,
-      .offset = texcoord_offset,
-      .count = texcoord_count[i],
-      .stride = 8,
-      .buffer_view = &buffer_views[2 + 4 * total_animation_count]
-    };
-    texcoord_offset += 4 * 2 * texcoord_count[i];
-  }
-
-  cgltf_image images[1];
-  images[0] = (cgltf_image) {
-    .name = "texture_image",
-    .buffer_view = &buffer_views[3 + 4 * total_animation_count],
-    .mime_type = "image/png"
-  };
-
   cgltf_sampler texture_samplers[1];
   texture_samplers[0] = (cgltf_sampler) {
     .name = "texture_sampler",
@@ -1157,102 +2070,273 @@ void make_epic_gltf_file(char* working_dir, float** vertices, size_t* vertex_cou
     .wrap_t = 33071 // CLAMP_TO_EDGE
   };
 
-  cgltf_texture textures[1];
-  textures[0] = (cgltf_texture) {
-    .name = "texture",
-    .image = &images[0],
-    .sampler = &texture_samplers[0]
-  };
+  // Each atlas page gets an image, a texture and three materials: opaque
+  // faces, opaque faces with transparent texels, semi-transparent faces
+  cgltf_image images[image_count];
+  cgltf_texture textures[texture_count];
+  cgltf_material materials[3 * atlas_page_count];
+  for (size_t page = 0; page < atlas_page_count; page++) {
+    images[page] = (cgltf_image) {
+      .name = "texture_image",
+      .uri = atlas_pages[page].png_uri,
+      .buffer_view = texture_view_buffers[page],
+      .mime_type = "image/png"
+    };
 
-  cgltf_texture_view texture_view = {
-    .texture = &textures[0]
-  };
+    textures[page] = (cgltf_texture) {
+      .name = "texture",
+      .image = &images[page],
+      .sampler = &texture_samplers[0]
+    };
 
-  cgltf_pbr_metallic_roughness metallic_roughness = {
-    .base_color_texture = texture_view,
-    .metallic_factor = 0,
-    .roughness_factor = 1
-  };
-  metallic_roughness.base_color_factor[0] = 1.0;
-  metallic_roughness.base_color_factor[1] = 1.0;
-  metallic_roughness.base_color_factor[2] = 1.0;
-  metallic_roughness.base_color_factor[3] = 1.0;
-
-  cgltf_material materials[1];
-  materials[0] = (cgltf_material) {
-    .name = "material",
-    .has_pbr_metallic_roughness = 1,
-    .pbr_metallic_roughness = metallic_roughness,
-    .double_sided = 0,
-    .alpha_mode = cgltf_alpha_mode_mask,
-    .alpha_cutoff = 0.1
-  };
+    cgltf_texture_view texture_view = {
+      .texture = &textures[page]
+    };
 
-  cgltf_attribute attributes[2 * object_count];
-  for (int i = 0; i < object_count; i++) {
-    attributes[2 * i] = (cgltf_attribute) {
+    cgltf_pbr_metallic_roughness metallic_roughness = {
+      .base_color_texture = texture_view,
+      .metallic_factor = 0,
+      .roughness_factor = 1
+    };
+    metallic_roughness.base_color_factor[0] = 1.0;
+    metallic_roughness.base_color_factor[1] = 1.0;
+    metallic_roughness.base_color_factor[2] = 1.0;
+    metallic_roughness.base_color_factor[3] = 1.0;
+
+    materials[3 * page + 0] = (cgltf_material) {
+      .name = "opaque",
+      .has_pbr_metallic_roughness = 1,
+      .pbr_metallic_roughness = metallic_roughness,
+      .double_sided = 0,
+      .alpha_mode = cgltf_alpha_mode_opaque
+    };
+    materials[3 * page + 1] = (cgltf_material) {
+      .name = "cutout",
+      .has_pbr_metallic_roughness = 1,
+      .pbr_metallic_roughness = metallic_roughness,
+      .double_sided = 0,
+      .alpha_mode = cgltf_alpha_mode_mask,
+      .alpha_cutoff = 0.1
+    };
+    materials[3 * page + 2] = (cgltf_material) {
+      .name = "semi_transparent",
+      .has_pbr_metallic_roughness = 1,
+      .pbr_metallic_roughness = metallic_roughness,
+      .double_sided = 0,
+      .alpha_mode = cgltf_alpha_mode_blend
+    };
+  }
+
+  // The CLUT strip is sampled like the atlas, through the last image and
+  // texture
+  if (palette_swap) {
+    images[image_count - 1] = (cgltf_image) {
+      .name = "clut_image",
+      .buffer_view = texture_view_buffers[image_count - 1],
+      .mime_type = "image/png"
+    };
+    textures[texture_count - 1] = (cgltf_texture) {
+      .name = "clut",
+      .image = &images[image_count - 1],
+      .sampler = &texture_samplers[0]
+    };
+  }
+
+  size_t attributes_per_mesh = (skinned ? 5 : 3) + palette_swap;
+  cgltf_attribute attributes[attributes_per_mesh * mesh_count];
+  for (int i = 0; i < mesh_count; i++) {
+    cgltf_attribute* mesh_attributes = &attributes[attributes_per_mesh * i];
+    mesh_attributes[0] = (cgltf_attribute) {
       .name = "POSITION",
       .type = cgltf_attribute_type_position,
       .index = 0,
-      .data = &accessors[i]
+      .data = position_accessors[i]
     };
-    attributes[2 * i + 1] = (cgltf_attribute) {
+    mesh_attributes[1] = (cgltf_attribute) {
       .name = "TEXCOORD_0",
       .type = cgltf_attribute_type_texcoord,
       .index = 0,
-      .data = &accessors[2 * object_count + 4 * total_animation_count * object_count + i]
+      .data = texcoord_accessors[i]
+    };
+    mesh_attributes[2] = (cgltf_attribute) {
+      .name = octahedral ? "_NORMAL_OCT" : "NORMAL",
+      .type = octahedral ? cgltf_attribute_type_invalid : cgltf_attribute_type_normal,
+      .index = 0,
+      .data = normal_accessors[i]
     };
+    if (skinned) {
+      mesh_attributes[3] = (cgltf_attribute) {
+        .name = "JOINTS_0",
+        .type = cgltf_attribute_type_joints,
+        .index = 0,
+        .data = joint_accessor
+      };
+      mesh_attributes[4] = (cgltf_attribute) {
+        .name = "WEIGHTS_0",
+        .type = cgltf_attribute_type_weights,
+        .index = 0,
+        .data = weight_accessor
+      };
+    }
+    if (palette_swap) {
+      mesh_attributes[attributes_per_mesh - 1] = (cgltf_attribute) {
+        .name = "TEXCOORD_1",
+        .type = cgltf_attribute_type_texcoord,
+        .index = 1,
+        .data = palette_row_accessors[i]
+      };
+    }
   }
 
-  cgltf_primitive prims[object_count];
-  for (int i = 0; i < object_count; i++) {
-    prims[i] = (cgltf_primitive) {
-      .type = cgltf_primitive_type_triangles,
-      .indices = &accessors[i+object_count],
-      .attributes = &attributes[2 * i],
-      .attributes_count = 2,
-      .material = &materials[0]
-    };
+  // Extras of every object are written into this one buffer, which is handed
+  // to cgltf as the file data that the extras offsets point into
+  char extras_buf[256*256];
+  int total_wrote = 0;
+  int wrote;
+
+  // With -c, every material says where its CLUT rows are
+  if (palette_swap) {
+    wrote = snprintf(
+      extras_buf + total_wrote,
+      sizeof(extras_buf) - total_wrote,
+      "{ \"palette_swap\": { \"clut\": %zu, \"texcoord\": 1, \"rows\": %zu } }",
+      texture_count - 1,
+      clut_strip.height);
+    if (wrote <= 0 || wrote >= sizeof(extras_buf) - total_wrote) {
+      die("snprintf error");
+    }
+    for (size_t k = 0; k < 3 * atlas_page_count; k++) {
+      materials[k].extras = (cgltf_extras) {
+        .start_offset = total_wrote,
+        .end_offset = total_wrote + wrote
+      };
+    }
+    total_wrote += wrote;
   }
 
-  cgltf_mesh meshes[object_count];
-  for (int i = 0; i < object_count; i++) {
-    meshes[i] = (cgltf_mesh) {
-      .primitives = (cgltf_primitive*) { &prims[i] },
-      .primitives_count = 1
+  // With -k, every texture names its KTX2 file. They're not referenced
+  // through KHR_texture_basisu, which requires Basis Universal payloads
+  // rather than plain BCn.
+  for (size_t page = 0; page < atlas_page_count && export_options.ktx2; page++) {
+    wrote = snprintf(
+      extras_buf + total_wrote,
+      sizeof(extras_buf) - total_wrote,
+      "{ \"ktx2\": \"%s\" }",
+      atlas_pages[page].ktx2_uri);
+    if (wrote <= 0 || wrote >= sizeof(extras_buf) - total_wrote) {
+      die("snprintf error");
+    }
+    textures[page].extras = (cgltf_extras) {
+      .start_offset = total_wrote,
+      .end_offset = total_wrote + wrote
     };
+    total_wrote += wrote;
   }
 
-  cgltf_animation_sampler samplers[total_animation_count * object_count * 3];
-
-  animation_counter = 0;
-  for (size_t animation_file = 0; animation_file < animation_file_count; animation_file++) {
-    animation_t* animation = &animations[animation_file];
-    for (int anim = 0; anim < animation->animation_count; anim++) {
-      for (int i = 0; i < object_count; i++) {
-        samplers[animation_counter * object_count * 3 + i * 3] = (cgltf_animation_sampler) {
-          .input = &accessors[2 * object_count + animation_counter * object_count * 4 + 4 * i],
-          .output = &accessors[2 * object_count + animation_counter * object_count * 4 + 4 * i + 1],
-          .interpolation = cgltf_interpolation_type_step
-        };
-
-        samplers[animation_counter * object_count * 3 + i * 3 + 1] = (cgltf_animation_sampler) {
-          .input = &accessors[2 * object_count + animation_counter * object_count * 4 + 4 * i],
-          .output = &accessors[2 * object_count + animation_counter * object_count * 4 + 4 * i + 2],
-          .interpolation = cgltf_interpolation_type_step
+  // Meshes of detail level l are at l * mesh_count, sharing the level 0
+  // vertex attributes. The opaque primitive goes first so that blended faces
+  // are drawn after it.
+  cgltf_primitive prims[2 * lod_levels * mesh_count];
+  cgltf_mesh meshes[lod_levels * mesh_count];
+  for (int i = 0; i < lod_levels * mesh_count; i++) {
+    int m = i % mesh_count;
+    meshes[i] = (cgltf_mesh) {
+      .primitives = &prims[2 * i],
+      .primitives_count = 0
+    };
+    for (int group = 1; group >= 0; group--) {
+      cgltf_accessor* index_accessor = index_accessors[2 * i + group];
+      if (!index_accessor) {
+        continue;
+      }
+      cgltf_primitive* prim = &prims[2 * i + meshes[i].primitives_count++];
+      *prim = (cgltf_primitive) {
+        .type = cgltf_primitive_type_triangles,
+        .indices = index_accessor,
+        .attributes = &attributes[attributes_per_mesh * m],
+        .attributes_count = attributes_per_mesh,
+        .material = &materials[3 * mesh_page[m] +
+          (group == 0 ? 2 : mesh_has_cutout[m] ? 1 : 0)]
+      };
+      if (export_options.meshlets && i < mesh_count) {
+        size_t first = mesh_meshlet_start[m];
+        size_t count = mesh_semi_meshlet_count[m];
+        if (group == 1) {
+          first += count;
+          count = mesh_meshlet_count[m] - count;
+        }
+        wrote = snprintf(
+          extras_buf + total_wrote,
+          sizeof(extras_buf) - total_wrote,
+          "{ \"meshlets\": { "
+          "\"meshlets\": %ld, \"vertices\": %ld, \"triangles\": %ld, "
+          "\"bounds\": %ld, \"first\": %zu, \"count\": %zu } }",
+          meshlet_views[0] - buffer_views,
+          meshlet_views[1] - buffer_views,
+          meshlet_views[2] - buffer_views,
+          meshlet_views[3] - buffer_views,
+          first,
+          count);
+        if (wrote <= 0 || wrote >= sizeof(extras_buf) - total_wrote) {
+          die("snprintf error");
+        }
+        prim->extras = (cgltf_extras) {
+          .start_offset = total_wrote,
+          .end_offset = total_wrote + wrote
         };
+        total_wrote += wrote;
+      }
+    }
+  }
 
-        samplers[animation_counter * object_count * 3 + i * 3 + 2] = (cgltf_animation_sampler) {
-          .input = &accessors[2 * object_count + animation_counter * object_count * 4 + 4 * i],
-          .output = &accessors[2 * object_count + animation_counter * object_count * 4 + 4 * i + 3],
-          .interpolation = cgltf_interpolation_type_step
+  // A sampler for each track with keys, in channel order. Constant tracks
+  // from -t sample the animation's single key input.
+  cgltf_animation_sampler samplers[animation_slots * object_count * TRACK_COUNT];
+  uint32_t sampler_objects[animation_slots * object_count * TRACK_COUNT];
+  int sampler_tracks[animation_slots * object_count * TRACK_COUNT];
+  size_t animation_sampler_firsts[total_animation_count + 1];
+  size_t sampler_count = 0;
+  for (size_t anim = 0; anim < total_animation_count; anim++) {
+    animation_sampler_firsts[anim] = sampler_count;
+    for (int i = 0; i < object_count; i++) {
+      for (int track = 0; track < TRACK_COUNT; track++) {
+        cgltf_accessor* output = track_accessors[anim][i][track];
+        if (!output) {
+          continue;
+        }
+        sampler_objects[sampler_count] = i;
+        sampler_tracks[sampler_count] = track;
+        samplers[sampler_count++] = (cgltf_animation_sampler) {
+          .input = output->count == 1 && export_options.compress_tracks ?
+            single_key_inputs[anim] : input_accessors[anim][i],
+          .output = output,
+          .interpolation = fitted ? cgltf_interpolation_type_linear : cgltf_interpolation_type_step
         };
       }
-      animation_counter++;
     }
   }
-
-  cgltf_node nodes[object_count];
+  animation_sampler_firsts[total_animation_count] = sampler_count;
+
+  // Object nodes come first and are the ones animated. When quantizing, each
+  // object's mesh hangs off a child node whose scale dequantizes the
+  // positions, so that it doesn't fight with the animated transform. When
+  // skinned, the object nodes are the joints and a single extra node carries
+  // the mesh.
+  //
+  // Detail levels use MSFT_lod, which swaps a node for an alternative one,
+  // children included. So the mesh always gets its own childless node then,
+  // and the alternatives for the simplified levels go at the end, outside the
+  // scene.
+  int has_mesh_node = !skinned && (quantize || lod_levels > 1);
+  size_t node_count = object_count;
+  if (skinned) {
+    node_count += 1;
+  } else if (has_mesh_node) {
+    node_count += object_count;
+  }
+  size_t lod_node_base = node_count;
+  node_count += (lod_levels - 1) * mesh_count;
+  cgltf_node nodes[node_count];
   for (int i = 0; i < object_count; i++) {
     cgltf_node* parent;
     if (node_tree[i] >= 0) {
@@ -1260,13 +2344,16 @@ void make_epic_gltf_file(char* working_dir, float** vertices, size_t* vertex_cou
     } else {
       parent = NULL;
     }
-    cgltf_node** children = malloc(object_count * sizeof(cgltf_node*));
+    cgltf_node** children = malloc((object_count + 1) * sizeof(cgltf_node*));
     size_t children_count = 0;
     for (int child_ix = i; child_ix < object_count; child_ix++) {
       if (node_tree[child_ix] == i) {
         children[children_count++] = &nodes[child_ix];
       }
     }
+    if (has_mesh_node) {
+      children[children_count++] = &nodes[object_count + i];
+    }
     if (children_count == 0) {
       free(children);
       children = NULL;
@@ -1277,47 +2364,108 @@ void make_epic_gltf_file(char* working_dir, float** vertices, size_t* vertex_cou
       .children = children,
       .children_count = children_count,
       .skin = NULL,
-      .mesh = &meshes[i],
+      .mesh = skinned || has_mesh_node ? NULL : &meshes[i],
       .has_translation = 1
     };
     nodes[i].translation[0] = 0.0;
     nodes[i].translation[1] = 0.0;
     nodes[i].translation[2] = 0.0;
+    if (has_mesh_node) {
+      nodes[object_count + i] = (cgltf_node) {
+        .name = "mesh_node",
+        .parent = &nodes[i],
+        .mesh = &meshes[i],
+        .has_scale = quantize
+      };
+      nodes[object_count + i].scale[0] = quantize ? -1.0 / 4096.0 : 1.0;
+      nodes[object_count + i].scale[1] = quantize ? -1.0 / 4096.0 : 1.0;
+      nodes[object_count + i].scale[2] = quantize ? 1.0 / 4096.0 : 1.0;
+    }
   }
 
-  cgltf_node* root_nodes[object_count];
+  cgltf_node* joints[object_count];
+  cgltf_skin skins[1];
+  if (skinned) {
+    for (int i = 0; i < object_count; i++) {
+      joints[i] = &nodes[i];
+    }
+    skins[0] = (cgltf_skin) {
+      .name = "skin",
+      .joints = joints,
+      .joints_count = object_count,
+      .inverse_bind_matrices = inverse_bind_accessor
+    };
+    nodes[object_count] = (cgltf_node) {
+      .name = "skinned_mesh",
+      .mesh = &meshes[0],
+      .skin = &skins[0]
+    };
+  }
+
+  // Screen coverage thresholds quarter with each level, like the area of an
+  // object twice as far away. The last level is kept down to nothing.
+  char lod_json[mesh_count][256];
+  cgltf_extension lod_extensions[mesh_count];
+  for (int i = 0; i < mesh_count && lod_levels > 1; i++) {
+    cgltf_node* mesh_node = &nodes[skinned ? object_count : object_count + i];
+    int at = sprintf(lod_json[i], "{ \"ids\": [");
+    for (int level = 1; level < lod_levels; level++) {
+      size_t lod_node = lod_node_base + (level - 1) * mesh_count + i;
+      nodes[lod_node] = *mesh_node;
+      nodes[lod_node].name = "mesh_node_lod";
+      nodes[lod_node].parent = NULL;
+      nodes[lod_node].mesh = &meshes[level * mesh_count + i];
+      at += sprintf(lod_json[i] + at, level > 1 ? ", %zu" : "%zu", lod_node);
+    }
+    sprintf(lod_json[i] + at, "] }");
+    lod_extensions[i] = (cgltf_extension) {
+      .name = "MSFT_lod",
+      .data = lod_json[i]
+    };
+    mesh_node->extensions = &lod_extensions[i];
+    mesh_node->extensions_count = 1;
+
+    wrote = sprintf(extras_buf + total_wrote, "{ \"MSFT_screencoverage\": [");
+    for (int level = 0; level < lod_levels; level++) {
+      float coverage = level + 1 < lod_levels ? 0.25 / (1 << (2 * level)) : 0;
+      wrote += sprintf(extras_buf + total_wrote + wrote,
+        level > 0 ? ", %g" : "%g", coverage);
+    }
+    wrote += sprintf(extras_buf + total_wrote + wrote, "] }");
+    mesh_node->extras = (cgltf_extras) {
+      .start_offset = total_wrote,
+      .end_offset = total_wrote + wrote
+    };
+    total_wrote += wrote;
+  }
+
+  cgltf_node* root_nodes[object_count + 1];
   int root_node_count = 0;
   for (int i = 0; i < object_count; i++) {
     if (node_tree[i] < 0) {
       root_nodes[root_node_count++] = &nodes[i];
     }
   }
+  if (skinned) {
+    root_nodes[root_node_count++] = &nodes[object_count];
+  }
 
-  animation_counter = 0;
-  cgltf_animation_channel channels[total_animation_count * object_count * 3];
-  for (int anim = 0; anim < total_animation_count; anim++) {
-    for (int i = 0; i < object_count; i++) {
-      channels[animation_counter * object_count * 3 + 3 * i + 0] = (cgltf_animation_channel) {
-        .sampler = &samplers[animation_counter * object_count * 3 + 3 * i + 0],
-        .target_node = &nodes[i],
-        .target_path = cgltf_animation_path_type_rotation
-      };
-      channels[animation_counter * object_count * 3 + 3 * i + 1] = (cgltf_animation_channel) {
-        .sampler = &samplers[animation_counter * object_count * 3 + 3 * i + 1],
-        .target_node = &nodes[i],
-        .target_path = cgltf_animation_path_type_translation
-      };
-      channels[animation_counter * object_count * 3 + 3 * i + 2] = (cgltf_animation_channel) {
-        .sampler = &samplers[animation_counter * object_count * 3 + 3 * i + 2],
-        .target_node = &nodes[i],
-        .target_path = cgltf_animation_path_type_scale
-      };
-    }
-    animation_counter++;
+  const cgltf_animation_path_type track_paths[TRACK_COUNT] = {
+    cgltf_animation_path_type_rotation,
+    cgltf_animation_path_type_translation,
+    cgltf_animation_path_type_scale
+  };
+  cgltf_animation_channel channels[sampler_count > 0 ? sampler_count : 1];
+  for (size_t i = 0; i < sampler_count; i++) {
+    channels[i] = (cgltf_animation_channel) {
+      .sampler = &samplers[i],
+      .target_node = &nodes[sampler_objects[i]],
+      .target_path = track_paths[sampler_tracks[i]]
+    };
   }
 
   animation_counter = 0;
-  char* animation_names[total_animation_count];
+  char* animation_names[animation_slots];
   for (int anim = 0; anim < animation_file_count; anim++) {
     for (int i = 0; i < animations[anim].animation_count; i++) {
       animation_names[animation_counter] = malloc(256);
@@ -1334,14 +2482,14 @@ void make_epic_gltf_file(char* working_dir, float** vertices, size_t* vertex_cou
       animation_counter++;
     }
   }
-  cgltf_animation gltf_animations[total_animation_count];
+  cgltf_animation gltf_animations[animation_slots];
   for (int i = 0; i < total_animation_count; i++) {
     gltf_animations[i] = (cgltf_animation) {
       .name = animation_names[i],
-      .samplers = &samplers[3 * object_count * i],
-      .samplers_count = 3 * object_count,
-      .channels = &channels[3 * object_count * i],
-      .channels_count = 3 * object_count
+      .samplers = &samplers[animation_sampler_firsts[i]],
+      .samplers_count = animation_sampler_firsts[i + 1] - animation_sampler_firsts[i],
+      .channels = &channels[animation_sampler_firsts[i]],
+      .channels_count = animation_sampler_firsts[i + 1] - animation_sampler_firsts[i]
     };
   }
 
@@ -1355,34 +2503,51 @@ void make_epic_gltf_file(char* working_dir, float** vertices, size_t* vertex_cou
 
   cgltf_data data = {0};
   data.meshes = meshes;
-  data.meshes_count = object_count;
+  data.meshes_count = lod_levels * mesh_count;
 
   data.animations = gltf_animations;
   data.animations_count = total_animation_count;
 
   data.accessors = accessors;
-  data.accessors_count = 4 * object_count * total_animation_count + 3 * object_count;
+  data.accessors_count = accessor_count;
 
   data.buffer_views = buffer_views;
-  data.buffer_views_count = 4 * total_animation_count + 4;
+  data.buffer_views_count = buffer_count;
 
   data.buffers = buffers;
-  data.buffers_count = 4 * total_animation_count + 4;
+  data.buffers_count = buffer_count;
 
   data.materials = materials;
-  data.materials_count = 1;
+  data.materials_count = 3 * atlas_page_count;
 
   data.images = images;
-  data.images_count = 1;
+  data.images_count = image_count;
 
   data.textures = textures;
-  data.textures_count = 1;
+  data.textures_count = texture_count;
 
   data.samplers = texture_samplers;
   data.samplers_count = 1;
 
   data.nodes = nodes;
-  data.nodes_count = object_count;
+  data.nodes_count = node_count;
+
+  if (skinned) {
+    data.skins = skins;
+    data.skins_count = 1;
+  }
+
+  char* extensions_used[2];
+  char* quantization_extension = "KHR_mesh_quantization";
+  data.extensions_used = extensions_used;
+  if (quantize) {
+    extensions_used[data.extensions_used_count++] = quantization_extension;
+    data.extensions_required = &quantization_extension;
+    data.extensions_required_count = 1;
+  }
+  if (lod_levels > 1) {
+    extensions_used[data.extensions_used_count++] = "MSFT_lod";
+  }
 
   data.scenes = scenes;
   data.scenes_count = 1;
@@ -1393,9 +2558,8 @@ void make_epic_gltf_file(char* working_dir, float** vertices, size_t* vertex_cou
     .version = "2.0"
   };
 
-  char extras_buf[256*256];
-  int total_wrote = 0;
-  int wrote = sprintf(
+  int blink_start = total_wrote;
+  wrote = sprintf(
     extras_buf + total_wrote,
     "{ \"blink\": ["
   );
@@ -1430,12 +2594,12 @@ void make_epic_gltf_file(char* working_dir, float** vertices, size_t* vertex_cou
   );
   total_wrote += wrote;
 
-  printf("extras buf: %s\n", extras_buf);
-  printf("extras bytes: %d\n", total_wrote);
+  printf("extras buf: %s\n", extras_buf + blink_start);
+  printf("extras bytes: %d\n", total_wrote - blink_start);
 
   data.file_data = extras_buf;
   data.extras = (cgltf_extras) {
-    .start_offset = 0,
+    .start_offset = blink_start,
     .end_offset = total_wrote,
   };
 
@@ -1450,16 +2614,611 @@ void make_epic_gltf_file(char* working_dir, float** vertices, size_t* vertex_cou
     fprintf(stderr, "Bad cgltf result: %d\n", result);
   }
 
-  free(vertex_encoded);
-  free(index_encoded);
-  free(texcoord_encoded);
-  free(png_encoded);
+  for (int i = 0; i < buffer_count; i++) {
+    free(buffers[i].uri);
+  }
 
   for (int i = 0; i < object_count; i++) {
     free(nodes[i].children);
   }
 }
 
+// Atlas slots in the order their palettes are first used by a face. A
+// palette is identified by its packed CLUT position and semi-transparency,
+// which fit in 16 bits, so a direct-mapped table finds its slot.
+typedef struct palette_slots_s {
+  uint16_t* lookup; // 64K entries, slot + 1 or 0 for unseen palettes
+  uint16_t* packed; // packed palette of each slot
+  size_t count;
+  size_t capacity;
+} palette_slots_t;
+
+void palette_slots_init(palette_slots_t* slots) {
+  slots->lookup = calloc(0x10000, sizeof(uint16_t));
+  slots->capacity = 32;
+  slots->packed = malloc(slots->capacity * sizeof(uint16_t));
+  slots->count = 0;
+}
+
+void palette_slots_free(palette_slots_t* slots) {
+  free(slots->lookup);
+  free(slots->packed);
+}
+
+int palette_slot(palette_slots_t* slots, uint8_t palette, uint8_t clut, uint8_t cmd_upper) {
+  uint8_t cmd = cmd_upper == 0 ? 0 : 0x80;
+  uint16_t pal_clut_packed = (clut << 8) | palette | (cmd << 8);
+  uint16_t slot = slots->lookup[pal_clut_packed];
+  if (slot != 0) {
+    return slot - 1;
+  }
+  // Texel rows are 16-bit, which caps the atlas at 256 rows of slots
+  if (slots->count >= 8 * 256) {
+    die("Too many palettes referenced in file!");
+  }
+  if (slots->count == slots->capacity) {
+    slots->capacity *= 2;
+    slots->packed = realloc(slots->packed, slots->capacity * sizeof(uint16_t));
+  }
+  slots->packed[slots->count] = pal_clut_packed;
+  slots->lookup[pal_clut_packed] = ++slots->count;
+  fprintf(stderr,
+    "Encountered new palette %04x (y=%02x, x=%02x, t=%02x)\n",
+    pal_clut_packed,
+    pal_clut_packed >> 6,
+    pal_clut_packed & 0x3f,
+    (pal_clut_packed >> 8) & 0x80);
+  return slots->count - 1;
+}
+
+// Looks up the welded vertex for one face corner, identified by its position
+// index, its normal index, its texel coordinates and the atlas slot of its
+// palette. A corner
+// that hasn't been seen yet is appended to the object's mesh.
+uint32_t weld_corner(weld_table_t* weld, vertex_t* verts, vertex_t* normals, uint8_t vertex, uint8_t normal, uint8_t tex_x, uint8_t tex_y, int pal, object_mesh_t* mesh) {
+  uint64_t key =
+    (uint64_t) vertex |
+    ((uint64_t) tex_x << 8) |
+    ((uint64_t) tex_y << 16) |
+    ((uint64_t) normal << 24) |
+    ((uint64_t) pal << 32);
+  int is_new;
+  uint32_t index = weld_table_insert(weld, key, &is_new);
+  if (is_new) {
+    mesh->positions[index] = verts[vertex];
+    mesh->normals[index] = normals[normal];
+    mesh->texels[2 * index + 0] = tex_x + 128 * (pal % 8);
+    mesh->texels[2 * index + 1] = tex_y + 256 * (pal / 8);
+    mesh->vertex_count = index + 1;
+  }
+  return index;
+}
+
+// Reorders each object's triangles for the post-transform vertex cache,
+// keeping semi-transparent and opaque triangles apart, then renumbers the
+// vertices in the order they are first used
+void optimize_object_mesh(object_mesh_t* mesh) {
+  size_t semi_index_count = 3 * mesh->semi_transparent_triangle_count;
+  size_t index_count = 3 * mesh->triangle_count;
+  float acmr_before = mesh_acmr(mesh->indices, index_count, mesh->vertex_count, 16);
+  optimize_vertex_cache(mesh->indices, semi_index_count, mesh->vertex_count);
+  optimize_vertex_cache(
+    &mesh->indices[semi_index_count],
+    index_count - semi_index_count,
+    mesh->vertex_count);
+  float acmr_after = mesh_acmr(mesh->indices, index_count, mesh->vertex_count, 16);
+  fprintf(stderr, "ACMR (16 entry FIFO): %.3f -> %.3f\n", acmr_before, acmr_after);
+
+  uint32_t* remap = malloc(mesh->vertex_count * sizeof(uint32_t));
+  optimize_vertex_fetch_remap(remap, mesh->indices, index_count, mesh->vertex_count);
+  vertex_t* positions = malloc(mesh->vertex_count * sizeof(vertex_t));
+  vertex_t* normals = malloc(mesh->vertex_count * sizeof(vertex_t));
+  uint16_t* texels = malloc(mesh->vertex_count * 2 * sizeof(uint16_t));
+  for (size_t v = 0; v < mesh->vertex_count; v++) {
+    positions[remap[v]] = mesh->positions[v];
+    normals[remap[v]] = mesh->normals[v];
+    texels[2 * remap[v] + 0] = mesh->texels[2 * v + 0];
+    texels[2 * remap[v] + 1] = mesh->texels[2 * v + 1];
+  }
+  free(mesh->positions);
+  free(mesh->normals);
+  free(mesh->texels);
+  free(remap);
+  mesh->positions = positions;
+  mesh->normals = normals;
+  mesh->texels = texels;
+}
+
+// Positions in the exported coordinate system, i.e. with the axis flips and
+// the 4.12 scale applied
+float* object_float_positions(object_mesh_t* mesh) {
+  float* positions = malloc(3 * sizeof(float) * mesh->vertex_count);
+  float bounds_min[3] = { INFINITY, INFINITY, INFINITY };
+  float bounds_max[3] = { -INFINITY, -INFINITY, -INFINITY };
+  vertices_to_floats(positions, bounds_min, bounds_max,
+    mesh->positions, mesh->vertex_count, export_scale);
+  return positions;
+}
+
+void build_object_meshlets(object_mesh_t* mesh) {
+  float* positions = object_float_positions(mesh);
+  size_t semi_index_count = 3 * mesh->semi_transparent_triangle_count;
+  build_meshlets(&mesh->meshlets, mesh->indices, semi_index_count,
+    positions, mesh->vertex_count);
+  mesh->semi_transparent_meshlet_count = mesh->meshlets.meshlet_count;
+  build_meshlets(&mesh->meshlets, &mesh->indices[semi_index_count],
+    3 * mesh->triangle_count - semi_index_count,
+    positions, mesh->vertex_count);
+  fprintf(stderr, "built %zu meshlets for %zu triangles\n",
+    mesh->meshlets.meshlet_count, mesh->triangle_count);
+  free(positions);
+}
+
+// Each level aims for half the triangles of the one before and may deviate
+// twice as far from the full geometry. The semi-transparent and opaque
+// triangles are simplified separately so they stay in their own ranges, with
+// the vertices they share locked to avoid cracks between the two.
+void build_object_lods(object_mesh_t* mesh) {
+  if (export_options.lod_levels <= 1) {
+    return;
+  }
+  float* positions = object_float_positions(mesh);
+  size_t semi_index_count = 3 * mesh->semi_transparent_triangle_count;
+  size_t index_count = 3 * mesh->triangle_count;
+  uint8_t* used_by_semi = calloc(mesh->vertex_count, 1);
+  uint8_t* used_by_opaque = calloc(mesh->vertex_count, 1);
+  for (size_t i = 0; i < index_count; i++) {
+    if (i < semi_index_count) {
+      used_by_semi[mesh->indices[i]] = 1;
+    } else {
+      used_by_opaque[mesh->indices[i]] = 1;
+    }
+  }
+
+  fprintf(stderr, "LOD 0: %zu triangles\n", mesh->triangle_count);
+  for (int level = 1; level < export_options.lod_levels; level++) {
+    object_lod_t* lod = &mesh->lods[level - 1];
+    float max_error = export_options.lod_error * (1 << (level - 1));
+    float semi_error, opaque_error;
+    lod->indices = malloc(index_count * sizeof(uint32_t));
+    size_t semi_count = simplify_mesh(
+      lod->indices, mesh->indices, semi_index_count,
+      positions, mesh->vertex_count, used_by_opaque,
+      (semi_index_count / 3 >> level) * 3, max_error, &semi_error);
+    size_t opaque_count = simplify_mesh(
+      &lod->indices[semi_count], &mesh->indices[semi_index_count],
+      index_count - semi_index_count,
+      positions, mesh->vertex_count, used_by_semi,
+      ((index_count - semi_index_count) / 3 >> level) * 3, max_error, &opaque_error);
+    optimize_vertex_cache(lod->indices, semi_count, mesh->vertex_count);
+    optimize_vertex_cache(&lod->indices[semi_count], opaque_count, mesh->vertex_count);
+    lod->semi_transparent_triangle_count = semi_count / 3;
+    lod->triangle_count = (semi_count + opaque_count) / 3;
+    fprintf(stderr, "LOD %d: %zu triangles (error %f)\n", level,
+      lod->triangle_count, fmaxf(semi_error, opaque_error));
+  }
+
+  free(positions);
+  free(used_by_semi);
+  free(used_by_opaque);
+}
+
+// Groups objects into atlas pages whose colours, including the transparent
+// black of unused atlas space, fit in a 256 entry palette. Each object joins
+// the last page, or starts a new one when it doesn't fit. An object that has
+// more colours than that on its own gets a page that is written as RGBA.
+size_t assign_atlas_pages(object_mesh_t* objects, size_t object_count, paletted_texture_t* tex, palette_slots_t* slots) {
+  uint32_t page_colors[257];
+  size_t page_color_count = 0;
+  size_t page = 0;
+  uint8_t used[slots->count];
+  for (size_t i = 0; i < object_count; i++) {
+    object_mesh_t* mesh = &objects[i];
+    memset(used, 0, sizeof(used));
+    for (size_t j = 0; j < mesh->vertex_count; j++) {
+      used[mesh->texels[2 * j + 0] / 128 + 8 * (mesh->texels[2 * j + 1] / 256)] = 1;
+    }
+    uint32_t colors[257];
+    size_t color_count = 0;
+    add_palette_color(colors, &color_count, 0);
+    for (size_t slot = 0; slot < slots->count; slot++) {
+      if (!used[slot]) {
+        continue;
+      }
+      uint16_t clut = slots->packed[slot];
+      uint8_t clut_rgba[16][4];
+      clut_colors(tex, clut & 0x3f, clut >> 6, clut & 0x8000, clut_rgba);
+      for (int k = 0; k < 16; k++) {
+        uint32_t color;
+        memcpy(&color, clut_rgba[k], sizeof(uint32_t));
+        add_palette_color(colors, &color_count, color);
+      }
+    }
+    uint32_t merged[257];
+    size_t merged_count = page_color_count;
+    memcpy(merged, page_colors, page_color_count * sizeof(uint32_t));
+    int fits = 1;
+    for (size_t k = 0; k < color_count && fits; k++) {
+      fits = add_palette_color(merged, &merged_count, colors[k]) >= 0 &&
+        merged_count <= 256;
+    }
+    if (!fits) {
+      if (i > 0) {
+        page++;
+      }
+      merged_count = color_count;
+      memcpy(merged, colors, color_count * sizeof(uint32_t));
+    }
+    memcpy(page_colors, merged, merged_count * sizeof(uint32_t));
+    page_color_count = merged_count;
+    mesh->page = page;
+  }
+  return page + 1;
+}
+
+// Lays out the 128x256 pages of the palette slots that a page's objects use
+// in rows of 8, and moves the objects' texels along with their slots
+void build_grid_atlas(object_mesh_t* objects, size_t object_count, size_t page, paletted_texture_t* tex, palette_slots_t* slots) {
+  int32_t local_slot[slots->count];
+  for (size_t slot = 0; slot < slots->count; slot++) {
+    local_slot[slot] = -1;
+  }
+  for (size_t i = 0; i < object_count; i++) {
+    object_mesh_t* mesh = &objects[i];
+    if (mesh->page != page) {
+      continue;
+    }
+    for (size_t j = 0; j < mesh->vertex_count; j++) {
+      local_slot[mesh->texels[2 * j + 0] / 128 + 8 * (mesh->texels[2 * j + 1] / 256)] = 0;
+    }
+  }
+  size_t slot_count = 0;
+  for (size_t slot = 0; slot < slots->count; slot++) {
+    if (local_slot[slot] == 0) {
+      local_slot[slot] = slot_count++;
+    }
+  }
+
+  png_write_width = 1024;
+  png_write_height = 256 * ((slot_count + 7) / 8);
+  if (png_write_height < 1024) {
+    png_write_height = 1024;
+  }
+  png_write_buffer = calloc(4 * png_write_width, png_write_height);
+  for (size_t slot = 0; slot < slots->count; slot++) {
+    if (local_slot[slot] < 0) {
+      continue;
+    }
+    uint16_t clut = slots->packed[slot];
+    fprintf(stderr, "Loading the texture with %02x,%02x\n", clut & 0x3f, clut >> 6);
+    size_t offset_x = 128 * (local_slot[slot] % 8);
+    size_t offset_y = 256 * (local_slot[slot] / 8);
+    blit_to_png_write_buffer(tex, clut & 0x3f, clut >> 6, clut & 0x8000, offset_x, offset_y);
+  }
+
+  for (size_t i = 0; i < object_count; i++) {
+    object_mesh_t* mesh = &objects[i];
+    if (mesh->page != page) {
+      continue;
+    }
+    for (size_t j = 0; j < mesh->vertex_count; j++) {
+      uint16_t* texel = &mesh->texels[2 * j];
+      int32_t local = local_slot[texel[0] / 128 + 8 * (texel[1] / 256)];
+      texel[0] = texel[0] % 128 + 128 * (local % 8);
+      texel[1] = texel[1] % 256 + 256 * (local / 8);
+    }
+  }
+}
+
+// Whether any of the mesh's opaque triangles samples transparent texels of
+// the atlas page in png_write_buffer
+int object_has_cutout(object_mesh_t* mesh) {
+  for (size_t t = mesh->semi_transparent_triangle_count; t < mesh->triangle_count; t++) {
+    size_t x0 = SIZE_MAX, y0 = SIZE_MAX, x1 = 0, y1 = 0;
+    for (int k = 0; k < 3; k++) {
+      uint32_t v = mesh->indices[3 * t + k];
+      size_t x = mesh->texels[2 * v + 0];
+      size_t y = mesh->texels[2 * v + 1];
+      if (x < x0) x0 = x;
+      if (y < y0) y0 = y;
+      if (x > x1) x1 = x;
+      if (y > y1) y1 = y;
+    }
+    if (atlas_rect_has_cutout(x0, y0, x1, y1)) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Writes the texture sheet as one R8 texture of CLUT indices and the palette
+// slots as a strip of RGBA rows, 16 texels each. Every vertex keeps its texel
+// within the sheet and gets its palette slot as its CLUT row. An RGBA grid
+// atlas is still built, only to find the objects with cutout texels.
+void build_palette_swap_textures(object_mesh_t* objects, size_t object_count, paletted_texture_t* tex, palette_slots_t* slots) {
+  build_grid_atlas(objects, object_count, 0, tex, slots);
+  for (size_t i = 0; i < object_count; i++) {
+    object_mesh_t* mesh = &objects[i];
+    mesh->has_cutout = object_has_cutout(mesh);
+    mesh->palette_rows = malloc(mesh->vertex_count * sizeof(uint16_t));
+    for (size_t j = 0; j < mesh->vertex_count; j++) {
+      uint16_t* texel = &mesh->texels[2 * j];
+      mesh->palette_rows[j] = texel[0] / 128 + 8 * (texel[1] / 256);
+      texel[0] %= 128;
+      texel[1] %= 256;
+    }
+  }
+  free(png_write_buffer);
+
+  uint8_t* indices = malloc(128 * 256);
+  for (size_t i = 0; i < 0x4000; i++) {
+    indices[2 * i + 0] = tex->texture[i] & 0x0f;
+    indices[2 * i + 1] = tex->texture[i] >> 4;
+  }
+  atlas_page_count = 1;
+  atlas_pages = calloc(1, sizeof(atlas_page_t));
+  atlas_pages[0] = (atlas_page_t) { .width = 128, .height = 256 };
+  atlas_pages[0].png = encode_png(indices, 128, 256, PNG_FORMAT_GRAY, &atlas_pages[0].png_size);
+  free(indices);
+
+  uint8_t* strip = malloc(4 * 16 * slots->count);
+  for (size_t slot = 0; slot < slots->count; slot++) {
+    uint16_t clut = slots->packed[slot];
+    clut_colors(tex, clut & 0x3f, clut >> 6, clut & 0x8000, (uint8_t (*)[4]) &strip[4 * 16 * slot]);
+  }
+  clut_strip = (atlas_page_t) { .width = 16, .height = slots->count };
+  clut_strip.png = encode_png(strip, 16, slots->count, PNG_FORMAT_RGBA, &clut_strip.png_size);
+  free(strip);
+  fprintf(stderr, "wrote a 128x256 index texture and %zu CLUT rows\n", slots->count);
+}
+
+static uint32_t find_chart(uint32_t* parent, uint32_t t) {
+  while (parent[t] != t) {
+    parent[t] = parent[parent[t]];
+    t = parent[t];
+  }
+  return t;
+}
+
+// Packs only the texels that the faces of a page's objects sample. Triangles
+// that share a vertex, or whose padded texel rectangles overlap within a
+// palette slot, form a chart that is copied as one rectangle, so every welded
+// vertex lies in exactly one chart and can be moved with it.
+void build_tight_atlas(object_mesh_t* objects, size_t object_count, size_t page, paletted_texture_t* tex, palette_slots_t* slots) {
+  size_t total_triangles = 0;
+  size_t triangle_base[object_count];
+  for (size_t i = 0; i < object_count; i++) {
+    triangle_base[i] = total_triangles;
+    if (objects[i].page == page) {
+      total_triangles += objects[i].triangle_count;
+    }
+  }
+  uint32_t* parent = malloc(total_triangles * sizeof(uint32_t));
+  for (uint32_t t = 0; t < total_triangles; t++) {
+    parent[t] = t;
+  }
+  for (size_t i = 0; i < object_count; i++) {
+    object_mesh_t* mesh = &objects[i];
+    if (mesh->page != page) {
+      continue;
+    }
+    uint32_t* first_triangle = malloc(mesh->vertex_count * sizeof(uint32_t));
+    memset(first_triangle, 0xff, mesh->vertex_count * sizeof(uint32_t));
+    for (size_t j = 0; j < 3 * mesh->triangle_count; j++) {
+      uint32_t v = mesh->indices[j];
+      uint32_t t = triangle_base[i] + j / 3;
+      if (first_triangle[v] == UINT32_MAX) {
+        first_triangle[v] = t;
+      } else {
+        parent[find_chart(parent, t)] = find_chart(parent, first_triangle[v]);
+      }
+    }
+    free(first_triangle);
+  }
+
+  // Bounds of each chart, padded by a texel and clamped to its slot's page.
+  // Charts are indexed by their root triangle.
+  uint16_t (*bounds)[4] = malloc(total_triangles * sizeof(*bounds));
+  uint16_t* chart_slot = malloc(total_triangles * sizeof(uint16_t));
+  for (uint32_t t = 0; t < total_triangles; t++) {
+    bounds[t][0] = bounds[t][1] = UINT16_MAX;
+    bounds[t][2] = bounds[t][3] = 0;
+  }
+  for (size_t i = 0; i < object_count; i++) {
+    object_mesh_t* mesh = &objects[i];
+    if (mesh->page != page) {
+      continue;
+    }
+    for (size_t j = 0; j < 3 * mesh->triangle_count; j++) {
+      uint32_t root = find_chart(parent, triangle_base[i] + j / 3);
+      uint16_t x = mesh->texels[2 * mesh->indices[j] + 0];
+      uint16_t y = mesh->texels[2 * mesh->indices[j] + 1];
+      size_t page_x = x / 128 * 128;
+      size_t page_y = y / 256 * 256;
+      chart_slot[root] = x / 128 + 8 * (y / 256);
+      uint16_t x0 = x > page_x ? x - 1 : x;
+      uint16_t y0 = y > page_y ? y - 1 : y;
+      uint16_t x1 = x < page_x + 127 ? x + 1 : x;
+      uint16_t y1 = y < page_y + 255 ? y + 1 : y;
+      if (x0 < bounds[root][0]) bounds[root][0] = x0;
+      if (y0 < bounds[root][1]) bounds[root][1] = y0;
+      if (x1 > bounds[root][2]) bounds[root][2] = x1;
+      if (y1 > bounds[root][3]) bounds[root][3] = y1;
+    }
+  }
+  uint32_t* charts = malloc(total_triangles * sizeof(uint32_t));
+  size_t chart_count = 0;
+  for (uint32_t t = 0; t < total_triangles; t++) {
+    if (parent[t] == t) {
+      charts[chart_count++] = t;
+    }
+  }
+
+  // Merge overlapping charts of the same slot until none overlap
+  int merged = 1;
+  while (merged) {
+    merged = 0;
+    for (size_t a = 0; a < chart_count; a++) {
+      for (size_t b = a + 1; b < chart_count; b++) {
+        uint32_t ra = charts[a];
+        uint32_t rb = charts[b];
+        if (chart_slot[ra] != chart_slot[rb] ||
+            bounds[ra][0] > bounds[rb][2] || bounds[rb][0] > bounds[ra][2] ||
+            bounds[ra][1] > bounds[rb][3] || bounds[rb][1] > bounds[ra][3]) {
+          continue;
+        }
+        parent[rb] = ra;
+        for (int k = 0; k < 2; k++) {
+          if (bounds[rb][k] < bounds[ra][k]) bounds[ra][k] = bounds[rb][k];
+          if (bounds[rb][k + 2] > bounds[ra][k + 2]) bounds[ra][k + 2] = bounds[rb][k + 2];
+        }
+        charts[b--] = charts[--chart_count];
+        merged = 1;
+      }
+    }
+  }
+
+  atlas_rect_t* rects = malloc(chart_count * sizeof(atlas_rect_t));
+  size_t* rect_of_chart = malloc(total_triangles * sizeof(size_t));
+  for (size_t c = 0; c < chart_count; c++) {
+    uint32_t root = charts[c];
+    rect_of_chart[root] = c;
+    rects[c] = (atlas_rect_t) {
+      .width = bounds[root][2] - bounds[root][0] + 1,
+      .height = bounds[root][3] - bounds[root][1] + 1
+    };
+  }
+  uint32_t width, height;
+  if (!pack_atlas(rects, chart_count, 8192, &width, &height)) {
+    die("Texture charts don't fit in an 8192x8192 atlas");
+  }
+  png_write_width = width;
+  png_write_height = height;
+  png_write_buffer = calloc(4 * png_write_width, png_write_height);
+  fprintf(stderr, "packed %zu charts into a %ux%u atlas\n", chart_count, width, height);
+
+  // Expand each page once, then copy the charts out of it
+  uint8_t* pages[slots->count];
+  memset(pages, 0, sizeof(pages));
+  for (size_t c = 0; c < chart_count; c++) {
+    uint32_t root = charts[c];
+    uint16_t slot = chart_slot[root];
+    if (!pages[slot]) {
+      uint16_t clut = slots->packed[slot];
+      pages[slot] = expand_texture_paletted(tex, clut & 0x3f, clut >> 6, clut & 0x8000);
+    }
+    blit_rect_to_png_write_buffer(pages[slot],
+      bounds[root][0] % 128, bounds[root][1] % 256,
+      rects[c].width, rects[c].height,
+      rects[c].x, rects[c].y);
+  }
+  for (size_t slot = 0; slot < slots->count; slot++) {
+    free(pages[slot]);
+  }
+
+  // Move every vertex along with its chart
+  for (size_t i = 0; i < object_count; i++) {
+    object_mesh_t* mesh = &objects[i];
+    if (mesh->page != page) {
+      continue;
+    }
+    uint8_t* moved = calloc(mesh->vertex_count, 1);
+    for (size_t j = 0; j < 3 * mesh->triangle_count; j++) {
+      uint32_t v = mesh->indices[j];
+      if (moved[v]) {
+        continue;
+      }
+      moved[v] = 1;
+      uint32_t root = find_chart(parent, triangle_base[i] + j / 3);
+      atlas_rect_t* rect = &rects[rect_of_chart[root]];
+      mesh->texels[2 * v + 0] += rect->x - bounds[root][0];
+      mesh->texels[2 * v + 1] += rect->y - bounds[root][1];
+    }
+    free(moved);
+  }
+
+  free(parent);
+  free(bounds);
+  free(chart_slot);
+  free(charts);
+  free(rects);
+  free(rect_of_chart);
+}
+
+// Encodes png_write_buffer as an atlas page. With -d the files are keyed by a
+// hash of the pixels and the encoding options, so a page that an earlier
+// model already wrote to the store is referenced without encoding it again.
+// Writes a page's KTX2 into dir as texture_<page>.ktx2, where the glTF
+// written there refers to it by that name
+void write_ktx2_file(const char* dir, size_t page, atlas_page_t* atlas_page) {
+  char file_name[32];
+  snprintf(file_name, sizeof(file_name), "texture_%zu.ktx2", page);
+  size_t path_length = strlen(dir) + strlen(file_name) + 2;
+  char* path = malloc(path_length);
+  snprintf(path, path_length, "%s/%s", dir, file_name);
+  FILE* fp = fopen(path, "wb");
+  if (!fp || fwrite(atlas_page->ktx2, 1, atlas_page->ktx2_size, fp) != atlas_page->ktx2_size || fclose(fp) != 0) {
+    die("write_ktx2_file: failed to write the KTX2 texture");
+  }
+  free(path);
+  free(atlas_page->ktx2);
+  atlas_page->ktx2 = NULL;
+  atlas_page->ktx2_uri = strdup(file_name);
+}
+
+atlas_page_t encode_atlas_page() {
+  atlas_page_t page = {
+    .width = png_write_width,
+    .height = png_write_height
+  };
+  uint64_t key = 0;
+  int have_png = 0;
+  int have_ktx2 = !export_options.ktx2;
+  if (export_options.shared_store) {
+    int32_t encoding[4] = {
+      page.width, page.height, export_options.paletted, export_options.png_level
+    };
+    key = store_hash(
+      png_write_buffer, 4 * page.width * page.height,
+      store_hash(encoding, sizeof(encoding), 0));
+    have_png = store_lookup(STORE_DIR, key, "png", NULL);
+    have_ktx2 = have_ktx2 || store_lookup(STORE_DIR, key, "ktx2", NULL);
+  }
+  if (!have_png) {
+    page.png_size = save_png_write_buffer(export_options.paletted);
+    page.png = png_buffer;
+  }
+  if (!have_ktx2) {
+    ktx2_format_t format = ktx2_pick_format(png_write_buffer, png_write_width, png_write_height);
+    page.ktx2 = ktx2_encode(
+      png_write_buffer, png_write_width, png_write_height, format, 0,
+      &page.ktx2_size);
+    fprintf(stderr, "encoded a %zux%zu %s KTX2 texture\n",
+      png_write_width, png_write_height,
+      format == KTX2_FORMAT_BC1 ? "BC1" : "BC3");
+  }
+  if (!export_options.shared_store) {
+    return page;
+  }
+  if (page.png && !store_put(STORE_DIR, key, "png", page.png, page.png_size)) {
+    die("encode_atlas_page: failed to write to the store");
+  }
+  if (page.ktx2 && !store_put(STORE_DIR, key, "ktx2", page.ktx2, page.ktx2_size)) {
+    die("encode_atlas_page: failed to write to the store");
+  }
+  fprintf(stderr, "%s atlas page %016llx\n",
+    have_png ? "reused" : "stored", (unsigned long long) key);
+  free(page.png);
+  free(page.ktx2);
+  page.png = NULL;
+  page.ktx2 = NULL;
+  page.png_uri = store_uri(STORE_DIR, key, "png");
+  if (export_options.ktx2) {
+    page.ktx2_uri = store_uri(STORE_DIR, key, "ktx2");
+  }
+  return page;
+}
+
 void rip_model(iso_t* iso, char* name, size_t model_sector, size_t* animation_sectors, char* animation_labels, size_t animation_file_count) {
   struct stat st = {0};
   if (stat(name, &st) == -1) {
@@ -1515,21 +3274,22 @@ void rip_model(iso_t* iso, char* name, size_t model_sector, size_t* animation_se
       new_model.face_offsets[i]);
   }
 
-  float* flat_vert_table[new_model.object_count];
-  memset(flat_vert_table, 0, new_model.object_count * sizeof(float*));
-  size_t flat_vert_counts[new_model.object_count];
-  memset(flat_vert_counts, 0, new_model.object_count * sizeof(size_t));
-  uint32_t* flat_tri_table[new_model.object_count];
-  memset(flat_tri_table, 0, new_model.object_count * sizeof(uint32_t*));
-  size_t flat_tri_counts[new_model.object_count];
-  memset(flat_tri_counts, 0, new_model.object_count * sizeof(size_t));
-  float* texcoord_table[new_model.object_count];
-  memset(texcoord_table, 0, new_model.object_count * sizeof(float*));
-  size_t texcoord_counts[new_model.object_count];
-  memset(texcoord_counts, 0, new_model.object_count * sizeof(size_t));
+  object_mesh_t objects[new_model.object_count];
+  memset(objects, 0, new_model.object_count * sizeof(object_mesh_t));
+
+  float pose[12 * new_model.object_count];
+  int bake = export_options.bake_frame >= 0;
+  if (bake) {
+    if (animation_file_count == 0 || animation[0].animation_count == 0 ||
+        export_options.bake_frame >= animation[0].frame_counts[0]) {
+      die("No such frame to bake");
+    }
+    evaluate_pose(&animation[0], 0, export_options.bake_frame,
+      new_model.node_tree, new_model.object_count, pose);
+  }
 
-  uint16_t exported_palettes[16];
-  size_t exported_palettes_count = 0;
+  palette_slots_t palette_slots;
+  palette_slots_init(&palette_slots);
 
   for (int j = 0; j < new_model.object_count; j++) {
     uint32_t num_read;
@@ -1537,6 +3297,9 @@ void rip_model(iso_t* iso, char* name, size_t model_sector, size_t* animation_se
     fprintf(stderr, "loading verts (%d/%d)\n", j + 1, new_model.object_count);
     verts = load_vertices(&new_model, j, &num_read);
     fprintf(stderr, "loaded %d verts\n", num_read);
+    uint32_t num_normals_read;
+    vertex_t* normals = load_normals(&new_model, j, &num_normals_read);
+    fprintf(stderr, "loaded %d normals\n", num_normals_read);
     uint32_t num_quads_read;
     uint32_t num_tris_read;
     polys_t polys;
@@ -1547,188 +3310,138 @@ void rip_model(iso_t* iso, char* name, size_t model_sector, size_t* animation_se
       num_quads_read * 2 + num_tris_read,
       3 * sizeof(uint32_t)
     );
-    float* texcoords = calloc(
-      6 * (num_quads_read * 2 + num_tris_read),
-      sizeof(float)
-    );
-    float* flat_verts = calloc(
-      6 * num_quads_read + 3 * num_tris_read,
-      3 * sizeof(float));
-    flat_vert_table[j] = flat_verts;
-    flat_vert_counts[j] = 6 * num_quads_read + 3 * num_tris_read;
+    // Every corner is a distinct vertex in the worst case
+    size_t max_corners = 4 * num_quads_read + 3 * num_tris_read;
+    objects[j].positions = calloc(max_corners, sizeof(vertex_t));
+    objects[j].normals = calloc(max_corners, sizeof(vertex_t));
+    objects[j].texels = calloc(max_corners, 2 * sizeof(uint16_t));
+    weld_table_t weld;
+    weld_table_init(&weld, max_corners);
 
     for (int i = 0; i < num_quads_read; i++) {
       face_quad_t* quads = polys.quads;
-      uint8_t this_palette = quads[i].palette;
-      uint8_t this_clut = quads[i].clut;
-      uint8_t this_cmd = quads[i].cmd_upper == 0 ? 0 : 0x80;
-      uint16_t pal_clut_packed =
-        (this_clut << 8) |
-        this_palette |
-        (this_cmd << 8);
-      int palette_is_new = 1;
-      int pal;
-      for (pal = 0; pal < exported_palettes_count; pal++) {
-        if (exported_palettes[pal] == pal_clut_packed) {
-          palette_is_new = 0;
-          break;
-        }
+      int pal = palette_slot(&palette_slots, quads[i].palette, quads[i].clut, quads[i].cmd_upper);
+
+      uint32_t c = weld_corner(&weld, verts, normals, quads[i].vertex_c, quads[i].normal_c, quads[i].tex_c_x, quads[i].tex_c_y, pal, &objects[j]);
+      uint32_t b = weld_corner(&weld, verts, normals, quads[i].vertex_b, quads[i].normal_b, quads[i].tex_b_x, quads[i].tex_b_y, pal, &objects[j]);
+      uint32_t a = weld_corner(&weld, verts, normals, quads[i].vertex_a, quads[i].normal_a, quads[i].tex_a_x, quads[i].tex_a_y, pal, &objects[j]);
+      uint32_t d = weld_corner(&weld, verts, normals, quads[i].vertex_d, quads[i].normal_d, quads[i].tex_d_x, quads[i].tex_d_y, pal, &objects[j]);
+      // Triangles are grouped as semi-transparent quads, semi-transparent
+      // tris, opaque quads, opaque tris
+      uint32_t* out = &flat_tris[6 * i];
+      if (i >= polys.semi_transparent_quad_count) {
+        out += 3 * polys.semi_transparent_tri_count;
       }
-      if (palette_is_new) {
-        if (exported_palettes_count >= 32) {
-          die("Too many palettes referenced in file!");
-        }
-        exported_palettes[exported_palettes_count++] = pal_clut_packed;
-        fprintf(stderr,
-          "Encountered new palette %04x (y=%02x, x=%02x, t=%02x)\n",
-          pal_clut_packed,
-          pal_clut_packed >> 6,
-          pal_clut_packed & 0x3f,
-          (pal_clut_packed >> 8) & 0x80);
-      }
-
-      int tex_page_x = pal % 8;
-      int tex_page_y = pal / 8;
-      float tex_offs_x = (float) tex_page_x / 8;
-      float tex_offs_y = (float) tex_page_y / 4;
-
-      // Slightly adjust the UV coordinates to make sampling of texels
-      // more consistent
-      float e = 0.0001;
-      texcoords[12 * i +  0] = quads[i].tex_c_x / 1024.0 + tex_offs_x + e;
-      texcoords[12 * i +  1] = quads[i].tex_c_y / 1024.0 + tex_offs_y + e;
-      texcoords[12 * i +  2] = quads[i].tex_b_x / 1024.0 + tex_offs_x + e;
-      texcoords[12 * i +  3] = quads[i].tex_b_y / 1024.0 + tex_offs_y + e;
-      texcoords[12 * i +  4] = quads[i].tex_a_x / 1024.0 + tex_offs_x + e;
-      texcoords[12 * i +  5] = quads[i].tex_a_y / 1024.0 + tex_offs_y + e;
-      texcoords[12 * i +  6] = quads[i].tex_b_x / 1024.0 + tex_offs_x + e;
-      texcoords[12 * i +  7] = quads[i].tex_b_y / 1024.0 + tex_offs_y + e;
-      texcoords[12 * i +  8] = quads[i].tex_c_x / 1024.0 + tex_offs_x + e;
-      texcoords[12 * i +  9] = quads[i].tex_c_y / 1024.0 + tex_offs_y + e;
-      texcoords[12 * i + 10] = quads[i].tex_d_x / 1024.0 + tex_offs_x + e;
-      texcoords[12 * i + 11] = quads[i].tex_d_y / 1024.0 + tex_offs_y + e;
-      flat_verts[18 * i +  0] = -verts[quads[i].vertex_c].x / 4096.0;
-      flat_verts[18 * i +  1] = -verts[quads[i].vertex_c].y / 4096.0;
-      flat_verts[18 * i +  2] = verts[quads[i].vertex_c].z / 4096.0;
-      flat_verts[18 * i +  3] = -verts[quads[i].vertex_b].x / 4096.0;
-      flat_verts[18 * i +  4] = -verts[quads[i].vertex_b].y / 4096.0;
-      flat_verts[18 * i +  5] = verts[quads[i].vertex_b].z / 4096.0;
-      flat_verts[18 * i +  6] = -verts[quads[i].vertex_a].x / 4096.0;
-      flat_verts[18 * i +  7] = -verts[quads[i].vertex_a].y / 4096.0;
-      flat_verts[18 * i +  8] = verts[quads[i].vertex_a].z / 4096.0;
-      flat_verts[18 * i +  9] = -verts[quads[i].vertex_b].x / 4096.0;
-      flat_verts[18 * i + 10] = -verts[quads[i].vertex_b].y / 4096.0;
-      flat_verts[18 * i + 11] = verts[quads[i].vertex_b].z / 4096.0;
-      flat_verts[18 * i + 12] = -verts[quads[i].vertex_c].x / 4096.0;
-      flat_verts[18 * i + 13] = -verts[quads[i].vertex_c].y / 4096.0;
-      flat_verts[18 * i + 14] = verts[quads[i].vertex_c].z / 4096.0;
-      flat_verts[18 * i + 15] = -verts[quads[i].vertex_d].x / 4096.0;
-      flat_verts[18 * i + 16] = -verts[quads[i].vertex_d].y / 4096.0;
-      flat_verts[18 * i + 17] = verts[quads[i].vertex_d].z / 4096.0;
-      flat_tris[6 * i + 0] = 6 * i + 0;
-      flat_tris[6 * i + 1] = 6 * i + 1;
-      flat_tris[6 * i + 2] = 6 * i + 2;
-      flat_tris[6 * i + 3] = 6 * i + 3;
-      flat_tris[6 * i + 4] = 6 * i + 4;
-      flat_tris[6 * i + 5] = 6 * i + 5;
+      out[0] = c;
+      out[1] = b;
+      out[2] = a;
+      out[3] = b;
+      out[4] = c;
+      out[5] = d;
     }
     for (int i = 0; i < num_tris_read; i++) {
       face_tri_t* tris = polys.tris;
-      uint8_t this_palette = tris[i].palette;
-      uint8_t this_clut = tris[i].clut;
-      uint8_t this_cmd = tris[i].cmd_upper == 0 ? 0 : 0x80;
-      uint16_t pal_clut_packed =
-        (this_clut << 8) |
-        this_palette |
-        (this_cmd << 8);
-      int palette_is_new = 1;
-      int pal;
-      for (pal = 0; pal < exported_palettes_count; pal++) {
-        if (exported_palettes[pal] == pal_clut_packed) {
-          palette_is_new = 0;
-          break;
-        }
-      }
-      if (palette_is_new) {
-        if (exported_palettes_count >= 32) {
-          die("Too many palettes referenced in file!");
-        }
-        exported_palettes[exported_palettes_count++] = pal_clut_packed;
-        fprintf(stderr,
-          "Encountered new palette %04x (y=%02x, x=%02x, t=%02x)\n",
-          pal_clut_packed,
-          pal_clut_packed >> 6,
-          pal_clut_packed & 0x3f,
-          (pal_clut_packed >> 8) & 0x80);
+      int pal = palette_slot(&palette_slots, tris[i].palette, tris[i].clut, tris[i].cmd_upper);
+
+      uint32_t a = weld_corner(&weld, verts, normals, tris[i].vertex_a, tris[i].normal_a, tris[i].tex_a_x, tris[i].tex_a_y, pal, &objects[j]);
+      uint32_t c = weld_corner(&weld, verts, normals, tris[i].vertex_c, tris[i].normal_c, tris[i].tex_c_x, tris[i].tex_c_y, pal, &objects[j]);
+      uint32_t b = weld_corner(&weld, verts, normals, tris[i].vertex_b, tris[i].normal_b, tris[i].tex_b_x, tris[i].tex_b_y, pal, &objects[j]);
+      uint32_t* out = &flat_tris[3 * i];
+      if (i < polys.semi_transparent_tri_count) {
+        out += 6 * polys.semi_transparent_quad_count;
+      } else {
+        out += 6 * num_quads_read;
       }
-
-      int tex_page_x = pal % 8;
-      int tex_page_y = pal / 8;
-      float tex_offs_x = (float) tex_page_x / 8;
-      float tex_offs_y = (float) tex_page_y / 4;
-
-      // Slightly adjust the UV coordinates to make sampling of texels
-      // more consistent
-      float e = 0.0001;
-      texcoords[6 * i + 0 + (12 * num_quads_read)] = tris[i].tex_a_x / 1024.0 + tex_offs_x + e;
-      texcoords[6 * i + 1 + (12 * num_quads_read)] = tris[i].tex_a_y / 1024.0 + tex_offs_y + e;
-      texcoords[6 * i + 2 + (12 * num_quads_read)] = tris[i].tex_c_x / 1024.0 + tex_offs_x + e;
-      texcoords[6 * i + 3 + (12 * num_quads_read)] = tris[i].tex_c_y / 1024.0 + tex_offs_y + e;
-      texcoords[6 * i + 4 + (12 * num_quads_read)] = tris[i].tex_b_x / 1024.0 + tex_offs_x + e;
-      texcoords[6 * i + 5 + (12 * num_quads_read)] = tris[i].tex_b_y / 1024.0 + tex_offs_y + e;
-      size_t this_tri_offset = 18 * num_quads_read + 9 * i;
-      flat_verts[this_tri_offset + 0] = -verts[tris[i].vertex_a].x / 4096.0;
-      flat_verts[this_tri_offset + 1] = -verts[tris[i].vertex_a].y / 4096.0;
-      flat_verts[this_tri_offset + 2] = verts[tris[i].vertex_a].z / 4096.0;
-      flat_verts[this_tri_offset + 3] = -verts[tris[i].vertex_c].x / 4096.0;
-      flat_verts[this_tri_offset + 4] = -verts[tris[i].vertex_c].y / 4096.0;
-      flat_verts[this_tri_offset + 5] = verts[tris[i].vertex_c].z / 4096.0;
-      flat_verts[this_tri_offset + 6] = -verts[tris[i].vertex_b].x / 4096.0;
-      flat_verts[this_tri_offset + 7] = -verts[tris[i].vertex_b].y / 4096.0;
-      flat_verts[this_tri_offset + 8] = verts[tris[i].vertex_b].z / 4096.0;
-      flat_tris[3 * i + 0 + (6 * num_quads_read)] = 3 * i + 0 + (6 * num_quads_read);
-      flat_tris[3 * i + 1 + (6 * num_quads_read)] = 3 * i + 1 + (6 * num_quads_read);
-      flat_tris[3 * i + 2 + (6 * num_quads_read)] = 3 * i + 2 + (6 * num_quads_read);
+      out[0] = a;
+      out[1] = c;
+      out[2] = b;
     }
     free(polys.quads);
     free(polys.tris);
-    flat_tri_table[j] = flat_tris;
-    flat_tri_counts[j] = 2 * num_quads_read + num_tris_read;
-    texcoord_table[j] = texcoords;
-    texcoord_counts[j] = num_quads_read * 6 + num_tris_read * 3;
+    fprintf(stderr, "welded %zu corners into %u vertices\n",
+      max_corners, weld.count);
+    objects[j].indices = flat_tris;
+    objects[j].triangle_count = 2 * num_quads_read + num_tris_read;
+    objects[j].semi_transparent_triangle_count =
+      2 * polys.semi_transparent_quad_count + polys.semi_transparent_tri_count;
+    if (bake && export_options.gte_bake) {
+      uint32_t flags = pose_vertices_gte(&animation[0], 0, export_options.bake_frame,
+        new_model.node_tree, new_model.object_count, j, objects[j].positions, objects[j].vertex_count, 1);
+      flags |= pose_vertices_gte(&animation[0], 0, export_options.bake_frame,
+        new_model.node_tree, new_model.object_count, j, objects[j].normals, objects[j].vertex_count, 0);
+      if (flags) {
+        fprintf(stderr, "posing object %d saturated the GTE, FLAG %08x\n", j, flags);
+      }
+    } else if (bake) {
+      float* transform = &pose[12 * j];
+      transform_vertices(objects[j].positions, objects[j].positions, objects[j].vertex_count, transform);
+      float rotation[12];
+      memcpy(rotation, transform, 9 * sizeof(float));
+      memset(&rotation[9], 0, 3 * sizeof(float));
+      transform_vertices(objects[j].normals, objects[j].normals, objects[j].vertex_count, rotation);
+    }
+    optimize_object_mesh(&objects[j]);
+    if (export_options.meshlets) {
+      build_object_meshlets(&objects[j]);
+    }
+    build_object_lods(&objects[j]);
+    weld_table_free(&weld);
     texcoords_seen += num_quads_read * 4 + num_tris_read * 3;
     verts_seen += num_read;
     free(verts);
+    free(normals);
   }
   fprintf(stderr, "loading texture\n");
   paletted_texture_t tex = load_texture(&new_model);
   fprintf(stderr, "loaded texture\n");
-  for (int pal = 0; pal < exported_palettes_count; pal++) {
-    uint16_t clut = exported_palettes[pal];
-    fprintf(stderr, "Loading the texture with %02x,%02x\n", clut & 0x3f, clut >> 6);
-    size_t offset_x = 128 * (pal % 8);
-    size_t offset_y = 256 * (pal / 8);
-    blit_to_png_write_buffer(&tex, clut & 0x3f, clut >> 6, clut & 0x8000, offset_x, offset_y);
+  if (export_options.palette_swap) {
+    build_palette_swap_textures(objects, new_model.object_count, &tex, &palette_slots);
+  } else {
+    // A skinned export is a single primitive, which can only use one page
+    atlas_page_count = 1;
+    if (export_options.paletted && !export_options.skinned) {
+      atlas_page_count = assign_atlas_pages(objects, new_model.object_count, &tex, &palette_slots);
+    }
+    atlas_pages = calloc(atlas_page_count, sizeof(atlas_page_t));
+    for (size_t page = 0; page < atlas_page_count; page++) {
+      if (export_options.tight_atlas) {
+        build_tight_atlas(objects, new_model.object_count, page, &tex, &palette_slots);
+      } else {
+        build_grid_atlas(objects, new_model.object_count, page, &tex, &palette_slots);
+      }
+      for (int i = 0; i < new_model.object_count; i++) {
+        if (objects[i].page == page) {
+          objects[i].has_cutout = object_has_cutout(&objects[i]);
+        }
+      }
+      atlas_pages[page] = encode_atlas_page();
+      if (atlas_pages[page].ktx2) {
+        write_ktx2_file(name, page, &atlas_pages[page]);
+      }
+      free(png_write_buffer);
+    }
   }
   free(tex.texture);
-  png_alloc_size_t png_alloc = save_png_write_buffer();
   make_epic_gltf_file(
     name,
-    flat_vert_table,
-    flat_vert_counts,
-    flat_tri_table,
-    flat_tri_counts,
-    texcoord_table,
-    texcoord_counts,
+    objects,
     animation,
-    animation_file_count,
+    bake ? 0 : animation_file_count,
     animation_labels,
     new_model.node_tree,
     new_model.object_count,
-    png_alloc,
     new_model.blink,
     new_model.blink_count
   );
+  palette_slots_free(&palette_slots);
+  for (size_t page = 0; page < atlas_page_count; page++) {
+    free(atlas_pages[page].png);
+    free(atlas_pages[page].ktx2);
+    free(atlas_pages[page].png_uri);
+    free(atlas_pages[page].ktx2_uri);
+  }
+  free(atlas_pages);
+  free(clut_strip.png);
   free(new_model.skeleton);
   free(new_model.node_tree);
   free(new_model.vertex_offsets);
@@ -1736,9 +3449,15 @@ void rip_model(iso_t* iso, char* name, size_t model_sector, size_t* animation_se
   free(new_model.face_offsets);
 
   for (int i = 0; i < new_model.object_count; i++) {
-    free(flat_vert_table[i]);
-    free(flat_tri_table[i]);
-    free(texcoord_table[i]);
+    free(objects[i].positions);
+    free(objects[i].normals);
+    free(objects[i].texels);
+    free(objects[i].palette_rows);
+    free(objects[i].indices);
+    free_meshlets(&objects[i].meshlets);
+    for (int level = 1; level < export_options.lod_levels; level++) {
+      free(objects[i].lods[level - 1].indices);
+    }
   }
 
   for (int i = 0; i < animation_file_count; i++) {
@@ -1746,12 +3465,128 @@ void rip_model(iso_t* iso, char* name, size_t model_sector, size_t* animation_se
   }
 }
 
+#define USAGE "Usage: ./rip_model [-q] [-s] [-m] [-n] [-a] [-p] [-k] [-c] [-d] [-r] [-t] [-x] [-z LEVEL] [-l LEVELS] [-e ERROR] [-f ERROR] [-g DEGREES] [-b FRAME] ROM MODEL_TABLE\n" \
+  "  -q  quantized geometry (KHR_mesh_quantization)\n" \
+  "  -s  one skinned mesh instead of a mesh per object\n" \
+  "  -m  meshlet tables for mesh shaders\n" \
+  "  -n  octahedral 16-bit normals in _NORMAL_OCT instead of NORMAL\n" \
+  "  -a  tight texture atlas of only the texels faces use\n" \
+  "  -p  8-bit paletted PNG textures, split by object past 256 colours\n" \
+  "  -k  also write BC1/BC3 KTX2 texture files, named in texture extras\n" \
+  "  -c  CLUT index texture and CLUT strip instead of an atlas\n" \
+  "  -d  share identical buffers and textures between models in ./" STORE_DIR "\n" \
+  "  -r  only write the frames where an object's keyframe changes\n" \
+  "  -t  drop rest pose channels, single key constant ones, int16 rotations\n" \
+  "  -x  pose -b with the GTE's fixed point arithmetic\n" \
+  "  -z  PNG compression level, 0 (stored) to 9, deflated in parallel\n" \
+  "  -l  number of detail levels, 1 to 4 (MSFT_lod)\n" \
+  "  -e  error allowed for the first simplified level, relative to object size\n" \
+  "  -f  fit LINEAR animation keys, within this world space distance\n" \
+  "  -g  rotation and scale error allowed by -f, in degrees (default 0.5)\n" \
+  "  -b  pose the meshes at this frame of the first animation, no animations"
+
 int main(int argc, char** argv) {
-  if (argc < 2) {
-    die("Usage: ./rip_model.c ROM MODEL_TABLE");
+  int opt;
+  while ((opt = getopt(argc, argv, "qsmnapkcdrtxz:l:e:f:g:b:")) != -1) {
+    switch (opt) {
+      case 'q':
+        export_options.quantize = 1;
+        break;
+      case 's':
+        export_options.skinned = 1;
+        break;
+      case 'm':
+        export_options.meshlets = 1;
+        break;
+      case 'n':
+        export_options.octahedral_normals = 1;
+        break;
+      case 'a':
+        export_options.tight_atlas = 1;
+        break;
+      case 'p':
+        export_options.paletted = 1;
+        break;
+      case 'k':
+        export_options.ktx2 = 1;
+        break;
+      case 'c':
+        export_options.palette_swap = 1;
+        break;
+      case 'd':
+        export_options.shared_store = 1;
+        break;
+      case 'r':
+        export_options.keyframes_only = 1;
+        break;
+      case 't':
+        export_options.compress_tracks = 1;
+        break;
+      case 'z':
+        export_options.png_level = atoi(optarg);
+        if (export_options.png_level < 0 || export_options.png_level > 9) {
+          die(USAGE);
+        }
+        break;
+      case 'l':
+        export_options.lod_levels = atoi(optarg);
+        if (export_options.lod_levels < 1 || export_options.lod_levels > MAX_LOD_LEVELS) {
+          die(USAGE);
+        }
+        break;
+      case 'e':
+        export_options.lod_error = atof(optarg);
+        if (export_options.lod_error <= 0) {
+          die(USAGE);
+        }
+        break;
+      case 'f':
+        export_options.fit_position_error = atof(optarg);
+        if (export_options.fit_position_error <= 0) {
+          die(USAGE);
+        }
+        break;
+      case 'g':
+        export_options.fit_angle_error = atof(optarg);
+        if (export_options.fit_angle_error <= 0) {
+          die(USAGE);
+        }
+        break;
+      case 'x':
+        export_options.gte_bake = 1;
+        break;
+      case 'b':
+        export_options.bake_frame = atoi(optarg);
+        if (export_options.bake_frame < 0) {
+          die(USAGE);
+        }
+        break;
+      default:
+        die(USAGE);
+    }
+  }
+  // The index texture and CLUT strip replace the atlas these options shape
+  if (export_options.palette_swap) {
+    export_options.tight_atlas = 0;
+    export_options.paletted = 0;
+    export_options.ktx2 = 0;
+  }
+  // Fitted keys already skip every frame that -r would
+  if (export_options.fit_position_error > 0) {
+    export_options.keyframes_only = 0;
   }
+  // -x only changes how -b poses
+  if (argc - optind < 2 || (export_options.gte_bake && export_options.bake_frame < 0)) {
+    die(USAGE);
+  }
+  if (export_options.shared_store) {
+    mkdir(STORE_DIR, 0700);
+  }
+  char* rom_path = argv[optind];
+  char* model_table_path = argv[optind + 1];
+
   FILE* fp;
-  fp = fopen(argv[1], "r");
+  fp = fopen(rom_path, "r");
   if (!fp) {
     die("Failed to open file");
   }
@@ -1760,7 +3595,7 @@ int main(int argc, char** argv) {
   iso_open(&iso, fp);
 
   FILE* model_table_fp;
-  model_table_fp = fopen(argv[2], "r");
+  model_table_fp = fopen(model_table_path, "r");
   if (!model_table_fp) {
     die("Failed to open model table file");
   }
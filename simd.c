@@ -0,0 +1,3 @@
+#include "simd.h"
+
+int simd_limit = SIMD_256;
@@ -0,0 +1,8 @@
+// How wide the vector kernels may go. Each module runs the widest kernel
+// that both the CPU and simd_limit allow, so the benchmarks and tests can
+// also run the narrower ones on the same machine.
+#define SIMD_SCALAR 0
+#define SIMD_128 1 // SSSE3, SSE4.1 or NEON
+#define SIMD_256 2 // AVX2
+
+extern int simd_limit;
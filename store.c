@@ -0,0 +1,139 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "store.h"
+
+// A directory of files named by a 64-bit key, shared by every model of a
+// batch. Models reference the files by relative URI, so the store sits next
+// to the model directories.
+
+#define PRIME64_1 0x9e3779b185ebca87ull
+#define PRIME64_2 0xc2b2ae3d27d4eb4full
+#define PRIME64_3 0x165667b19e3779f9ull
+#define PRIME64_4 0x85ebca77c2b2ae63ull
+#define PRIME64_5 0x27d4eb2f165667c5ull
+
+static uint64_t rotl64(uint64_t x, int r) {
+  return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t read64(const uint8_t* p) {
+  uint64_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static uint32_t read32(const uint8_t* p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static uint64_t hash_round(uint64_t acc, uint64_t input) {
+  acc += input * PRIME64_2;
+  return rotl64(acc, 31) * PRIME64_1;
+}
+
+static uint64_t hash_merge(uint64_t acc, uint64_t v) {
+  acc ^= hash_round(0, v);
+  return acc * PRIME64_1 + PRIME64_4;
+}
+
+// XXH64 of bytes. Reads four independent lanes of 8 bytes per step, so it
+// runs at memory speed on texture sized inputs.
+uint64_t store_hash(const void* bytes, size_t size, uint64_t seed) {
+  const uint8_t* p = bytes;
+  const uint8_t* end = p + size;
+  uint64_t h;
+  if (size >= 32) {
+    uint64_t v1 = seed + PRIME64_1 + PRIME64_2;
+    uint64_t v2 = seed + PRIME64_2;
+    uint64_t v3 = seed;
+    uint64_t v4 = seed - PRIME64_1;
+    for (; p + 32 <= end; p += 32) {
+      v1 = hash_round(v1, read64(p));
+      v2 = hash_round(v2, read64(p + 8));
+      v3 = hash_round(v3, read64(p + 16));
+      v4 = hash_round(v4, read64(p + 24));
+    }
+    h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+    h = hash_merge(h, v1);
+    h = hash_merge(h, v2);
+    h = hash_merge(h, v3);
+    h = hash_merge(h, v4);
+  } else {
+    h = seed + PRIME64_5;
+  }
+  h += size;
+  for (; p + 8 <= end; p += 8) {
+    h ^= hash_round(0, read64(p));
+    h = rotl64(h, 27) * PRIME64_1 + PRIME64_4;
+  }
+  if (p + 4 <= end) {
+    h ^= read32(p) * PRIME64_1;
+    h = rotl64(h, 23) * PRIME64_2 + PRIME64_3;
+    p += 4;
+  }
+  for (; p < end; p++) {
+    h ^= *p * PRIME64_5;
+    h = rotl64(h, 11) * PRIME64_1;
+  }
+  h ^= h >> 33;
+  h *= PRIME64_2;
+  h ^= h >> 29;
+  h *= PRIME64_3;
+  h ^= h >> 32;
+  return h;
+}
+
+static char* store_path(const char* dir, uint64_t key, const char* extension, const char* prefix) {
+  size_t length = strlen(prefix) + strlen(dir) + strlen(extension) + 19;
+  char* path = malloc(length);
+  snprintf(path, length, "%s%s/%016llx.%s", prefix, dir, (unsigned long long) key, extension);
+  return path;
+}
+
+// Returns 1 if dir holds the file for key, and its size if size isn't NULL
+int store_lookup(const char* dir, uint64_t key, const char* extension, size_t* size) {
+  char* path = store_path(dir, key, extension, "");
+  struct stat st;
+  int found = stat(path, &st) == 0;
+  free(path);
+  if (found && size) {
+    *size = st.st_size;
+  }
+  return found;
+}
+
+// Writes the file for key. It's written under a temporary name and renamed
+// into place, so an interrupted batch never leaves a truncated file that
+// later lookups would take as a hit. Returns 0 on failure.
+int store_put(const char* dir, uint64_t key, const char* extension, const void* bytes, size_t size) {
+  char* path = store_path(dir, key, extension, "");
+  size_t temp_length = strlen(path) + 24;
+  char* temp = malloc(temp_length);
+  snprintf(temp, temp_length, "%s.%ld.tmp", path, (long) getpid());
+  int ok = 0;
+  FILE* fp = fopen(temp, "wb");
+  if (fp) {
+    ok = fwrite(bytes, 1, size, fp) == size;
+    ok = fclose(fp) == 0 && ok;
+    ok = ok && rename(temp, path) == 0;
+    if (!ok) {
+      remove(temp);
+    }
+  }
+  free(temp);
+  free(path);
+  return ok;
+}
+
+// The file for key as a URI relative to a model directory next to the store
+char* store_uri(const char* dir, uint64_t key, const char* extension) {
+  return store_path(dir, key, extension, "../");
+}
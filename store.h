@@ -0,0 +1,7 @@
+#include <stddef.h>
+#include <stdint.h>
+
+uint64_t store_hash(const void* bytes, size_t size, uint64_t seed);
+int store_lookup(const char* dir, uint64_t key, const char* extension, size_t* size);
+int store_put(const char* dir, uint64_t key, const char* extension, const void* bytes, size_t size);
+char* store_uri(const char* dir, uint64_t key, const char* extension);